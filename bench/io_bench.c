@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+#define CHUNK (1 << 20)         // bytes moved by one ext2_pwrite
+#define READ_CHUNK 65536        // bytes moved by one ext2_pread
+#define FILE_CHUNKS 60          // size of the file written, in chunks
+
+// Returns the time in seconds
+static double now() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Prints the virtual size and the peak resident size of this process
+static void print_memory() {
+
+    char line[256];
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if(status == NULL)
+        return;
+    while(fgets(line, sizeof(line), status) != NULL) {
+        if(strncmp(line, "VmSize", 6) == 0 || strncmp(line, "VmHWM", 5) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            printf("  %s", line);
+        }
+    }
+    fclose(status);
+}
+
+// Writes a 60 MB file /big through the file API ("write"), or reads it
+// back the given number of times ("read"), and reports the time taken and
+// the memory used. The backend is the one EXT2_IO picks.
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    int writing = argc == 3 && strcmp(argv[2], "write") == 0;
+    int passes = argc == 4 && strcmp(argv[2], "read") == 0 ? atoi(argv[3]) : 0;
+
+    if(writing == 0 && passes <= 0) {
+        fprintf(stderr, "Usage: io_bench <image file name> write | read <passes>\n");
+        return -1;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[1], writing ? O_RDWR : O_RDONLY) == -1) {
+        return -1;
+    }
+
+    unsigned char *buf = malloc(CHUNK);
+    if(buf == NULL) {
+        perror("malloc");
+        return ENOMEM;
+    }
+
+    /* Move the file's data */
+
+    struct ext2_file *file;
+    unsigned long long total = 0;
+    double start = now();
+    ssize_t n;
+    off_t offset;
+    int i;
+
+    if(writing) {
+        file = ext2_open("/big", O_RDWR | O_CREAT);
+        if(file == NULL) {
+            perror("/big");
+            return errno;
+        }
+        memset(buf, 7, CHUNK);
+        for(i = 0; i < FILE_CHUNKS; i++) {
+            if(ext2_pwrite(file, buf, CHUNK, (off_t)i * CHUNK) != CHUNK) {
+                perror("ext2_pwrite");
+                return EIO;
+            }
+            total += CHUNK;
+        }
+        ext2_close(file);
+        if(sync_image() == -1)
+            return EIO;
+    }
+    else {
+        for(i = 0; i < passes; i++) {
+            file = ext2_open("/big", O_RDONLY);
+            if(file == NULL) {
+                perror("/big");
+                return errno;
+            }
+            for(offset = 0; (n = ext2_pread(file, buf, READ_CHUNK, offset)) > 0; offset += n)
+                total += n;
+            ext2_close(file);
+            checkpoint_image();
+        }
+    }
+
+    /* Report the time and memory */
+
+    double elapsed = now() - start;
+
+    printf("%-6s %s  %.3f s  %.0f MB/s", getenv("EXT2_IO") != NULL ? getenv("EXT2_IO") : "mmap", \
+           writing ? "write" : "read ", elapsed, total / elapsed / 1e6);
+    print_memory();
+    printf("\n");
+    free(buf);
+    return 0;
+}
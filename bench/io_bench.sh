@@ -0,0 +1,39 @@
+#!/bin/bash
+# Compares the mmap and pread backends (EXT2_IO) on a 20M-block image:
+# writing a 60 MB file and reading it back five times through the file
+# API, then 1000 runs of ext2_cp on a 400000-block image.
+# Usage: io_bench.sh [directory of the tools] [scratch directory]
+
+BIN=${1:-.}
+WORK=${2:-/tmp/ext2_bench}
+
+mkdir -p "$WORK" || exit 1
+TIMEFORMAT="%R s"
+
+# Making the image in two steps is quicker than one ext2_mkfs of 20M blocks
+rm -f "$WORK/io.img"
+"$BIN/ext2_mkfs" "$WORK/io.img" 2000000 >/dev/null || exit 1
+"$BIN/ext2_resize" "$WORK/io.img" 20000000 >/dev/null || exit 1
+
+echo "File API, 60 MB file on a 20M-block image:"
+for backend in mmap pread; do
+    cp --sparse=always "$WORK/io.img" "$WORK/io.$backend.img"
+    EXT2_IO=$backend "$BIN/bench/io_bench" "$WORK/io.$backend.img" write
+    EXT2_IO=$backend "$BIN/bench/io_bench" "$WORK/io.$backend.img" read 5
+done
+cmp -s "$WORK/io.mmap.img" "$WORK/io.pread.img" || echo "The backends wrote different images"
+rm -f "$WORK/io.img" "$WORK/io.mmap.img" "$WORK/io.pread.img"
+
+echo "1000 x ext2_cp of a 3000-byte file:"
+head -c 3000 /dev/urandom > "$WORK/small"
+for backend in mmap pread; do
+    rm -f "$WORK/cp.img"
+    "$BIN/ext2_mkfs" "$WORK/cp.img" 400000 >/dev/null || exit 1
+    "$BIN/ext2_mkdir" "$WORK/cp.img" /d || exit 1
+    printf "%-6s " $backend
+    time (i=0; while [ $i -lt 1000 ]; do
+        EXT2_IO=$backend "$BIN/ext2_cp" "$WORK/cp.img" "$WORK/small" /d/f$i || exit 1
+        i=$((i + 1))
+    done)
+done
+rm -f "$WORK/cp.img" "$WORK/small"
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+# Sends EXT2D_LOOKUP requests to an ext2d all at once, then reads the
+# replies, and prints the time per lookup.
+#   lookup.py <socket> <directory> <files> <hits> <misses>
+# <hits> names are picked at random among file000000 to the last of
+# <files> (as make_record.py fill names them), and <misses> names that do
+# not exist follow them.
+
+import random
+import socket
+import struct
+import sys
+import time
+
+EXT2D_LOOKUP = 1
+
+sock = socket.socket(socket.AF_UNIX)
+sock.connect(sys.argv[1])
+directory = sys.argv[2].encode().rstrip(b'/')
+files, hits, misses = (int(arg) for arg in sys.argv[3:6])
+
+random.seed(1)
+names = [b'file%06d' % random.randrange(files) for _ in range(hits)]
+names += [b'missing%d' % i for i in range(misses)]
+
+def request(path):
+    # struct ext2d_request, then the path
+    return struct.pack('<HHHHIIQ', EXT2D_LOOKUP, len(path), 0, 0, 0, 0, 0) + path
+
+def receive(size):
+    data = b''
+    while len(data) < size:
+        data += sock.recv(size - len(data))
+    return data
+
+start = time.time()
+sock.sendall(b''.join(request(directory + b'/' + name) for name in names))
+found = 0
+for name in names:
+    # struct ext2d_reply, then its data
+    _, result, size, _ = struct.unpack('<IiII', receive(16))
+    receive(size)
+    found += result == 0
+elapsed = time.time() - start
+
+print('%6d lookups  %.3f s  %.1f us each  %d found' % (len(names), elapsed, elapsed / len(names) * 1e6, found))
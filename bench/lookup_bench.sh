@@ -0,0 +1,42 @@
+#!/bin/bash
+# Measures name lookups in large directories:
+# - ext2_replay filling a directory with 20000 files on a 400000-block image
+# - EXT2D_LOOKUP of 3000 existing and then 1000 missing names in it, sent
+#   to ext2d all at once
+# - ext2_replay of 60000 creates, removes, restores and links spread over
+#   four directories on a 200000-block image
+# Usage: lookup_bench.sh [directory of the tools] [scratch directory]
+
+BIN=${1:-.}
+WORK=${2:-/tmp/ext2_bench}
+BENCH=$(dirname "$0")
+
+mkdir -p "$WORK" || exit 1
+TIMEFORMAT="%R s"
+
+python3 "$BENCH/make_record.py" "$WORK/fill.rec" fill 20000 || exit 1
+python3 "$BENCH/make_record.py" "$WORK/churn.rec" churn 9 60000 || exit 1
+
+rm -f "$WORK/lookup.img" "$WORK/churn.img"
+"$BIN/ext2_mkfs" "$WORK/lookup.img" 400000 120000 >/dev/null || exit 1
+"$BIN/ext2_mkfs" "$WORK/churn.img" 200000 >/dev/null || exit 1
+
+printf "Filling a directory with 20000 files:  "
+time "$BIN/ext2_replay" "$WORK/lookup.img" "$WORK/fill.rec" >/dev/null 2>&1
+
+echo "Lookups in that directory through ext2d:"
+rm -f "$WORK/ext2d.sock"
+"$BIN/ext2d" "$WORK/lookup.img" "$WORK/ext2d.sock" &
+EXT2D=$!
+while [ ! -S "$WORK/ext2d.sock" ] && kill -0 $EXT2D 2>/dev/null; do
+    sleep 0.1
+done
+python3 "$BENCH/lookup.py" "$WORK/ext2d.sock" /big 20000 3000 0
+python3 "$BENCH/lookup.py" "$WORK/ext2d.sock" /big 20000 0 1000
+kill $EXT2D
+wait $EXT2D
+
+printf "Replaying 60000 operations over four directories:  "
+time "$BIN/ext2_replay" "$WORK/churn.img" "$WORK/churn.rec" >/dev/null 2>&1
+
+rm -f "$WORK/fill.rec" "$WORK/churn.rec" "$WORK/lookup.img" "$WORK/churn.img" "$WORK/ext2d.sock"
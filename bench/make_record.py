@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# Writes a record file for ext2_replay (see struct op_record in ext2_ops.h).
+#   make_record.py <record> fill <files>
+#       mkdir /big, then copy <files> empty files file000000... into it
+#   make_record.py <record> churn <seed> <operations>
+#       creates, removes, restores and hard links in four directories of at
+#       most 500 names each, with names of 5 to 60 bytes and files of up to
+#       3000 bytes
+# The recorded results are all 0, so ext2_replay reports the operations
+# that fail; the benchmarks only use its timing.
+
+import random
+import struct
+import sys
+
+RECORD_MAGIC = 0x43455232
+COPY, MKDIR, LINK, SYMLINK, UNLINK, RESTORE = range(6)
+
+out = open(sys.argv[1], 'wb')
+out.write(struct.pack('<I', RECORD_MAGIC))
+
+def record(op, path, arg=b'', size=0):
+    out.write(struct.pack('<HHHHiI', op, len(path), len(arg), 0, 0, size) + path + arg)
+
+if sys.argv[2] == 'fill':
+    record(MKDIR, b'/big')
+    for i in range(int(sys.argv[3])):
+        record(COPY, b'/big/file%06d' % i)
+
+elif sys.argv[2] == 'churn':
+    random.seed(int(sys.argv[3]))
+    dirs = [b'/d%d' % i for i in range(4)]
+    live = {d: [] for d in dirs}
+    dead = {d: [] for d in dirs}
+    for d in dirs:
+        record(MKDIR, d)
+    for n in range(int(sys.argv[4])):
+        d = random.choice(dirs)
+        r = random.random()
+        if r < 0.6 and len(live[d]) < 500:
+            name = b'n%d_' % n + b'x' * random.randint(0, 50)
+            record(COPY, d + b'/' + name, b'', random.randint(0, 3000))
+            live[d].append(name)
+        elif r < 0.85 and live[d]:
+            name = live[d].pop(random.randrange(len(live[d])))
+            record(UNLINK, d + b'/' + name)
+            dead[d].append(name)
+        elif r < 0.92 and dead[d]:
+            name = dead[d].pop(random.randrange(len(dead[d])))
+            record(RESTORE, d + b'/' + name)
+            live[d].append(name)
+        elif live[d]:
+            name = random.choice(live[d])
+            record(LINK, d + b'/L%d' % n, d + b'/' + name)
+            live[d].append(b'L%d' % n)
+
+else:
+    sys.exit('Usage: make_record.py <record> fill <files> | churn <seed> <operations>')
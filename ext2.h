@@ -86,7 +86,7 @@ struct ext2_super_block {
 	 */
 	unsigned char  s_prealloc_blocks;     /* Nr of blocks to try to preallocate*/
 	unsigned char  s_prealloc_dir_blocks; /* Nr to preallocate for dirs */
-	unsigned short s_padding1;
+	unsigned short s_reserved_gdt_blocks; /* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -103,6 +103,15 @@ struct ext2_super_block {
 	unsigned int   s_reserved[190]; /* Padding to the end of the block */
 };
 
+#define    EXT2_SUPER_MAGIC   0xEF53
+#define    EXT2_DYNAMIC_REV   1       /* s_rev_level with variable inode sizes */
+#define    EXT2_VALID_FS      0x0001  /* s_state: cleanly unmounted */
+#define    EXT2_ERROR_FS      0x0002  /* s_state: errors detected */
+
+#define    EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define    EXT2_FEATURE_RO_COMPAT_GDT_CSUM     0x0010  /* bg_checksum and bg_itable_unused are valid */
+
 
 /*
  * Structure of a blocks group descriptor
@@ -115,11 +124,18 @@ struct ext2_group_desc
 	unsigned short bg_free_blocks_count; /* Free blocks count */
 	unsigned short bg_free_inodes_count; /* Free inodes count */
 	unsigned short bg_used_dirs_count;   /* Directories count */
-	/* The pad and reserved fields should be 0 for the assignment. */
-	unsigned short bg_pad;
-	unsigned int   bg_reserved[3];
+	unsigned short bg_flags;             /* EXT2_BG_* flags */
+	unsigned int   bg_reserved[2];
+	unsigned short bg_itable_unused;     /* Uninitialized inodes at the end of the table */
+	unsigned short bg_checksum;
 };
 
+/*
+ * Block group flags (same values as ext4's uninit_bg)
+ */
+#define    EXT2_BG_INODE_ZEROED  0x0004  /* Inode table is fully initialized */
+#define    EXT2_BG_DIRTY         0x0100  /* Changed since ext2_checker last checked it (not an ext4 flag) */
+
 
 /*
  * Structure of an inode on the disk
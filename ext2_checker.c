@@ -8,93 +8,123 @@
 #include <unistd.h>
 #include "ext2.h"
 #include "ext2_helper.h"
-
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
-unsigned char *block_bitmap;
-unsigned char *inode_bitmap;
-struct ext2_inode *inode_table;
+#include "ext2_stats.h"
+#include "ext2_csum.h"
 
 int main(int argc, char *argv[]){
 
-    if(argc != 2) {
-        fprintf(stderr, "Usage: ext2_checker <image file name>\n");
-        return -1;
+    int force = 0;          // -f: check the whole image even if it is clean
+    int init_csum = 0;
+    int verify_csum = 0;
+    int arg;
+
+    for(arg = 1; arg < argc - 1; arg++) {
+        if(strcmp(argv[arg], "-f") == 0)
+            force = 1;
+        else if(strcmp(argv[arg], "--init-csum") == 0)
+            init_csum = 1;
+        else if(strcmp(argv[arg], "--verify-csum") == 0)
+            verify_csum = 1;
+        else
+            break;
     }
 
-    /* Intiailize disk and other structures */
-
-    int image_fd = open(argv[1], O_RDWR);
-    if(image_fd == -1) {
-        perror("open");
+    if(argc < 2 || arg != argc - 1 || init_csum + verify_csum > 1) {
+        fprintf(stderr, "Usage: ext2_checker [-f] [--init-csum | --verify-csum] <image file name>\n");
         return -1;
     }
+    char *image_name = argv[argc - 1];
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        return -1;
-    }
-
-    sb = (struct ext2_super_block *)(disk + 1024);
-    gd = (struct ext2_group_desc*)(disk + 2048);
-    block_bitmap = disk + 3072;
-    inode_bitmap = disk + 4096;
-    inode_table = (struct ext2_inode *)(disk + 5120);
-
-    /* Check inconsistencies */
-
-    int total = 0;  // total number of inconsistencies
-
-    // Part a
-    int bitmap_free_inodes_count = 0;
-    int bitmap_free_blocks_count = 0;
-    int diff;
+    /* Make the checksum file, which needs no other checking */
 
-    // Count the number of free inodes in the bitmap
-    int i;
-    for(i = 1; i <= sb->s_inodes_count; i++) {
-       if(check_allocation(inode_bitmap, i) == 0) 
-           bitmap_free_inodes_count++;
+    if(init_csum) {
+        if(csum_init_image(image_name) == -1)
+            return EIO;
+        printf("Checksums of %s written to %s%s\n", image_name, image_name, CSUM_SUFFIX);
+        return 0;
     }
 
-    for(i = 1; i <= sb->s_blocks_count; i++) {
-        if(check_allocation(block_bitmap, i) == 0)
-            bitmap_free_blocks_count++;
-    }
-    
-    if(sb->s_free_inodes_count != bitmap_free_inodes_count) {
-        diff = abs(sb->s_free_inodes_count - bitmap_free_inodes_count);        
-        printf("Fixed: superblock's free inodes was off by %d compared to the bitmap\n", diff);
-        sb->s_free_inodes_count = bitmap_free_inodes_count;        
-        total += diff;
+    /* Find the groups changed since the last check, if the image was closed cleanly after one */
+
+    unsigned char *dirty = NULL;    // 1 for each group to check, or NULL to check the whole image
+    unsigned int num_dirty = 0;
+    unsigned int group;
+
+    if(force == 0 && verify_csum == 0) {
+        if(open_image(image_name, O_RDONLY) == -1) {
+            return -1;
+        }
+        if((sb->s_state & EXT2_VALID_FS) && (sb->s_state & EXT2_ERROR_FS) == 0 && was_checked()) {
+            dirty = calloc(num_groups, 1);
+            if(dirty == NULL) {
+                perror("calloc");
+                return -1;
+            }
+            for(group = 0; group < num_groups; group++) {
+                if(gd[group].bg_flags & EXT2_BG_DIRTY) {
+                    dirty[group] = 1;
+                    num_dirty++;
+                }
+            }
+            if(num_dirty == 0) {
+                printf("%s is clean and has not changed since it was last checked (use -f to check it anyway)\n", \
+                       image_name);
+                return 0;
+            }
+            // Checking every group one by one would only be slower than the tree walk
+            if(num_dirty == num_groups) {
+                free(dirty);
+                dirty = NULL;
+            }
+        }
+        close_image();
     }
 
-    if(sb->s_free_blocks_count != bitmap_free_blocks_count) {
-        diff = abs(sb->s_free_blocks_count - bitmap_free_blocks_count);
-        printf("Fixed: superblock's free blocks was off by %d compared to the bitmap\n", diff);
-        sb->s_free_blocks_count = bitmap_free_blocks_count;
-        total += diff;
-    }
+    /* Intiailize disk and other structures */
 
-    if(gd->bg_free_inodes_count != bitmap_free_inodes_count) {
-        diff = abs(gd->bg_free_inodes_count - bitmap_free_inodes_count);
-        printf("Fixed: block group's free inodes was off by %d compared to the bitmap\n", diff);
-        gd->bg_free_inodes_count = bitmap_free_inodes_count;
-        total += diff;
+    if(open_image(image_name, verify_csum ? O_RDONLY : O_RDWR) == -1) {
+        return -1;
     }
 
-    if(gd->bg_free_blocks_count != bitmap_free_blocks_count) {        
-        diff = abs(gd->bg_free_blocks_count - bitmap_free_blocks_count);
-        printf("Fixed: block group's free blocks was off by %d compared to the bitmap\n", diff);
-        gd->bg_free_blocks_count = bitmap_free_blocks_count;
-        total += diff;
+    /* Check the metadata blocks against their checksums instead of one another */
+
+    if(verify_csum) {
+        stats_phase("checksums");
+        unsigned int checked = csum_verify_metadata();
+
+        if(csum_enabled == 0) {
+            fprintf(stderr, "%s has no checksums, see ext2_checker --init-csum\n", image_name);
+            return ENOENT;
+        }
+        if(csum_errors > 0) {
+            printf("%u of %u metadata blocks do not match their checksums!\n", csum_errors, checked);
+            return EIO;
+        }
+        printf("All %u metadata blocks match their checksums\n", checked);
+        return 0;
     }
 
+    /* Check inconsistencies */
+
+    stats_phase("bitmaps");
+
+    int total = check_free_counts(dirty);  // total number of inconsistencies
+    if(total == -1)
+        return -1;
 
     // Traverse each entry in the root direcotry and fix corrupted files
-    total += check_directory(2);
+    stats_phase("directories");
+    if(dirty == NULL) {
+        total += check_directory(2);
+    }
+    else {
+        for(group = 0; group < num_groups; group++) {
+            if(dirty[group])
+                total += check_group(group);
+        }
+        printf("Checked the %u of %u block groups changed since the last check\n", num_dirty, num_groups);
+    }
+    mark_checked();
 
 
     if(total > 0) 
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ext2_client.h"
+
+#define SEND_BUFFER (1 << 20)   // bytes of requests gathered before they are sent
+
+static int server_fd = -1;          // socket connected to ext2d
+static unsigned char *pending;      // requests not sent yet
+static size_t pending_len;
+static size_t pending_cap;
+static unsigned int next_id;
+
+// Writes all len bytes of buf to fd.
+// Returns 0 on success or -1.
+static int write_all(int fd, const void *buf, size_t len) {
+
+    const unsigned char *pos = buf;
+    ssize_t written;
+
+    while(len > 0) {
+        written = write(fd, pos, len);
+        if(written == -1 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return -1;
+        pos += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Reads exactly len bytes from fd into buf.
+// Returns 0 on success or -1 if the connection failed or was closed.
+static int read_all(int fd, void *buf, size_t len) {
+
+    unsigned char *pos = buf;
+    ssize_t got;
+
+    while(len > 0) {
+        got = read(fd, pos, len);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return -1;
+        pos += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Sends the requests gathered so far.
+// Returns 0 on success or -1.
+static int flush_requests() {
+
+    if(pending_len > 0 && write_all(server_fd, pending, pending_len) == -1) {
+        perror("ext2d");
+        return -1;
+    }
+    pending_len = 0;
+    return 0;
+}
+
+// Adds len bytes of buf to the requests to send.
+// Returns 0 on success or -1.
+static int queue_bytes(const void *buf, size_t len) {
+
+    if(len == 0)
+        return 0;
+
+    // Large data goes out on its own instead of being copied
+    if(len >= SEND_BUFFER) {
+        if(flush_requests() == -1 || write_all(server_fd, buf, len) == -1) {
+            perror("ext2d");
+            return -1;
+        }
+        return 0;
+    }
+
+    if(pending_len + len > SEND_BUFFER && flush_requests() == -1)
+        return -1;
+    if(pending_len + len > pending_cap) {
+        unsigned char *bigger = realloc(pending, SEND_BUFFER);
+        if(bigger == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        pending = bigger;
+        pending_cap = SEND_BUFFER;
+    }
+    memcpy(pending + pending_len, buf, len);
+    pending_len += len;
+    return 0;
+}
+
+// Connects to the ext2d named by EXT2D_SOCKET, if it is set.
+// Returns 1 if the operations on image_name are to be sent to it.
+// Returns 0 if the image is to be opened directly: EXT2D_SOCKET is not set
+// or the ext2d serves another image.
+// Returns -1 on failure.
+int client_open(char *image_name) {
+
+    char *socket_path = getenv("EXT2D_SOCKET");
+    struct sockaddr_un addr;
+    char image_path[PATH_MAX];
+    int rv;
+
+    if(socket_path == NULL || socket_path[0] == '\0')
+        return 0;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path is too long\n", socket_path);
+        return -1;
+    }
+
+    // ext2d does not run in the same directory, so it gets the full path
+    if(realpath(image_name, image_path) == NULL) {
+        perror(image_name);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server_fd == -1 || connect(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(socket_path);
+        return -1;
+    }
+
+    if(client_send(EXT2D_OPEN, image_path, NULL, NULL, 0, 0) == -1)
+        return -1;
+    rv = client_reply(NULL, 0);
+    if(rv == ENXIO) {
+        close(server_fd);
+        server_fd = -1;
+        return 0;
+    }
+    return rv == 0 ? 1 : -1;
+}
+
+// Adds a request to the ones to send to ext2d.
+// path and arg may be NULL, and data is size bytes.
+// Requests are only sent when the buffer fills up or a reply is read,
+// so that many of them go out together.
+// Returns 0 on success or -1.
+int client_send(unsigned short op, char *path, char *arg, const void *data, unsigned int size, \
+        unsigned long long offset) {
+
+    struct ext2d_request req;
+    size_t path_len = path == NULL ? 0 : strlen(path);
+    size_t arg_len = arg == NULL ? 0 : strlen(arg);
+
+    if(path_len > USHRT_MAX || arg_len > USHRT_MAX) {
+        fprintf(stderr, "ext2d: path is too long\n");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.path_len = path_len;
+    req.arg_len = arg_len;
+    req.id = next_id++;
+    req.size = size;
+    req.offset = offset;
+
+    if(queue_bytes(&req, sizeof(req)) == -1 || queue_bytes(path, path_len) == -1 || \
+            queue_bytes(arg, arg_len) == -1 || queue_bytes(data, size) == -1)
+        return -1;
+    return 0;
+}
+
+// Reads the reply to the oldest request that has not been answered yet,
+// after sending any requests still waiting to go out.
+// Up to max_size bytes of the data that comes with it are put in buf.
+// Returns the result of the request (0 on success or an errno code),
+// or EIO if the connection failed.
+int client_reply(void *buf, unsigned int max_size) {
+
+    struct ext2d_reply reply;
+    unsigned char skip[256];
+    unsigned int left;
+    unsigned int len;
+
+    if(flush_requests() == -1)
+        return EIO;
+    if(read_all(server_fd, &reply, sizeof(reply)) == -1) {
+        fprintf(stderr, "ext2d: connection closed\n");
+        return EIO;
+    }
+
+    // Keep what fits and drop the rest
+    len = reply.size < max_size ? reply.size : max_size;
+    if(read_all(server_fd, buf, len) == -1)
+        return EIO;
+    for(left = reply.size - len; left > 0; left -= len) {
+        len = left < sizeof(skip) ? left : sizeof(skip);
+        if(read_all(server_fd, skip, len) == -1)
+            return EIO;
+    }
+    return reply.result;
+}
+
+// Has ext2d carry out one operation and write it to the image file, as the
+// tool that opens the image itself would have done by the time it exits.
+// Returns the result of the operation.
+int client_call(unsigned short op, char *path, char *arg, const void *data, unsigned int size) {
+
+    int rv;
+    int sync_rv;
+
+    if(client_send(op, path, arg, data, size, 0) == -1 || \
+            client_send(EXT2D_SYNC, NULL, NULL, NULL, 0, 0) == -1)
+        return EIO;
+    rv = client_reply(NULL, 0);
+    sync_rv = client_reply(NULL, 0);
+    return rv != 0 ? rv : sync_rv;
+}
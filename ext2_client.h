@@ -0,0 +1,72 @@
+#ifndef __EXT2_CLIENT_H__
+#define __EXT2_CLIENT_H__
+
+#include "ext2.h"
+
+// The protocol spoken by ext2d, which keeps one image open and serves it
+// over a Unix socket, and the client side of it used by the tools.
+// A client may send any number of requests before it reads the replies;
+// they are carried out one after another, and the replies come back in the
+// order of the requests.
+
+// Kinds of request
+enum ext2d_op {
+    EXT2D_OPEN,         // path: image file name, replies 0 if ext2d serves that file
+    EXT2D_LOOKUP,       // path, replies the inode number as an unsigned int
+    EXT2D_STAT,         // path, replies a struct ext2d_stat
+    EXT2D_LIST,         // path of a directory, replies its entries (see below)
+    EXT2D_CREATE,       // path, arg: source name, data: contents, as ext2_cp
+    EXT2D_WRITE,        // path, data written at offset, replies the bytes written as an unsigned int
+    EXT2D_MKDIR,        // path, as ext2_mkdir
+    EXT2D_LINK,         // path, arg: source path, as ext2_ln
+    EXT2D_SYMLINK,      // path, arg: source path, as ext2_ln -s
+    EXT2D_UNLINK,       // path, as ext2_rm
+    EXT2D_RESTORE,      // path, as ext2_restore
+    EXT2D_CHECK,        // replies the number of inconsistencies fixed as an int
+    EXT2D_SYNC          // waits until every change has reached the image file
+};
+
+// Each request is followed by path_len bytes of path, arg_len bytes of
+// argument and size bytes of data
+struct ext2d_request {
+    unsigned short op;              // an enum ext2d_op
+    unsigned short path_len;
+    unsigned short arg_len;
+    unsigned short unused;
+    unsigned int id;                // given back in the reply
+    unsigned int size;
+    unsigned long long offset;      // where EXT2D_WRITE writes in the file
+};
+
+// Each reply is followed by size bytes of data
+struct ext2d_reply {
+    unsigned int id;
+    int result;                     // 0 on success or the errno code the tool would exit with
+    unsigned int size;
+    unsigned int unused;
+};
+
+struct ext2d_stat {
+    unsigned int inum;
+    struct ext2_inode inode;
+};
+
+// Each entry listed by EXT2D_LIST is followed by name_len bytes of name
+struct ext2d_entry {
+    unsigned int inode;
+    unsigned char name_len;
+    unsigned char file_type;
+    unsigned short unused;
+};
+
+// When EXT2D_SOCKET names the socket of an ext2d, ext2_cp, ext2_mkdir,
+// ext2_ln, ext2_rm and ext2_restore hand their operation to it
+// instead of opening the image themselves.
+
+int client_open(char *image_name);
+int client_send(unsigned short op, char *path, char *arg, const void *data, unsigned int size, \
+        unsigned long long offset);
+int client_reply(void *buf, unsigned int max_size);
+int client_call(unsigned short op, char *path, char *arg, const void *data, unsigned int size);
+
+#endif
@@ -2,240 +2,261 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <math.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_ops.h"
+#include "ext2_client.h"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
-unsigned char *block_bitmap;
-unsigned char *inode_bitmap;
-struct ext2_inode *inode_table;
+#define MAX_THREADS 64
 
-int main(int argc, char *argv[]) {
+// Files shared by the threads
+static char **sources;              // paths of the files to copy
+static unsigned int num_sources;
+static unsigned int next_source;    // index of the next file a thread takes
+static int *results;                // what copying each file returned
+static char *target;                // absolute path on the disk
 
-    /* Check if arguments are valid */
+// Opens the file at source into *fd, which the caller closes, and takes its size into *size.
+// Returns 0 on success or the errno code to exit with.
+static int open_source(char *source, int *fd, off_t *size) {
 
-    if(argc !=  4) {
-        fprintf(stderr, "Usage: ext2_cp <image file name> <path to source file> <absolute path to target file>\n");
-        return -1;
+    *fd = open(source, O_RDONLY);
+    if(*fd == -1) {
+        perror("open");
+        return ENOENT;
     }
 
-    if(argv[3][0] != '/') {        
-        return ENOENT;
+    struct stat file_stats;
+    if(fstat(*fd, &file_stats) == -1) {
+        perror("stat");
+        close(*fd);
+        return EIO;
     }
 
-    /* Initialize disk and other structures */
-    
-    int image_fd = open(argv[1], O_RDWR);
-    if(image_fd == -1) {
-        perror("open");
-        return -1;
+    // Too large a file is turned down before any of it is read
+    if(file_stats.st_size > MAX_COPY_SIZE) {
+        fprintf(stderr, "ext2_cp: %s is too large\n", source);
+        close(*fd);
+        return EFBIG;
     }
+    *size = file_stats.st_size;
+    return 0;
+}
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        return -1;
+// Reads the file at source into *data, which the caller frees, and its size into *size.
+// Returns 0 on success or the errno code to exit with.
+static int read_source(char *source, unsigned char **data, size_t *size) {
+
+    int file_fd;
+    off_t file_size;
+    size_t total = 0;           // bytes read from the file
+    ssize_t read_bytes;
+    int rv = open_source(source, &file_fd, &file_size);
+
+    if(rv != 0)
+        return rv;
+
+    *data = malloc(file_size + 1);
+    if(*data == NULL) {
+        perror("malloc");
+        close(file_fd);
+        return ENOMEM;
+    }
+    while(total < file_size) {
+        read_bytes = read(file_fd, *data + total, file_size - total);
+        if(read_bytes == -1) {
+            perror("read");
+            free(*data);
+            close(file_fd);
+            return EIO;
+        }
+        if(read_bytes == 0)
+            break;
+        total += read_bytes;
     }
+    close(file_fd);
+    *size = total;
+    return 0;
+}
 
-    sb = (struct ext2_super_block *)(disk + 1024);
-    gd = (struct ext2_group_desc *)(disk + 2048);
-    block_bitmap = disk + 3072;
-    inode_bitmap = disk + 4096;
-    inode_table = (struct ext2_inode *)(disk + 5120);   
+// Copies the file at source to target, reading it as it goes.
+// Returns 0 on success or the errno code to exit with.
+static int copy_source(char *source) {
 
-    int file_fd = open(argv[2], O_RDONLY);
-    if(file_fd == -1) {
-        perror("open");
-        return ENOENT;
+    int fd;
+    off_t size;
+    int rv = open_source(source, &fd, &size);
+
+    if(rv != 0)
+        return rv;
+
+    rv = ext2_copy_fd(target, find_name(source), fd, size);
+
+    close(fd);
+    return rv;
+}
+
+// Sends every file to ext2d before waiting for any reply.
+// Returns 0 on success or the errno code to exit with.
+static int send_sources() {
+
+    struct ext2d_stat st;
+    unsigned char *data;
+    size_t size;
+    unsigned int i;
+    int rv;
+
+    // Several files go into a directory, each under its own name
+    if(num_sources > 1) {
+        if(client_send(EXT2D_STAT, target, NULL, NULL, 0, 0) == -1)
+            return EIO;
+        if(client_reply(&st, sizeof(st)) != 0)
+            return ENOENT;
+        if((st.inode.i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+            fprintf(stderr, "ext2_cp: %s is not a directory\n", target);
+            return ENOTDIR;
+        }
     }
 
-    /* Check if target path is valid */
+    for(i = 0; i < num_sources; i++) {
+        results[i] = read_source(sources[i], &data, &size);
+        if(results[i] != 0)
+            continue;
+        rv = client_send(EXT2D_CREATE, target, find_name(sources[i]), data, size, 0);
+        free(data);
+        if(rv == -1)
+            return EIO;
+    }
+    if(client_send(EXT2D_SYNC, NULL, NULL, NULL, 0, 0) == -1)
+        return EIO;
 
-    char *file_name;             // name of the copied file
-    unsigned int dest_inum;      // inode number for the directoy to which the copied file is added
+    // The replies come back in the order the files were sent
+    for(i = 0; i < num_sources; i++) {
+        if(results[i] == 0)
+            results[i] = client_reply(NULL, 0);
+    }
+    rv = client_reply(NULL, 0);
 
-    // Full path info
-    int path_len = strlen(argv[3]);
-    unsigned int path_inum = pathwalk(argv[3]);  // inode number for the last file object in path
-    struct ext2_inode path_inode;       
-    unsigned short path_type;
+    for(i = 0; i < num_sources; i++) {
+        if(results[i] != 0)
+            return results[i];
+    }
+    return rv;
+}
 
-    // Subpath info 
-    // Subpath is a subpath of path leading up to the last file object
-    // We need subpath when path includes path AND new name for the copied file
-    unsigned int subpath_inum;
-    char *subpath;
+// Copies files until there are none left
+static void *worker(void *arg) {
 
-    // Check if path exists
-        
-    // Case 1: path exists
-    if(path_inum > 0) {
-        path_inode = inode_table[path_inum - 1];
-        path_type = path_inode.i_mode & EXT2_IMODE_MASK;
+    unsigned int i;
 
-        // Case 1-1: path is a directory
-        if(path_type == EXT2_S_IFDIR) {
-            // Check if a file with same name as the source file already exists in parent's directory
-            char *source_name = find_name(argv[2]);
-            if(search_directory(path_inum, source_name) > 0) {                
-                return EEXIST;
-            }
+    while((i = __atomic_fetch_add(&next_source, 1, __ATOMIC_RELAXED)) < num_sources)
+        results[i] = copy_source(sources[i]);
+    return NULL;
+}
 
-            file_name = source_name;
-            dest_inum = path_inum;
+int main(int argc, char *argv[]) {
 
-        }
-        // Case 1-2: path is a file/link.
-        else {
-            // There is already a file that has the same name in parent's diretory            
-            return EEXIST;
+    /* Check if arguments are valid */
 
-        }
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int bad = 0;
+    int opt;
 
+    while((opt = getopt(argc, argv, "j:")) != -1) {
+        if(opt == 'j')
+            num_threads = atoi(optarg);
+        else
+            bad = 1;
     }
- 
-    // Case 2: path does not exist
-    else {
 
-        // If path ends with '/', path does not exist.
-        if(argv[3][path_len - 1] == '/') {
-            return ENOENT;
-        }
+    if(bad || argc - optind < 3) {
+        fprintf(stderr, "Usage: ext2_cp [-j threads] <image file name> <path to source file>... " \
+                "<absolute path to target file>\n");
+        return -1;
+    }
 
-        // If subpath is a valid directory, copy the file in parent's direcotry with
-        // with its name as last token in path
-       
-        // Obtain parent's directory
-        subpath = find_subpath(argv[3]);
-        subpath_inum = pathwalk(subpath);
-
-        // If subpath does not exist or subpath is not a directory, path is invalid.
-        // Note that by the design, subpath ends with '/'.
-        // If subpath_inum > 0 (i.e., subpath exists), subpath must be a direcotry
-        // since subpath to a file/link that ends with '/' cannot exist.
-        if(subpath_inum == 0) {            
-           return ENOENT;
-       }
-        
-        // subpath is a valid directory and path does not end with '/'
-        
-        file_name = find_name(argv[3]);
-        dest_inum = subpath_inum;
-
-    }        
-
-    /* Allocate an inode to the new file */
-
-    unsigned int new_inum = allocate_inode();
-    if(new_inum == 0) {
-        fprintf(stderr, "There is no more space in inode table.\n");
+    target = argv[argc - 1];
+    sources = &argv[optind + 1];
+    num_sources = argc - optind - 2;
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+    if(num_threads > num_sources)
+        num_threads = num_sources;
+    if(num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    if(num_threads < 1)
+        num_threads = 1;
+
+    results = calloc(num_sources, sizeof(int));
+    if(results == NULL) {
+        perror("calloc");
         return ENOMEM;
     }
-    struct ext2_inode *new_inode = &inode_table[new_inum - 1];
 
-    struct stat file_stats;
-    if(stat(argv[2], &file_stats) == -1) {
-        perror("stat");
+    /* Hand the files to ext2d if one serves the disk */
+
+    int served = client_open(argv[optind]);
+    if(served == -1) {
         return -1;
     }
-    unsigned int file_size = file_stats.st_size;
-    unsigned int file_blocks;
-    if(file_size <= 12 * 1024)
-        file_blocks = (ceil((double)file_size / 1024)) * 2;
-    else
-        file_blocks = (ceil((double)file_size / 1024) + 1) * 2;
-
-    new_inode->i_mode = EXT2_S_IFREG;
-    new_inode->i_size = file_size;
-    new_inode->i_links_count = 1;
-    new_inode->i_blocks = file_blocks;
-    new_inode->i_dtime = 0;
+    if(served) {
+        return send_sources();
+    }
 
-    /* Add entry for the new file in the parent's directory */
+    /* Initialize disk and other structures */
 
-    struct ext2_dir_entry *new_entry = malloc(sizeof(struct ext2_dir_entry));
-    if(new_entry == NULL) {
-        perror("malloc");
+    if(open_image(argv[optind], O_RDWR) == -1) {
         return -1;
     }
-    new_entry->inode = new_inum;
-    new_entry->rec_len = -1;
-    new_entry->name_len = strlen(file_name);
-    new_entry->file_type = EXT2_FT_REG_FILE;
-    strncpy(new_entry->name, file_name, new_entry->name_len);
-    add_new_entry(dest_inum, new_entry);
-
-    /* Copy the source file into empty data blocks */
-    
-    // Find empty data blocks and copy the file there
-    unsigned int block_num;                 // block number for current block
-    unsigned int cur_block_idx = 0;         // index for current block
-    unsigned int cur_indirect_idx = 0;      // index into the single indirect block    
-    unsigned char *cur_block;               // a pointer to the start of the current block   
-    unsigned int *indirect_block;           // a pointer to the start of the single indirect block
-    int read_bytes = 0;                     // bytes read from the file
-    int total = 0;                          // total bytes read from the file 
-
-    while(total < file_size) {     
-        // Only direct blocks are needed
-        if(cur_block_idx < 12) {
-            // Find an empty block
-            block_num = allocate_block();
-            if(block_num == 0) {
-                fprintf(stderr, "There is no more available data blocks.\n");
-                return ENOMEM;
-            }
-            new_inode->i_block[cur_block_idx] = block_num;
-    
-            // Copy the file to the current block
-            cur_block = disk + block_num * 1024;           
-            read_bytes = read(file_fd, cur_block, 1024);
-            if(read_bytes == -1) {
-                perror("read");
-                return -1;
-            }
-            cur_block_idx++;
+
+    // Several files go into a directory, each under its own name
+    if(num_sources > 1) {
+        int inum = pathwalk(target);
+        if(inum <= 0)
+            return ENOENT;
+        if((get_inode(inum)->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+            fprintf(stderr, "ext2_cp: %s is not a directory\n", target);
+            return ENOTDIR;
+        }
+    }
+
+    /* Copy the files, one file per thread at a time */
+
+    pthread_t threads[MAX_THREADS];
+    long i;
+    int rv = 0;
+
+    if(num_threads > 1 && begin_threads() == -1)
+        num_threads = 1;
+    if(num_threads == 1) {
+        worker(NULL);
+    }
+    else {
+        // The threads already started have to finish before the image is closed
+        for(i = 0; i < num_threads; i++) {
+            rv = pthread_create(&threads[i], NULL, worker, NULL);
+            if(rv != 0)
+                break;
         }
-        // Need a single indirect block (cur_block_idx == 12)
-        else {
-            // A block has not been allocated to indirect block yet (i.e., total bytes read so far == 1024 * 12)
-            if(cur_indirect_idx == 0) {
-                // Allocate new block for indirect block
-                block_num = allocate_block();
-                if(block_num == 0) {
-                    fprintf(stderr, "There is no more available data blocks.\n");
-                    return ENOMEM;
-                }
-                new_inode->i_block[cur_block_idx] = block_num;
-                indirect_block = (unsigned int *)(disk + block_num * 1024);                
-            }
-
-            // Allocate a block that goes in the indirect block
-            block_num = allocate_block();
-            if(block_num == 0) {
-                fprintf(stderr, "There is no more available data blocks.\n");
-                return ENOMEM;
-            }
-            // Copy the file to the current block
-            cur_block = disk + block_num * 1024;
-            read_bytes = read(file_fd, cur_block, 1024);
-            if(read_bytes == -1) {
-                perror("read");
-                return -1;
-            }
-            // Save a pointer to the new block in the indirect block
-            indirect_block[cur_indirect_idx] = block_num;
-            cur_indirect_idx++;
+        num_threads = i;
+        for(i = 0; i < num_threads; i++)
+            pthread_join(threads[i], NULL);
+        end_threads();
+        if(rv != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+            return rv;
         }
-        total += read_bytes;
     }
 
-	return 0;
+    // The first file that could not be copied decides the exit code
+    for(i = 0; i < num_sources; i++) {
+        if(results[i] != 0)
+            return results[i];
+    }
+    return 0;
 }
@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_csum.h"
+
+#define CRC32C_POLY 0x82F63B78      // the Castagnoli polynomial, bit-reversed
+#define CHUNK_BLOCKS 256            // blocks checksummed per read when sweeping an image
+
+int csum_enabled;
+unsigned int csum_errors;
+
+static unsigned int crc_table[8][256];      // slicing-by-8 tables for CPUs without SSE4.2
+static int use_sse42 = -1;                  // -1 until crc_setup has run
+
+static char *csum_name;                     // the checksum file of the open image
+static int csum_fd = -1;
+static unsigned char *csum_map;             // the whole checksum file mapped into memory
+static unsigned long long csum_size;        // length of the mapping
+static unsigned int *crcs;                  // checksum of each block, right after the header
+static unsigned int num_blocks;             // blocks with a checksum
+static unsigned int num_pinned;             // blocks changed without going through get_block
+static int csum_writable;
+
+// Bit n is set once block n has been checked since the last checkpoint.
+// Those are the only blocks that can have changed through a pointer from
+// get_block, so they are the ones whose checksums are worked out again.
+static unsigned long long *touched;
+
+/* From below is CRC32C */
+
+// Fills the slicing-by-8 tables and sees whether the CPU has the crc32 instruction
+static void crc_setup() {
+
+    unsigned int crc;
+    int i;
+    int j;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++) {
+        for(j = 1; j < 8; j++)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    use_sse42 = __builtin_cpu_supports("sse4.2");
+#else
+    use_sse42 = 0;
+#endif
+}
+
+// Software CRC32C taking 8 bytes per step. crc is the inverted running value.
+static unsigned int crc32c_table(unsigned int crc, const unsigned char *p, size_t len) {
+
+    unsigned int lo;
+    unsigned int hi;
+
+    while(len >= 8) {
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ \
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^ \
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^ \
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C with the SSE4.2 crc32 instruction. crc is the inverted running value.
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len) {
+
+    unsigned long long value = crc;
+    unsigned long long word;
+
+    while(len >= 8) {
+        memcpy(&word, p, 8);
+        value = __builtin_ia32_crc32di(value, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = value;
+    while(len-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+// Checksums three blocks at a time. One crc32 instruction has to wait for
+// the one before it on the same data, but three independent blocks keep the
+// unit busy every cycle.
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_blocks_sse42(const unsigned char *blocks, unsigned int count, unsigned int *out) {
+
+    const unsigned char *a;
+    const unsigned char *b;
+    const unsigned char *c;
+    unsigned long long x;
+    unsigned long long y;
+    unsigned long long z;
+    unsigned long long word;
+    unsigned int off;
+    unsigned int i;
+
+    for(i = 0; i + 3 <= count; i += 3) {
+        a = blocks + (size_t)i * EXT2_BLOCK_SIZE;
+        b = a + EXT2_BLOCK_SIZE;
+        c = b + EXT2_BLOCK_SIZE;
+        x = y = z = 0xFFFFFFFF;
+        for(off = 0; off < EXT2_BLOCK_SIZE; off += 8) {
+            memcpy(&word, a + off, 8);
+            x = __builtin_ia32_crc32di(x, word);
+            memcpy(&word, b + off, 8);
+            y = __builtin_ia32_crc32di(y, word);
+            memcpy(&word, c + off, 8);
+            z = __builtin_ia32_crc32di(z, word);
+        }
+        out[i] = ~(unsigned int)x;
+        out[i + 1] = ~(unsigned int)y;
+        out[i + 2] = ~(unsigned int)z;
+    }
+    return i;
+}
+#endif
+
+// Returns the CRC32C of len bytes at data, continuing from crc
+// (0 to start a new checksum)
+unsigned int crc32c(unsigned int crc, const void *data, size_t len) {
+
+    if(use_sse42 == -1)
+        crc_setup();
+#if defined(__x86_64__)
+    if(use_sse42)
+        return ~crc32c_sse42(~crc, data, len);
+#endif
+    return ~crc32c_table(~crc, data, len);
+}
+
+// Puts the CRC32C of each of count blocks at blocks in crcs
+void crc32c_blocks(const unsigned char *blocks, unsigned int count, unsigned int *out) {
+
+    unsigned int i = 0;
+
+    if(use_sse42 == -1)
+        crc_setup();
+#if defined(__x86_64__)
+    if(use_sse42)
+        i = crc32c_blocks_sse42(blocks, count, out);
+#endif
+    for(; i < count; i++)
+        out[i] = crc32c(0, blocks + (size_t)i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+}
+
+/* From below is the checksum file */
+
+// Returns the name of the checksum file of image_name, allocated with malloc
+static char *checksum_file_name(char *image_name) {
+
+    char *name = malloc(strlen(image_name) + sizeof(CSUM_SUFFIX));
+
+    if(name == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    strcpy(name, image_name);
+    strcat(name, CSUM_SUFFIX);
+    return name;
+}
+
+// Makes the checksum file of image_name from scratch, replacing any old one.
+// The image must not be open for writing by this program.
+// Returns 0 on success or -1.
+int csum_init_image(char *image_name) {
+
+    char *name = checksum_file_name(image_name);
+    char *tmp_name = malloc(strlen(name) + 5);
+    unsigned char *buf = malloc((size_t)CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+    unsigned int *chunk_crcs = malloc(CHUNK_BLOCKS * sizeof(unsigned int));
+    unsigned char header_block[EXT2_BLOCK_SIZE] = {0};
+    struct csum_header *header = (struct csum_header *)header_block;
+    struct ext2_super_block super;
+    struct stat image_stats;
+    unsigned int blocks;
+    unsigned int block_num;
+    unsigned int count;
+    int image_fd;
+    int fd;
+
+    if(tmp_name == NULL || buf == NULL || chunk_crcs == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    sprintf(tmp_name, "%s.tmp", name);
+
+    image_fd = open(image_name, O_RDONLY);
+    if(image_fd == -1 || fstat(image_fd, &image_stats) == -1 || \
+            pread(image_fd, &super, sizeof(super), 1024) != sizeof(super)) {
+        perror(image_name);
+        return -1;
+    }
+    if(super.s_magic != EXT2_SUPER_MAGIC) {
+        fprintf(stderr, "%s: not an ext2 image\n", image_name);
+        return -1;
+    }
+    blocks = image_stats.st_size / EXT2_BLOCK_SIZE;
+
+    // Written under another name first, so a crash never leaves a half-made file in use
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        perror(tmp_name);
+        return -1;
+    }
+    header->magic = CSUM_MAGIC;
+    header->blocks_count = blocks;
+    memcpy(header->uuid, super.s_uuid, sizeof(header->uuid));
+    if(pwrite(fd, header_block, EXT2_BLOCK_SIZE, 0) != EXT2_BLOCK_SIZE) {
+        perror(tmp_name);
+        goto fail;
+    }
+
+    for(block_num = 0; block_num < blocks; block_num += count) {
+        count = blocks - block_num < CHUNK_BLOCKS ? blocks - block_num : CHUNK_BLOCKS;
+        if(pread(image_fd, buf, (size_t)count * EXT2_BLOCK_SIZE, (off_t)block_num * EXT2_BLOCK_SIZE) != \
+                (ssize_t)count * EXT2_BLOCK_SIZE) {
+            perror(image_name);
+            goto fail;
+        }
+        crc32c_blocks(buf, count, chunk_crcs);
+        if(pwrite(fd, chunk_crcs, count * sizeof(unsigned int), \
+                  EXT2_BLOCK_SIZE + (off_t)block_num * sizeof(unsigned int)) != count * sizeof(unsigned int)) {
+            perror(tmp_name);
+            goto fail;
+        }
+    }
+
+    if(fsync(fd) == -1 || close(fd) == -1 || rename(tmp_name, name) == -1) {
+        perror(name);
+        return -1;
+    }
+    close(image_fd);
+    free(chunk_crcs);
+    free(buf);
+    free(tmp_name);
+    free(name);
+    return 0;
+
+fail:
+    close(fd);
+    unlink(tmp_name);
+    return -1;
+}
+
+// Reports block block_num as not matching its checksum, and marks the
+// image as having errors if it is open for writing, so that ext2_checker
+// checks all of it
+static void mismatch(unsigned int block_num) {
+    __atomic_fetch_add(&csum_errors, 1, __ATOMIC_RELAXED);
+    if(csum_writable)
+        sb->s_state |= EXT2_ERROR_FS;
+    fprintf(stderr, "%s: block %u does not match its checksum\n", csum_name, block_num);
+}
+
+// Maps the checksum file of size bytes
+// Returns 0 on success or -1.
+static int map_checksums(unsigned long long size) {
+
+    csum_map = mmap(NULL, size, PROT_READ | (csum_writable ? PROT_WRITE : 0), MAP_SHARED, csum_fd, 0);
+    if(csum_map == MAP_FAILED) {
+        perror("mmap");
+        csum_map = NULL;
+        return -1;
+    }
+    csum_size = size;
+    crcs = (unsigned int *)(csum_map + EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+// Gives the blocks from the old end of the checksum file to file_blocks
+// their checksums, after ext2_resize has made the image file longer.
+// Returns 0 on success or -1.
+static int grow_checksums(unsigned long long file_blocks) {
+
+    struct csum_header *header = (struct csum_header *)csum_map;
+    unsigned char *buf = malloc((size_t)CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+    unsigned int block_num = header->blocks_count;
+    unsigned int count;
+
+    if(buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    munmap(csum_map, csum_size);
+    if(ftruncate(csum_fd, EXT2_BLOCK_SIZE + file_blocks * sizeof(unsigned int)) == -1) {
+        perror(csum_name);
+        return -1;
+    }
+    if(map_checksums(EXT2_BLOCK_SIZE + file_blocks * sizeof(unsigned int)) == -1)
+        return -1;
+    header = (struct csum_header *)csum_map;
+
+    for(; block_num < file_blocks; block_num += count) {
+        count = file_blocks - block_num < CHUNK_BLOCKS ? file_blocks - block_num : CHUNK_BLOCKS;
+        if(read_blocks(block_num, count, buf) == -1)
+            return -1;
+        crc32c_blocks(buf, count, crcs + block_num);
+    }
+    header->blocks_count = file_blocks;
+    free(buf);
+    return 0;
+}
+
+// Starts keeping checksums for the image just opened by open_image, if it
+// has a checksum file. A file made for another image, or for a longer one,
+// is ignored with a warning. Blocks 0 to pinned - 1 are checked at once.
+// Returns 0 on success or -1.
+int csum_open(char *image_name, unsigned long long file_blocks, int writable, unsigned int pinned) {
+
+    struct csum_header *header;
+    struct stat csum_stats;
+    unsigned int i;
+
+    csum_name = checksum_file_name(image_name);
+    csum_writable = writable;
+    csum_fd = open(csum_name, writable ? O_RDWR : O_RDONLY);
+    if(csum_fd == -1 && errno == ENOENT)
+        return 0;
+    if(csum_fd == -1 || fstat(csum_fd, &csum_stats) == -1) {
+        perror(csum_name);
+        return -1;
+    }
+
+    if(csum_stats.st_size < EXT2_BLOCK_SIZE || map_checksums(csum_stats.st_size) == -1) {
+        fprintf(stderr, "%s: not a checksum file, ignoring it\n", csum_name);
+        goto ignore;
+    }
+    header = (struct csum_header *)csum_map;
+    if(header->magic != CSUM_MAGIC || \
+            csum_stats.st_size < EXT2_BLOCK_SIZE + (unsigned long long)header->blocks_count * sizeof(unsigned int)) {
+        fprintf(stderr, "%s: not a checksum file, ignoring it\n", csum_name);
+        goto ignore;
+    }
+    if(memcmp(header->uuid, sb->s_uuid, sizeof(header->uuid)) != 0 || header->blocks_count > file_blocks || \
+            (header->blocks_count < file_blocks && writable == 0)) {
+        fprintf(stderr, "%s: made for another image, ignoring it (see ext2_checker --init-csum)\n", csum_name);
+        goto ignore;
+    }
+    if(header->blocks_count < file_blocks && grow_checksums(file_blocks) == -1)
+        return -1;
+
+    num_blocks = file_blocks;
+    num_pinned = pinned < num_blocks ? pinned : num_blocks;
+    touched = calloc(num_blocks / 64 + 1, sizeof(unsigned long long));
+    if(touched == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    csum_enabled = 1;
+
+    // The superblock and descriptors are changed in place through sb and gd,
+    // so they count as touched for as long as the image is open
+    for(i = 0; i < num_pinned; i++)
+        get_block(i);
+    return 0;
+
+ignore:
+    if(csum_map != NULL)
+        munmap(csum_map, csum_size);
+    csum_map = NULL;
+    close(csum_fd);
+    csum_fd = -1;
+    return 0;
+}
+
+// Checks block block_num, just looked up at block, against its checksum the
+// first time it is looked up since the last checkpoint
+void csum_touch(unsigned int block_num, const unsigned char *block) {
+
+    unsigned long long bit = 1ULL << (block_num % 64);
+    unsigned long long *word = &touched[block_num / 64];
+
+    if(block_num >= num_blocks || (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0)
+        return;
+    // Threads may look the block up at the same time (see ext2_find): one checks it
+    if((__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0)
+        return;
+    if(crc32c(0, block, EXT2_BLOCK_SIZE) != crcs[block_num])
+        mismatch(block_num);
+}
+
+// Checks count blocks from block_num, just read into buf, against their checksums.
+// Touched blocks are skipped: they were checked when they were looked up and
+// may have changed since.
+void csum_check(unsigned int block_num, unsigned int count, const unsigned char *buf) {
+
+    unsigned int chunk_crcs[64];
+    unsigned int n;
+    unsigned int i;
+
+    while(count > 0 && block_num < num_blocks) {
+        n = count < 64 ? count : 64;
+        if(n > num_blocks - block_num)
+            n = num_blocks - block_num;
+        crc32c_blocks(buf, n, chunk_crcs);
+        for(i = 0; i < n; i++) {
+            if((touched[(block_num + i) / 64] & (1ULL << ((block_num + i) % 64))) == 0 && \
+                    chunk_crcs[i] != crcs[block_num + i])
+                mismatch(block_num + i);
+        }
+        block_num += n;
+        count -= n;
+        buf += (size_t)n * EXT2_BLOCK_SIZE;
+    }
+}
+
+// Records the checksums of count blocks from block_num, just written from buf
+void csum_update(unsigned int block_num, unsigned int count, const unsigned char *buf) {
+
+    if(block_num >= num_blocks)
+        return;
+    if(count > num_blocks - block_num)
+        count = num_blocks - block_num;
+    crc32c_blocks(buf, count, crcs + block_num);
+}
+
+// Works out the checksums of the touched blocks again, before the backend
+// writes them back. If forget is 1 (at a checkpoint, when the pointers to
+// them become invalid) they are checked again when next looked up.
+// Returns 0 on success or -1.
+int csum_flush(int forget) {
+
+    unsigned long long bits;
+    unsigned int block_num;
+    unsigned int i;
+    int bit;
+
+    if(csum_enabled == 0)
+        return 0;
+
+    if(csum_writable) {
+        for(i = 0; i <= (num_blocks - 1) / 64; i++) {
+            for(bits = touched[i]; bits != 0; bits &= bits - 1) {
+                bit = __builtin_ctzll(bits);
+                block_num = i * 64 + bit;
+                crcs[block_num] = crc32c(0, get_block(block_num), EXT2_BLOCK_SIZE);
+            }
+        }
+    }
+
+    if(forget) {
+        memset(touched, 0, (num_blocks / 64 + 1) * sizeof(unsigned long long));
+        for(i = 0; i < num_pinned; i++)
+            touched[i / 64] |= 1ULL << (i % 64);
+    }
+    else if(csum_writable && msync(csum_map, csum_size, MS_SYNC) == -1) {
+        perror(csum_name);
+        return -1;
+    }
+    return 0;
+}
+
+// Brings the checksums up to date and closes the checksum file
+void csum_close() {
+
+    if(csum_enabled == 0)
+        return;
+    csum_flush(1);
+    munmap(csum_map, csum_size);
+    close(csum_fd);
+    free(touched);
+    csum_map = NULL;
+    csum_fd = -1;
+    touched = NULL;
+    csum_enabled = 0;
+}
+
+/* From below is the metadata check */
+
+// Sets the bits of count blocks from block_num in map, leaving out any past the end of the image
+static void mark_metadata(unsigned char *map, unsigned int block_num, unsigned int count) {
+
+    unsigned int i;
+
+    for(i = block_num; i < block_num + count && i < sb->s_blocks_count; i++)
+        map[i / 8] |= 1 << (i % 8);
+}
+
+// Checks every metadata block of the open image against its checksum: the
+// superblocks and group descriptors, the bitmaps, the inode tables, the
+// indirect blocks of every inode in use and the blocks of every directory.
+// Blocks are found from the descriptors and inode tables alone, without
+// following directory entries, and read in order of block number.
+// Returns the number of blocks checked, or 0 if there is no checksum file.
+unsigned int csum_verify_metadata() {
+
+    unsigned int gdt_blocks = (num_groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int size = sb->s_rev_level < EXT2_DYNAMIC_REV ? 128 : sb->s_inode_size;
+    unsigned int itable_blocks = (sb->s_inodes_per_group * size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int sparse = (sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
+    unsigned char *map = calloc(sb->s_blocks_count / 8 + 1, 1);
+    unsigned char *buf = malloc((size_t)CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+    unsigned char *inode_bitmap;
+    struct ext2_inode *inode;
+    struct block_iter iter;
+    struct block_run run;
+    unsigned int checked = 0;
+    unsigned int group;
+    unsigned int block_num;
+    unsigned int count;
+    unsigned int inum;
+    unsigned int i;
+    int is_dir;
+
+    if(csum_enabled == 0)
+        return 0;
+    if(map == NULL || buf == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    // Where each group keeps its copies, bitmaps and inode table
+    mark_metadata(map, 0, sb->s_first_data_block);
+    for(group = 0; group < num_groups; group++) {
+        if(has_super(group, sparse))
+            mark_metadata(map, sb->s_first_data_block + group * sb->s_blocks_per_group, 1 + gdt_blocks);
+        mark_metadata(map, gd[group].bg_block_bitmap, 1);
+        mark_metadata(map, gd[group].bg_inode_bitmap, 1);
+        mark_metadata(map, gd[group].bg_inode_table, itable_blocks);
+    }
+
+    // Indirect blocks and directory blocks, from the inodes the bitmaps say are in use.
+    // Looking the inodes up checks the inode table blocks they are in on the way.
+    for(group = 0; group < num_groups; group++) {
+        prefetch_blocks(gd[group].bg_inode_table, itable_blocks);
+        inode_bitmap = get_block(gd[group].bg_inode_bitmap);
+        for(i = 1; i <= sb->s_inodes_per_group; i++) {
+            if(check_allocation(inode_bitmap, i) == 0)
+                continue;
+            inum = group * sb->s_inodes_per_group + i;
+            inode = get_inode(inum);
+            is_dir = (inode->i_mode & EXT2_IMODE_MASK) == EXT2_S_IFDIR;
+            block_iter_init(&iter, inode);
+            while(block_iter_next(&iter, &run)) {
+                if(run.physical != 0 && (run.metadata || is_dir))
+                    mark_metadata(map, run.physical, run.length);
+            }
+        }
+    }
+
+    // Sweep the marked blocks in order. Blocks looked up above were checked
+    // then, and csum_check skips them.
+    for(block_num = 0; block_num < sb->s_blocks_count; block_num += count) {
+        if((map[block_num / 8] & (1 << (block_num % 8))) == 0) {
+            count = 1;
+            continue;
+        }
+        for(count = 1; count < CHUNK_BLOCKS && block_num + count < sb->s_blocks_count; count++) {
+            if((map[(block_num + count) / 8] & (1 << ((block_num + count) % 8))) == 0)
+                break;
+        }
+        if(read_blocks(block_num, count, buf) == -1)
+            exit(EIO);
+        checked += count;
+    }
+
+    free(buf);
+    free(map);
+    return checked;
+}
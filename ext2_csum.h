@@ -0,0 +1,39 @@
+#ifndef __EXT2_CSUM_H__
+#define __EXT2_CSUM_H__
+
+#include <stddef.h>
+
+// CRC32C checksums of every block of an image, kept in a file next to it
+// (the image name followed by ".csum") since ext2 has no room for them.
+// ext2_checker --init-csum makes the file. From then on open_image finds it,
+// every block is checked against it the first time it is looked up or read,
+// and the checksums of blocks that may have changed are brought up to date
+// when the image is checkpointed, synced or closed.
+
+#define CSUM_MAGIC 0x4D534332      // "2CSM"
+#define CSUM_SUFFIX ".csum"
+
+// Block 0 of a checksum file. The checksum of image block n is the nth
+// unsigned int from block 1 on.
+struct csum_header {
+    unsigned int magic;
+    unsigned int blocks_count;      // blocks in the image file it was made for
+    unsigned char uuid[16];         // s_uuid of that image
+};
+
+extern int csum_enabled;            // 1 if the open image has a checksum file
+extern unsigned int csum_errors;    // blocks found not to match their checksums
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+void crc32c_blocks(const unsigned char *blocks, unsigned int count, unsigned int *crcs);
+
+int csum_init_image(char *image_name);
+int csum_open(char *image_name, unsigned long long file_blocks, int writable, unsigned int pinned);
+void csum_touch(unsigned int block_num, const unsigned char *block);
+void csum_check(unsigned int block_num, unsigned int count, const unsigned char *buf);
+void csum_update(unsigned int block_num, unsigned int count, const unsigned char *buf);
+int csum_flush(int forget);
+void csum_close();
+unsigned int csum_verify_metadata();
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+// A block of a file, in the order the block map iterator visits it
+struct file_block {
+    unsigned int old_num;       // where the block is now
+    unsigned int new_num;       // where the block is moved to
+    int metadata;               // 1 for an indirect block
+};
+
+// A file that may be moved
+struct candidate {
+    unsigned int inum;
+    unsigned int first_block;   // lowest physical block of the file
+    unsigned int num_blocks;    // data and indirect blocks
+    unsigned int fragments;     // number of physically contiguous pieces
+};
+
+// Collects the data and indirect blocks of inode in walk order into *list.
+// Returns the number of blocks or -1 if memory runs out.
+static int collect_blocks(struct ext2_inode *inode, struct file_block **list) {
+
+    struct block_iter iter;
+    struct block_run run;
+    unsigned int n = 0;
+    unsigned int max_n = inode->i_blocks / (EXT2_BLOCK_SIZE / 512);
+    unsigned int i;
+
+    *list = malloc((max_n + 1) * sizeof(struct file_block));
+    if(*list == NULL)
+        return -1;
+
+    block_iter_init(&iter, inode);
+    while(block_iter_next(&iter, &run)) {
+        for(i = 0; i < run.length && run.physical != 0 && n < max_n; i++) {
+            (*list)[n].old_num = run.physical + i;
+            (*list)[n].metadata = run.metadata;
+            n++;
+        }
+    }
+    return n;
+}
+
+// Returns the number of physically contiguous pieces in list
+static unsigned int count_fragments(struct file_block *list, int n) {
+
+    unsigned int fragments = 0;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if(i == 0 || list[i].old_num != list[i - 1].old_num + 1)
+            fragments++;
+    }
+    return fragments;
+}
+
+static int compare_old_num(const void *a, const void *b) {
+
+    unsigned int x = ((struct file_block *)a)->old_num;
+    unsigned int y = ((struct file_block *)b)->old_num;
+    return (x > y) - (x < y);
+}
+
+// Returns the new location of block old_num, or 0 if it is not a block of the file
+static unsigned int translate(struct file_block *sorted, int n, unsigned int old_num) {
+
+    struct file_block key;
+    struct file_block *found;
+
+    key.old_num = old_num;
+    found = bsearch(&key, sorted, n, sizeof(struct file_block), compare_old_num);
+    return found == NULL ? 0 : found->new_num;
+}
+
+// Moves the n blocks in list of inode into the free run starting at start,
+// rebuilding its indirect blocks, and updates the bitmaps one run at a time.
+// Returns 0 on success or -1 if memory runs out or the image cannot be written.
+static int move_file(struct ext2_inode *inode, struct file_block *list, int n, unsigned int start) {
+
+    struct file_block *sorted;
+    unsigned char block[EXT2_BLOCK_SIZE];
+    unsigned int *ptrs;
+    unsigned int run_start;
+    int i;
+    int j;
+
+    // Copy every block to its new place, bypassing the block cache
+    for(i = 0; i < n; i++) {
+        list[i].new_num = start + i;
+        if(read_blocks(list[i].old_num, 1, block) == -1 || write_blocks(list[i].new_num, 1, block) == -1)
+            return -1;
+    }
+
+    sorted = malloc(n * sizeof(struct file_block));
+    if(sorted == NULL)
+        return -1;
+    memcpy(sorted, list, n * sizeof(struct file_block));
+    qsort(sorted, n, sizeof(struct file_block), compare_old_num);
+
+    // Point the new indirect blocks and the inode at the new places
+    for(i = 0; i < n; i++) {
+        if(list[i].metadata == 0)
+            continue;
+        ptrs = (unsigned int *)get_block(list[i].new_num);
+        for(j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+            if(ptrs[j] != 0)
+                ptrs[j] = translate(sorted, n, ptrs[j]);
+        }
+    }
+    for(j = 0; j < 15; j++) {
+        if(inode->i_block[j] != 0)
+            inode->i_block[j] = translate(sorted, n, inode->i_block[j]);
+    }
+
+    // Release the old blocks run by run and take the new run in one step
+    run_start = 0;
+    for(i = 1; i <= n; i++) {
+        if(i == n || sorted[i].old_num != sorted[i - 1].old_num + 1) {
+            deallocate_blocks(sorted[run_start].old_num, i - run_start);
+            run_start = i;
+        }
+    }
+    mark_blocks_used(start, n);
+
+    free(sorted);
+    return 0;
+}
+
+static int compare_first_block(const void *a, const void *b) {
+
+    unsigned int x = ((struct candidate *)a)->first_block;
+    unsigned int y = ((struct candidate *)b)->first_block;
+    return (x > y) - (x < y);
+}
+
+// Prints how the free space of the image is split up
+static void report_free_space(char *when) {
+
+    unsigned int block_num;
+    unsigned int runs = 0;
+    unsigned int length = 0;
+    unsigned int largest = 0;
+
+    for(block_num = sb->s_first_data_block; block_num < sb->s_blocks_count; block_num++) {
+        if(block_in_use(block_num)) {
+            length = 0;
+            continue;
+        }
+        if(length++ == 0)
+            runs++;
+        if(length > largest)
+            largest = length;
+    }
+    printf("Free space %s: %u blocks in %u runs, largest run %u blocks\n", \
+            when, sb->s_free_blocks_count, runs, largest);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    int dry_run = 0;        // -n: only report
+    int consolidate = 0;    // -c: also move files down to merge free space
+    int opt;
+
+    while((opt = getopt(argc, argv, "nc")) != -1) {
+        if(opt == 'n')
+            dry_run = 1;
+        else if(opt == 'c')
+            consolidate = 1;
+        else
+            optind = argc + 1;
+    }
+
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: ext2_defrag [-n] [-c] <image file name>\n");
+        return -1;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[optind], dry_run ? O_RDONLY : O_RDWR) == -1) {
+        return -1;
+    }
+
+    /* Measure the fragmentation of every file */
+
+    unsigned int first_ino = (sb->s_rev_level < EXT2_DYNAMIC_REV) ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    struct candidate *candidates = malloc(sb->s_inodes_count * sizeof(struct candidate));
+    unsigned int num_candidates = 0;
+    unsigned int num_files = 0;
+    unsigned int num_fragmented = 0;
+    struct ext2_inode *inode;
+    unsigned short type;
+    struct file_block *list;
+    unsigned int inum;
+    int n;
+    int j;
+
+    if(candidates == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for(inum = 1; inum <= sb->s_inodes_count; inum++) {
+        // Reserved inodes other than the root are not files
+        if((inum < first_ino && inum != EXT2_ROOT_INO) || inode_in_use(inum) == 0)
+            continue;
+
+        inode = get_inode(inum);
+        type = inode->i_mode & EXT2_IMODE_MASK;
+        if(type != EXT2_S_IFREG && type != EXT2_S_IFDIR && type != EXT2_S_IFLNK)
+            continue;
+
+        n = collect_blocks(inode, &list);
+        if(n == -1) {
+            perror("malloc");
+            return -1;
+        }
+        if(n == 0) {
+            free(list);
+            continue;
+        }
+
+        num_files++;
+        candidates[num_candidates].inum = inum;
+        candidates[num_candidates].first_block = list[0].old_num;
+        for(j = 1; j < n; j++) {
+            if(list[j].old_num < candidates[num_candidates].first_block)
+                candidates[num_candidates].first_block = list[j].old_num;
+        }
+        candidates[num_candidates].num_blocks = n;
+        candidates[num_candidates].fragments = count_fragments(list, n);
+        if(candidates[num_candidates].fragments > 1) {
+            num_fragmented++;
+            if(dry_run)
+                printf("inode %u: %u blocks in %u fragments\n", inum, n, candidates[num_candidates].fragments);
+        }
+        num_candidates++;
+        free(list);
+        checkpoint_image();
+    }
+
+    printf("%u of %u files are fragmented\n", num_fragmented, num_files);
+    report_free_space("before");
+
+    /* Move each fragmented file into a contiguous free run */
+    /* With -c, move every file down to the lowest run that fits it */
+
+    unsigned int i;
+    unsigned int start;
+    unsigned int num_moved = 0;
+    struct candidate *cand;
+
+    // Going from the bottom of the disk up lets later files fill the gaps earlier ones leave
+    if(consolidate)
+        qsort(candidates, num_candidates, sizeof(struct candidate), compare_first_block);
+
+    for(i = 0; i < num_candidates; i++) {
+        cand = &candidates[i];
+        if(cand->fragments <= 1 && consolidate == 0)
+            continue;
+
+        start = find_free_run(cand->num_blocks);
+        if(start == 0)
+            continue;
+        if(cand->fragments <= 1 && start > cand->first_block)
+            continue;
+
+        num_moved++;
+        if(dry_run)
+            continue;
+
+        inode = get_inode(cand->inum);
+        n = collect_blocks(inode, &list);
+        if(n == -1 || move_file(inode, list, n, start) == -1) {
+            fprintf(stderr, "ext2_defrag: could not move inode %u\n", cand->inum);
+            return -1;
+        }
+        free(list);
+        if(checkpoint_image() == -1)
+            return -1;
+    }
+
+    if(dry_run) {
+        printf("%u files would be moved\n", num_moved);
+    }
+    else {
+        printf("%u files moved\n", num_moved);
+        report_free_space("after");
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2_dircompact <image file name> <absolute path to directory>\n");
+        return -1;
+    }
+
+    if(argv[2][0] != '/') {
+        return ENOENT;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[1], O_RDWR) == -1) {
+        return -1;
+    }
+
+    /* Check if path is a directory */
+
+    unsigned int dir_inum = pathwalk(argv[2]);
+    if(dir_inum == 0) {
+        return ENOENT;
+    }
+
+    struct ext2_inode *dir_inode = get_inode(dir_inum);
+    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+        return ENOTDIR;
+    }
+
+    /* Rewrite the directory's entries densely and release its empty blocks */
+
+    if(compact_directory(dir_inum) == -1) {
+        fprintf(stderr, "ext2_dircompact: cannot compact %s\n", argv[2]);
+        return -1;
+    }
+
+    return 0;
+}
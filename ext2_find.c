@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <regex.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+#define MAX_THREADS 64
+
+// A directory waiting to be searched
+struct dir_work {
+    unsigned int inum;
+    char *path;                 // path of the directory without the trailing /
+    struct dir_work *next;
+};
+
+// Filters given on the command line
+static char *glob_pattern;          // -n
+static regex_t name_regex;          // -e
+static int use_regex;
+static unsigned char type_filter;   // -t as an EXT2_FT_ value, or EXT2_FT_UNKNOWN
+static char size_cmp;               // -s: '+', '-' or '=', or 0 when not given
+static unsigned long long size_arg;
+static char links_cmp;              // -l: like size_cmp
+static unsigned long long links_arg;
+
+// Directories shared by the threads
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct dir_work *queue;      // directories not started yet, most recent first
+static unsigned int busy;           // threads searching a directory, which may add more
+static unsigned char *dirs_seen;    // bit n set once directory n has been queued
+
+// Returns a pointer to the ] that ends the bracket expression at set, or NULL if there is none
+static const char *set_end(const char *set) {
+
+    const char *p = set + 1;
+
+    if(*p == '!' || *p == '^')
+        p++;
+    if(*p == ']')           // a ] right after the [ is part of the set
+        p++;
+    while(*p != '\0' && *p != ']')
+        p++;
+    return *p == ']' ? p : NULL;
+}
+
+// Matches c against the token at *pattern (a character, ?, a bracket expression or
+// an escaped character) and moves *pattern past the token if it matches
+static int match_char(const char **pattern, unsigned char c) {
+
+    const char *p = *pattern;
+    const char *end;
+    unsigned char lo;
+    unsigned char hi;
+    int negate;
+    int matched;
+
+    if(*p == '?') {
+        matched = 1;
+        p++;
+    }
+    else if(*p == '[' && (end = set_end(p)) != NULL) {
+        p++;
+        negate = (*p == '!' || *p == '^');
+        if(negate)
+            p++;
+        matched = 0;
+        while(p < end) {
+            lo = *p;
+            hi = lo;
+            if(p + 2 < end && p[1] == '-') {
+                hi = p[2];
+                p += 2;
+            }
+            if(lo <= c && c <= hi)
+                matched = 1;
+            p++;
+        }
+        p = end + 1;
+        matched ^= negate;
+    }
+    else {
+        if(*p == '\\' && p[1] != '\0')
+            p++;
+        matched = ((unsigned char)*p == c);
+        p++;
+    }
+
+    if(matched)
+        *pattern = p;
+    return matched;
+}
+
+// Returns 1 if the len bytes at name match the shell pattern pattern.
+// name need not end with a NUL, so entry names are matched where they lie.
+static int glob_match(const char *pattern, const char *name, int len) {
+
+    const char *star = NULL;    // pattern after the last * seen
+    int star_n = 0;             // name position that * was last tried to end at
+    int n = 0;
+
+    while(n < len) {
+        if(*pattern == '*') {
+            star = ++pattern;
+            star_n = n;
+            continue;
+        }
+        if(*pattern != '\0' && match_char(&pattern, name[n])) {
+            n++;
+            continue;
+        }
+        // Let the last * take one more character and try again
+        if(star == NULL)
+            return 0;
+        pattern = star;
+        n = ++star_n;
+    }
+    while(*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+// Returns the EXT2_FT_ type of the file entry names
+static unsigned char entry_type(struct ext2_dir_entry *entry) {
+
+    unsigned short mode;
+
+    if(entry->file_type != EXT2_FT_UNKNOWN)
+        return entry->file_type;
+
+    // Images without the filetype feature only keep the type in the inode
+    mode = get_inode(entry->inode)->i_mode & EXT2_IMODE_MASK;
+    if(mode == EXT2_S_IFREG)
+        return EXT2_FT_REG_FILE;
+    if(mode == EXT2_S_IFDIR)
+        return EXT2_FT_DIR;
+    if(mode == EXT2_S_IFLNK)
+        return EXT2_FT_SYMLINK;
+    return EXT2_FT_UNKNOWN;
+}
+
+// Returns 1 if value passes the comparison cmp against arg
+static int compare(char cmp, unsigned long long value, unsigned long long arg) {
+
+    if(cmp == '+')
+        return value > arg;
+    if(cmp == '-')
+        return value < arg;
+    return value == arg;
+}
+
+// Returns 1 if entry passes every filter
+static int matches(struct ext2_dir_entry *entry) {
+
+    struct ext2_inode *inode;
+    regmatch_t match;
+
+    if(type_filter != EXT2_FT_UNKNOWN && entry_type(entry) != type_filter)
+        return 0;
+    if(glob_pattern != NULL && glob_match(glob_pattern, entry->name, entry->name_len) == 0)
+        return 0;
+
+    // REG_STARTEND bounds the match by the name length instead of a NUL
+    if(use_regex) {
+        match.rm_so = 0;
+        match.rm_eo = entry->name_len;
+        if(regexec(&name_regex, entry->name, 1, &match, REG_STARTEND) != 0)
+            return 0;
+    }
+
+    if(size_cmp != 0 || links_cmp != 0) {
+        inode = get_inode(entry->inode);
+        if(size_cmp != 0 && compare(size_cmp, inode->i_size, size_arg) == 0)
+            return 0;
+        if(links_cmp != 0 && compare(links_cmp, inode->i_links_count, links_arg) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Queues the directory inum, unless it has been queued before.
+// path is taken over by the queue.
+static void push_dir(unsigned int inum, char *path) {
+
+    struct dir_work *work;
+
+    // A directory reached twice means the tree has a loop
+    if(__atomic_fetch_or(&dirs_seen[inum / 8], 1 << (inum % 8), __ATOMIC_RELAXED) & (1 << (inum % 8))) {
+        free(path);
+        return;
+    }
+
+    work = malloc(sizeof(struct dir_work));
+    if(work == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    work->inum = inum;
+    work->path = path;
+
+    pthread_mutex_lock(&queue_lock);
+    work->next = queue;
+    queue = work;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Prints the entries of one directory that pass the filters and queues its subdirectories
+static void search_dir(struct dir_work *work) {
+
+    struct ext2_inode *dir_inode = get_inode(work->inum);
+    struct ext2_dir_entry *entry;
+    unsigned int block_idx = 0;
+    unsigned int offset = 0;
+    char *path;
+
+    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR || dir_inode->i_block[0] == 0)
+        return;
+    prefetch_inode_blocks(dir_inode);
+
+    entry = (struct ext2_dir_entry *)get_block(dir_inode->i_block[0]);
+    while(entry != NULL && entry->rec_len != 0) {
+        if(entry->inode != 0 && entry->inode <= sb->s_inodes_count && \
+                strncmp(entry->name, ".", max(entry->name_len, 1)) != 0 && \
+                strncmp(entry->name, "..", max(entry->name_len, 2)) != 0) {
+
+            // One printf per line keeps lines from different threads whole
+            if(matches(entry))
+                printf("%s/%.*s\n", work->path, entry->name_len, entry->name);
+
+            if(entry_type(entry) == EXT2_FT_DIR) {
+                path = malloc(strlen(work->path) + entry->name_len + 2);
+                if(path == NULL) {
+                    perror("malloc");
+                    exit(ENOMEM);
+                }
+                sprintf(path, "%s/%.*s", work->path, entry->name_len, entry->name);
+                push_dir(entry->inode, path);
+            }
+        }
+        entry = move_entry(entry, work->inum, &block_idx, &offset);
+    }
+}
+
+// Takes directories off the queue until every directory has been searched
+static void *worker(void *arg) {
+
+    struct dir_work *work;
+
+    while(1) {
+        pthread_mutex_lock(&queue_lock);
+        while(queue == NULL && busy > 0)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if(queue == NULL) {
+            pthread_cond_broadcast(&queue_cond);
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        work = queue;
+        queue = work->next;
+        busy++;
+        pthread_mutex_unlock(&queue_lock);
+
+        search_dir(work);
+        free(work->path);
+        free(work);
+
+        pthread_mutex_lock(&queue_lock);
+        busy--;
+        if(busy == 0 && queue == NULL)
+            pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+// Reads a comparison like +10k from arg into *cmp and *value.
+// Returns 0 on success or -1.
+static int parse_compare(char *arg, char *cmp, unsigned long long *value) {
+
+    char *end;
+
+    *cmp = '=';
+    if(arg[0] == '+' || arg[0] == '-')
+        *cmp = *arg++;
+    *value = strtoull(arg, &end, 10);
+    if(end == arg)
+        return -1;
+    if(*end == 'k')
+        *value <<= 10;
+    else if(*end == 'M')
+        *value <<= 20;
+    else if(*end == 'G')
+        *value <<= 30;
+    else if(*end != '\0')
+        return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int bad = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:e:t:s:l:j:")) != -1) {
+        if(opt == 'n')
+            glob_pattern = optarg;
+        else if(opt == 'e') {
+            if(regcomp(&name_regex, optarg, REG_EXTENDED | REG_NOSUB) != 0) {
+                fprintf(stderr, "ext2_find: bad regular expression %s\n", optarg);
+                return EINVAL;
+            }
+            use_regex = 1;
+        }
+        else if(opt == 't' && strcmp(optarg, "f") == 0)
+            type_filter = EXT2_FT_REG_FILE;
+        else if(opt == 't' && strcmp(optarg, "d") == 0)
+            type_filter = EXT2_FT_DIR;
+        else if(opt == 't' && strcmp(optarg, "l") == 0)
+            type_filter = EXT2_FT_SYMLINK;
+        else if(opt == 's')
+            bad |= parse_compare(optarg, &size_cmp, &size_arg);
+        else if(opt == 'l')
+            bad |= parse_compare(optarg, &links_cmp, &links_arg);
+        else if(opt == 'j')
+            num_threads = atoi(optarg);
+        else
+            bad = 1;
+    }
+
+    if(bad || (optind != argc - 1 && optind != argc - 2)) {
+        fprintf(stderr, "Usage: ext2_find [-n glob] [-e regex] [-t f|d|l] [-s [+-]size[kMG]] [-l [+-]links] " \
+                "[-j threads] <image file name> [absolute path]\n");
+        return EINVAL;
+    }
+    if(num_threads < 1)
+        num_threads = 1;
+    if(num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[optind], O_RDONLY) == -1) {
+        return ENOENT;
+    }
+
+    /* Find the directory to start from */
+
+    char *start = optind == argc - 2 ? argv[optind + 1] : "/";
+    char *path;
+    int inum;
+
+    if(start[0] != '/') {
+        fprintf(stderr, "ext2_find: %s is not an absolute path\n", start);
+        return EINVAL;
+    }
+    inum = strcmp(start, "/") == 0 ? EXT2_ROOT_INO : pathwalk(start);
+    if(inum <= 0) {
+        fprintf(stderr, "ext2_find: %s does not exist\n", start);
+        return ENOENT;
+    }
+    if((get_inode(inum)->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+        fprintf(stderr, "ext2_find: %s is not a directory\n", start);
+        return ENOTDIR;
+    }
+
+    // Results are printed as "<path>/<name>", so the start loses any trailing /
+    path = strdup(start);
+    while(strlen(path) > 0 && path[strlen(path) - 1] == '/')
+        path[strlen(path) - 1] = '\0';
+
+    dirs_seen = calloc(sb->s_inodes_count / 8 + 1, 1);
+    if(path == NULL || dirs_seen == NULL) {
+        perror("malloc");
+        return ENOMEM;
+    }
+    push_dir(inum, path);
+
+    /* Search the tree, one directory per thread at a time */
+
+    pthread_t threads[MAX_THREADS];
+    long i;
+
+    for(i = 0; i < num_threads; i++) {
+        if(pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    for(i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    return 0;
+}
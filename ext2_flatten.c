@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+#define MAX_RUN 256         // blocks copied by one read and write
+
+// Returns 1 if bit n of bitmap is set
+static int present(unsigned char *bitmap, unsigned int n) {
+    return (bitmap[n / 8] >> (n % 8)) & 1;
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2_flatten <image file name> <delta file name>\n");
+        return -1;
+    }
+
+    /* Open the base image and the delta written through EXT2_OVERLAY */
+
+    int image_fd = open(argv[1], O_RDWR);
+    int delta_fd = open(argv[2], O_RDONLY);
+    struct stat image_stats;
+    struct ext2_super_block super;
+    struct overlay_header header;
+    unsigned char *bitmap;
+
+    if(image_fd == -1 || fstat(image_fd, &image_stats) == -1) {
+        perror(argv[1]);
+        return ENOENT;
+    }
+    if(delta_fd == -1) {
+        perror(argv[2]);
+        return ENOENT;
+    }
+    if(overlay_load(delta_fd, &header, &bitmap) == -1)
+        return EINVAL;
+
+    if(pread(image_fd, &super, sizeof(super), 1024) != sizeof(super)) {
+        perror("pread");
+        return EIO;
+    }
+    if(header.blocks_count != image_stats.st_size / EXT2_BLOCK_SIZE || \
+            memcmp(header.base_uuid, super.s_uuid, sizeof(header.base_uuid)) != 0) {
+        fprintf(stderr, "ext2_flatten: %s was not made from %s\n", argv[2], argv[1]);
+        return EINVAL;
+    }
+
+    /* Copy each run of blocks in the delta over the image */
+
+    // If this stops part way, the delta is still there and running it again finishes the job
+    unsigned char buf[MAX_RUN * EXT2_BLOCK_SIZE];
+    unsigned int merged = 0;
+    unsigned int block_num = 0;
+    unsigned int n;
+    size_t size;
+
+    while(block_num < header.blocks_count) {
+        if(present(bitmap, block_num) == 0) {
+            block_num++;
+            continue;
+        }
+
+        for(n = 1; n < MAX_RUN && block_num + n < header.blocks_count && present(bitmap, block_num + n); n++);
+        size = (size_t)n * EXT2_BLOCK_SIZE;
+        if(pread(delta_fd, buf, size, (off_t)(1 + header.bitmap_blocks + block_num) * EXT2_BLOCK_SIZE) != size) {
+            perror("pread");
+            return EIO;
+        }
+        if(pwrite(image_fd, buf, size, (off_t)block_num * EXT2_BLOCK_SIZE) != size) {
+            perror("pwrite");
+            return EIO;
+        }
+
+        merged += n;
+        block_num += n;
+    }
+
+    if(fsync(image_fd) == -1) {
+        perror("fsync");
+        return EIO;
+    }
+
+    // The image now holds every change, so the delta is not needed any more
+    if(unlink(argv[2]) == -1) {
+        perror("unlink");
+        return EIO;
+    }
+
+    printf("Merged %u blocks from %s into %s\n", merged, argv[2], argv[1]);
+    return 0;
+}
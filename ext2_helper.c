@@ -2,409 +2,2764 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
+#include "ext2_stats.h"
+#include "ext2_csum.h"
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gd;
+unsigned int num_groups;    // number of block groups in the image
+int image_threads;          // 1 between begin_threads and end_threads
+
+#define PTRS_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int))    // pointers in an indirect block
+#define DIR_LOCKS 256       // locks that directories share by inode number while threads run
+#define DIR_INDEXES (4 * DIR_LOCKS) // directories whose free space is indexed at once
+
+static const unsigned char zero_block[EXT2_BLOCK_SIZE];
+
+static __thread struct reservation *active;    // what allocate_inode and allocate_block hand out first
+
+static int image_writable;      // 1 if open_image opened the image for writing
+static int track_groups;        // 1 while the groups of blocks looked up get EXT2_BG_DIRTY
+
+// While threads run, each group's bitmaps and descriptor are changed under
+// the group's lock, and directories are searched under a shared lock and
+// changed under an exclusive one. The superblock's free counts would be
+// changed by every allocation on every thread, so each thread keeps its
+// changes to itself until fold_free_counts.
+static pthread_mutex_t *group_locks;
+static pthread_rwlock_t dir_locks[DIR_LOCKS];
+static __thread int free_blocks_delta;      // changes to s_free_blocks_count not folded in yet
+static __thread int free_inodes_delta;      // changes to s_free_inodes_count not folded in yet
+
+// Free space of the block groups, kept in a segment tree so that the lowest
+// group with free blocks and the lowest run of free blocks are found without
+// visiting every group of a large image.
+// The leaves are groups: a group's bitmap is a single block, so it is scanned
+// directly rather than getting levels of its own.
+// The tree is made the first time an allocation needs it and is kept up to
+// date by mark_block_used, deallocate_block and change_blocks, which adjust
+// the runs around the bits they change rather than reading the bitmap again.
+// The longest run of a group is then an upper bound: taking blocks out of it
+// does not tell how long the runs left over are, so a run query that finds
+// a group's longest run too short reads the bitmap and asks again. The programs
+// that edit bitmaps or free counts by themselves (ext2_checker, ext2_mkfs
+// before it allocates, ext2_resize) do so before the tree exists.
+struct space_node {
+    unsigned int free;          // sum of bg_free_blocks_count over the range (changed atomically)
+    unsigned int len;           // blocks in the range
+    unsigned int prefix;        // free blocks at the start of the range
+    unsigned int suffix;        // free blocks at the end of the range
+    unsigned int longest;       // longest run of free blocks in the range
+    unsigned int unread;        // groups in the range whose bitmap was not read yet
+};
+
+// Until a group's bitmap is read, its runs are taken to be as long as the
+// group, and a run query that depends on them reads it first.
+static struct space_node *space;    // node 1 is the root, node n has children 2n and 2n + 1
+static unsigned int space_leaves;   // node of group 0: the group count rounded up to a power of two
+static pthread_mutex_t space_lock = PTHREAD_MUTEX_INITIALIZER;     // runs in the tree, while threads run
+
+// How much room each block of a directory has for a new entry, so that
+// add_new_entry goes straight to a block the entry fits in instead of
+// walking the directory. It is built by the first insert into the directory.
+// Directories whose inode numbers are equal modulo DIR_INDEXES share an
+// index, and so share a lock while threads run. A gap may be larger than
+// the room its block really has (ext2_restore takes room back without
+// telling the index); add_new_entry corrects it when it finds the block full.
+// remove_entry updates the gap of the block it frees space in, and
+// compact_directory drops the index.
+// The gaps are the leaves of a binary tree whose nodes hold the largest gap
+// below them, so the first block an entry fits in is found in log time
+// rather than by scanning the blocks before it.
+struct dir_index {
+    unsigned int inum;          // directory the index is for (0 if none)
+    unsigned int num_blocks;    // blocks of the directory in gaps
+    unsigned int max_blocks;    // blocks gaps has room for, a power of 2
+    unsigned short *gaps;       // most space any entry of each block has after itself
+    unsigned short *most;       // largest gap below each node 1 to max_blocks - 1 of the
+                                // tree, whose children are 2n and 2n + 1 and whose
+                                // leaf for block i is node max_blocks + i
+};
+
+static struct dir_index dir_indexes[DIR_INDEXES];
+
+static unsigned int inode_size();
+static int space_build();
+static unsigned int *block_pointer(struct ext2_inode *inode, unsigned int logical, int create);
+
+// Opens the image file with the block I/O backend chosen by EXT2_IO.
+// flags is O_RDONLY or O_RDWR.
+// If EXT2_OVERLAY names a delta file, the image itself is only read and
+// every change goes to the delta instead (see ext2_flatten).
+// Changes are written back when the program exits.
+// If the image has a checksum file, its blocks are checked and the file is
+// kept up to date (see ext2_csum.h), except through an overlay.
+// Opened for writing, the image is marked as not cleanly closed until
+// close_image, and every group whose blocks are looked up or written is
+// flagged with EXT2_BG_DIRTY for ext2_checker.
+// Returns 0 on success.
+// Returns -1 if the image cannot be opened or is not an ext2 image.
+int open_image(char *image_name, int flags) {
+
+    static int registered = 0;      // 1 once close_image runs at exit
+
+    stats_init();
+    stats_phase("open");
+
+    char *overlay = getenv("EXT2_OVERLAY");
+    if(overlay != NULL && overlay[0] == '\0')
+        overlay = NULL;
+
+    int image_fd = open(image_name, overlay != NULL ? O_RDONLY : flags);
+    if(image_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat image_stats;
+    if(fstat(image_fd, &image_stats) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if(image_stats.st_size < 3 * EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "%s: image is too small\n", image_name);
+        return -1;
+    }
+
+    // The superblock decides how many blocks the backend keeps pinned
+    struct ext2_super_block super;
+    if(pread(image_fd, &super, sizeof(super), 1024) != sizeof(super)) {
+        perror("pread");
+        return -1;
+    }
+    if(super.s_magic != EXT2_SUPER_MAGIC || super.s_blocks_per_group == 0) {
+        fprintf(stderr, "%s: not an ext2 image\n", image_name);
+        return -1;
+    }
+    if((unsigned long long)super.s_blocks_count * EXT2_BLOCK_SIZE > image_stats.st_size) {
+        fprintf(stderr, "%s: image is shorter than its block count\n", image_name);
+        return -1;
+    }
+
+    // Pin enough descriptor blocks for every group the file has room for,
+    // so the descriptor table can grow in place (see ext2_resize)
+    unsigned long long file_blocks = image_stats.st_size / EXT2_BLOCK_SIZE;
+    unsigned int max_groups = (file_blocks - super.s_first_data_block + super.s_blocks_per_group - 1) / \
+                              super.s_blocks_per_group;
+    unsigned int pinned = super.s_first_data_block + 1 + \
+            (max_groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+    int writable = (flags & O_ACCMODE) != O_RDONLY;
+    if(overlay != NULL && overlay_open(overlay, image_fd, image_stats.st_size, writable) == -1)
+        return -1;
+    if(io_open(image_fd, image_stats.st_size, writable, pinned) == -1)
+        return -1;
+
+    sb = (struct ext2_super_block *)(get_block(0) + 1024);
+    if(overlay == NULL && csum_open(image_name, file_blocks, writable, pinned) == -1)
+        return -1;
+
+    // Group descriptors start in the block after the superblock
+    gd = (struct ext2_group_desc *)get_block(sb->s_first_data_block + 1);
+    num_groups = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) / \
+                 sb->s_blocks_per_group;
+
+    // The cleared flag reaches the file before any change does, so a crash
+    // in between leaves the image marked for a full check
+    if(writable && (sb->s_state & EXT2_VALID_FS)) {
+        sb->s_state &= ~EXT2_VALID_FS;
+        if(sync_image() == -1)
+            return -1;
+    }
+    image_writable = writable;
+    track_groups = writable;
+
+    if(registered == 0) {
+        atexit(close_image);
+        registered = 1;
+    }
+    stats_phase("run");
+    return 0;
+}
+
+// Writes back every change and closes the image opened by open_image
+void close_image() {
+
+    unsigned int i;
+
+    if(io == NULL)
+        return;
+    stats_phase("close");
+
+    // Every change reaches the file before the superblock says it is valid
+    if(image_writable && sync_image() == 0)
+        sb->s_state |= EXT2_VALID_FS;
+    image_writable = 0;
+    track_groups = 0;
+
+    free(space);
+    space = NULL;
+    for(i = 0; i < DIR_INDEXES; i++) {
+        free(dir_indexes[i].gaps);
+        free(dir_indexes[i].most);
+    }
+    memset(dir_indexes, 0, sizeof(dir_indexes));
+    csum_close();
+
+    // Nothing is left to pass the failure to once the program is exiting
+    if(io->close() == -1) {
+        fprintf(stderr, "close_image: changes could not be written back\n");
+        io = NULL;
+        fflush(NULL);
+        _exit(EIO);
+    }
+    io = NULL;
+}
+
+// Writes back every change and waits until it reaches the image file.
+// Returns 0 on success or -1.
+int sync_image() {
+    fold_free_counts();
+    if(csum_flush(0) == -1)
+        return -1;
+    return io->sync();
+}
+
+// Writes back changed blocks and lets the backend drop cached ones.
+// Every pointer returned by get_block or get_inode before this call is invalid after it.
+// Returns 0 on success or -1.
+int checkpoint_image() {
+    fold_free_counts();
+    if(csum_flush(1) == -1)
+        return -1;
+    return io->checkpoint();
+}
+
+// Lets several threads run the operations of ext2_ops.h (other than
+// ext2_restore) on the open image at once, until end_threads.
+// Call it before the threads start, without a reservation pending.
+// Every group must keep its bitmaps and inode table inside it, as the images
+// made by ext2_mkfs and ext2_resize do, and the image must not have a
+// checksum file (a block's checksum is checked while another thread could
+// already be changing it).
+// Returns 0 on success.
+// Returns -1 if the image does not allow it, in which case one thread has to do the work.
+int begin_threads() {
+
+    static int dir_locks_ready = 0;
+    pthread_mutexattr_t attr;
+    unsigned int group;
+    unsigned int start;
+    unsigned int end;
+    unsigned int table_end;
+    unsigned int i;
+
+    if(csum_enabled)
+        return -1;
+    for(group = 0; group < num_groups; group++) {
+        start = sb->s_first_data_block + group * sb->s_blocks_per_group;
+        end = start + group_blocks(group);
+        table_end = gd[group].bg_inode_table + \
+                    (sb->s_inodes_per_group * inode_size() + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        if(gd[group].bg_block_bitmap < start || gd[group].bg_block_bitmap >= end || \
+                gd[group].bg_inode_bitmap < start || gd[group].bg_inode_bitmap >= end || \
+                gd[group].bg_inode_table < start || table_end > end)
+            return -1;
+    }
+
+    // The tree is made now rather than by whichever thread allocates first
+    if(space_build() == -1)
+        return -1;
+
+    // A thread holding a group's lock looks up blocks of the group, which
+    // flags the group as dirty under the same lock
+    group_locks = malloc(num_groups * sizeof(pthread_mutex_t));
+    if(group_locks == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for(group = 0; group < num_groups; group++)
+        pthread_mutex_init(&group_locks[group], &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if(dir_locks_ready == 0) {
+        for(i = 0; i < DIR_LOCKS; i++)
+            pthread_rwlock_init(&dir_locks[i], NULL);
+        dir_locks_ready = 1;
+    }
+
+    image_threads = 1;
+    return 0;
+}
+
+// Goes back to one thread after the threads started since begin_threads are joined
+void end_threads() {
+
+    unsigned int group;
+
+    if(image_threads == 0)
+        return;
+
+    fold_free_counts();
+    image_threads = 0;
+    for(group = 0; group < num_groups; group++)
+        pthread_mutex_destroy(&group_locks[group]);
+    free(group_locks);
+    group_locks = NULL;
+}
+
+// Adds the changes this thread made to the superblock's free counts to the
+// superblock. The operations of ext2_ops.h do this when they finish.
+void fold_free_counts() {
+
+    if(free_blocks_delta != 0)
+        __atomic_fetch_add(&sb->s_free_blocks_count, free_blocks_delta, __ATOMIC_RELAXED);
+    if(free_inodes_delta != 0)
+        __atomic_fetch_add(&sb->s_free_inodes_count, free_inodes_delta, __ATOMIC_RELAXED);
+    free_blocks_delta = 0;
+    free_inodes_delta = 0;
+}
+
+// Adds delta to the superblock's count of free blocks, or to this thread's
+// share of it while threads run
+static void add_free_blocks(int delta) {
+    if(image_threads)
+        free_blocks_delta += delta;
+    else
+        sb->s_free_blocks_count += delta;
+}
+
+// Adds delta to the superblock's count of free inodes, or to this thread's
+// share of it while threads run
+static void add_free_inodes(int delta) {
+    if(image_threads)
+        free_inodes_delta += delta;
+    else
+        sb->s_free_inodes_count += delta;
+}
+
+// Takes the lock over the bitmaps and descriptor of group while threads run.
+// A thread may take it again while it holds it.
+void lock_group(unsigned int group) {
+    if(image_threads)
+        pthread_mutex_lock(&group_locks[group]);
+}
+
+void unlock_group(unsigned int group) {
+    if(image_threads)
+        pthread_mutex_unlock(&group_locks[group]);
+}
+
+// Takes the lock of directory dir_inum for changing it while threads run.
+// search_directory, add_new_entry and remove_entry leave locking to their
+// callers, which hold it from looking a name up until the entry is added or removed.
+void lock_directory(unsigned int dir_inum) {
+    if(image_threads)
+        pthread_rwlock_wrlock(&dir_locks[dir_inum % DIR_LOCKS]);
+}
+
+void unlock_directory(unsigned int dir_inum) {
+    if(image_threads)
+        pthread_rwlock_unlock(&dir_locks[dir_inum % DIR_LOCKS]);
+}
+
+// Flags the groups that hold count blocks from block_num as changed since ext2_checker last checked them
+static void mark_groups_dirty(unsigned int block_num, unsigned int count) {
+
+    unsigned int end = block_num + count - 1;
+    unsigned int group = block_num < sb->s_first_data_block ? 0 : block_group(block_num);
+    unsigned int last = end < sb->s_first_data_block ? 0 : block_group(end);
+
+    for(; group <= last; group++) {
+        if((gd[group].bg_flags & EXT2_BG_DIRTY) == 0) {
+            lock_group(group);
+            gd[group].bg_flags |= EXT2_BG_DIRTY;
+            update_group_checksum(group);
+            unlock_group(group);
+        }
+    }
+}
+
+// Returns a pointer to the start of the block block_num
+unsigned char *get_block(unsigned int block_num) {
+
+    unsigned char *block = io->get_block(block_num);
+
+    STAT_INC(blocks_touched);
+    if(__builtin_expect(csum_enabled, 0))
+        csum_touch(block_num, block);
+    if(track_groups)
+        mark_groups_dirty(block_num, 1);
+    return block;
+}
+
+// Copies count blocks from block_num into buf without keeping them cached.
+// Returns 0 on success or -1.
+int read_blocks(unsigned int block_num, unsigned int count, void *buf) {
+    STAT_ADD(blocks_read, count);
+    if(io->read(block_num, count, buf) == -1)
+        return -1;
+    if(__builtin_expect(csum_enabled, 0))
+        csum_check(block_num, count, buf);
+    return 0;
+}
+
+// Copies count blocks from buf to block_num without keeping them cached.
+// Returns 0 on success or -1.
+int write_blocks(unsigned int block_num, unsigned int count, const void *buf) {
+    STAT_ADD(blocks_written, count);
+    if(__builtin_expect(csum_enabled, 0))
+        csum_update(block_num, count, buf);
+    if(track_groups && count > 0)
+        mark_groups_dirty(block_num, count);
+    return io->write(block_num, count, buf);
+}
+
+// Size of an on-disk inode (revision 0 images always use 128 bytes)
+static unsigned int inode_size() {
+    if(sb->s_rev_level < EXT2_DYNAMIC_REV)
+        return 128;
+    return sb->s_inode_size;
+}
+
+// Returns the inode table block that holds the inode inum
+unsigned int inode_block(unsigned int inum) {
+
+    unsigned int idx = (inum - 1) % sb->s_inodes_per_group;  // index in the group's inode table
+    return gd[inode_group(inum)].bg_inode_table + idx * inode_size() / EXT2_BLOCK_SIZE;
+}
+
+// Returns a pointer to the inode that has the number inum
+struct ext2_inode *get_inode(unsigned int inum) {
+
+    unsigned int idx = (inum - 1) % sb->s_inodes_per_group;  // index in the group's inode table
+
+    unsigned int offset = idx * inode_size();                  // byte offset in the table
+
+    STAT_INC(inodes_touched);
+
+    // Inodes never straddle blocks, but the table blocks need not be adjacent in memory
+    unsigned char *block = get_block(inode_block(inum));
+    return (struct ext2_inode *)(block + offset % EXT2_BLOCK_SIZE);
+}
+
+// Returns the block group that contains block block_num
+unsigned int block_group(unsigned int block_num) {
+    return (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+// Returns the block group that contains inode inum
+unsigned int inode_group(unsigned int inum) {
+    return (inum - 1) / sb->s_inodes_per_group;
+}
+
+// Returns the number of blocks in group.
+// Only the last group can be shorter than s_blocks_per_group.
+unsigned int group_blocks(unsigned int group) {
+
+    unsigned int first = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    if(sb->s_blocks_count - first < sb->s_blocks_per_group)
+        return sb->s_blocks_count - first;
+    return sb->s_blocks_per_group;
+}
+
+// Returns 1 if group holds a copy of the superblock and group descriptors.
+// With sparse_super only groups 0, 1 and powers of 3, 5 and 7 have copies.
+int has_super(unsigned int group, int sparse) {
+
+    unsigned int base[3] = {3, 5, 7};
+    unsigned int power;
+    int i;
+
+    if(group <= 1 || sparse == 0)
+        return 1;
+
+    for(i = 0; i < 3; i++) {
+        for(power = base[i]; power < group; power *= base[i]);
+        if(power == group)
+            return 1;
+    }
+    return 0;
+}
+
+// CRC16 (polynomial 0x8005, reflected) used for group descriptor checksums
+static unsigned short crc16(unsigned short crc, unsigned char *data, unsigned int len) {
+
+    int i;
+    while(len-- > 0) {
+        crc ^= *data++;
+        for(i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+// Recomputes bg_checksum of group after its descriptor changed.
+// Only images with the gdt_csum feature (lazily formatted ones) carry checksums.
+void update_group_checksum(unsigned int group) {
+
+    if((sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM) == 0)
+        return;
+
+    unsigned short crc = crc16(~0, sb->s_uuid, sizeof(sb->s_uuid));
+    crc = crc16(crc, (unsigned char *)&group, sizeof(group));
+    crc = crc16(crc, (unsigned char *)&gd[group], offsetof(struct ext2_group_desc, bg_checksum));
+    gd[group].bg_checksum = crc;
+}
+
+int max(int a, int b) {
+    if(a > b)
+        return a;
+    return b;
+}
+
+// Checks if the block located at pos in bitmap is allocated
+// Returns 1 if it is allocated
+// Returns 0 if it is not allocated
+int check_allocation(unsigned char *bitmap, int num) {
+    int byte_pos = (num - 1) / 8;
+    int bit_pos = (num - 1) % 8;
+
+    if(bitmap[byte_pos] & (1 << bit_pos)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Set inode or block that has the number num to used
+void set_to_used(unsigned char *bitmap, int num) {
+
+    int byte_pos = (num - 1) / 8;
+    int bit_pos = (num - 1) % 8;
+    bitmap[byte_pos] = bitmap[byte_pos] | (1 << bit_pos);
+}
+
+// Sets the runs of node n from its children
+static void space_join(unsigned int n) {
+
+    struct space_node *node = &space[n];
+    struct space_node *left = &space[2 * n];
+    struct space_node *right = &space[2 * n + 1];
+
+    node->len = left->len + right->len;
+    node->prefix = left->prefix == left->len ? left->len + right->prefix : left->prefix;
+    node->suffix = right->suffix == right->len ? right->len + left->suffix : right->suffix;
+    node->longest = left->suffix + right->prefix;
+    if(left->longest > node->longest)
+        node->longest = left->longest;
+    if(right->longest > node->longest)
+        node->longest = right->longest;
+    node->unread = left->unread + right->unread;
+}
+
+// Works out the free runs of the leaf of group from its bitmap
+static void space_read_bitmap(unsigned int group) {
+
+    struct space_node *leaf = &space[space_leaves + group];
+    unsigned char *bitmap = get_block(gd[group].bg_block_bitmap);
+    unsigned int size = leaf->len;
+    unsigned int bit = 0;
+    unsigned int run = 0;       // free bits just before bit
+    unsigned int step;          // bits looked at in one go
+    int used;
+
+    leaf->prefix = size;
+    leaf->longest = 0;
+    while(bit < size) {
+        // Whole bytes that are fully free or fully used are taken at once
+        if(bit % 8 == 0 && bit + 8 <= size && (bitmap[bit / 8] == 0x00 || bitmap[bit / 8] == 0xff)) {
+            used = bitmap[bit / 8] != 0;
+            step = 8;
+        }
+        else {
+            used = (bitmap[bit / 8] >> (bit % 8)) & 1;
+            step = 1;
+        }
+
+        if(used) {
+            if(leaf->prefix == size)
+                leaf->prefix = bit;
+            if(run > leaf->longest)
+                leaf->longest = run;
+            run = 0;
+        }
+        else {
+            run += step;
+        }
+        bit += step;
+    }
+    if(run > leaf->longest)
+        leaf->longest = run;
+    leaf->suffix = run;
+    leaf->unread = 0;
+    STAT_ADD(bits_probed, size);
+}
+
+// Brings the free count of the leaf of group and every node above it up to
+// date with the group's descriptor
+static void space_count(unsigned int group) {
+
+    unsigned int leaf = space_leaves + group;
+    unsigned int delta = gd[group].bg_free_blocks_count - space[leaf].free;
+    unsigned int n;
+
+    // Only the free counts change on every allocation, and they are sums
+    for(n = leaf; n >= 1 && delta != 0; n /= 2)
+        __atomic_fetch_add(&space[n].free, delta, __ATOMIC_RELAXED);
+}
+
+// Brings the leaf of group up to date with its descriptor and its bitmap,
+// then every node above it.
+// While threads run, the caller holds the group's lock.
+static void space_update(unsigned int group) {
+
+    unsigned int n;
+
+    space_count(group);
+    if(image_threads)
+        pthread_mutex_lock(&space_lock);
+    space_read_bitmap(group);
+    for(n = (space_leaves + group) / 2; n >= 1; n /= 2)
+        space_join(n);
+    if(image_threads)
+        pthread_mutex_unlock(&space_lock);
+}
+
+// Brings the leaf of group up to date after count bits from bit of its
+// bitmap were all set (used is 1) or all cleared, then every node above it.
+// Only the runs that touch those bits are looked at.
+// While threads run, the caller holds the group's lock.
+static void space_change(unsigned int group, unsigned int bit, unsigned int count, int used) {
+
+    struct space_node *leaf = &space[space_leaves + group];
+    unsigned char *bitmap;
+    unsigned int first = bit;       // first bit of the free run the cleared bits are in
+    unsigned int end = bit + count; // bit after that run
+    unsigned int n;
+
+    space_count(group);
+    if(leaf->unread)
+        return;
+
+    if(image_threads)
+        pthread_mutex_lock(&space_lock);
+    if(used) {
+        if(first < leaf->prefix)
+            leaf->prefix = first;
+        if(end > leaf->len - leaf->suffix)
+            leaf->suffix = leaf->len - end;
+    }
+    else {
+        // Extend the cleared bits over the free bits on either side, a
+        // whole byte at a time where it is free
+        bitmap = get_block(gd[group].bg_block_bitmap);
+        while(first > 0) {
+            if(first % 8 == 0 && first >= 8 && bitmap[first / 8 - 1] == 0x00)
+                first -= 8;
+            else if(bitmap[(first - 1) / 8] & (1 << ((first - 1) % 8)))
+                break;
+            else
+                first--;
+        }
+        while(end < leaf->len) {
+            if(end % 8 == 0 && end + 8 <= leaf->len && bitmap[end / 8] == 0x00)
+                end += 8;
+            else if(bitmap[end / 8] & (1 << (end % 8)))
+                break;
+            else
+                end++;
+        }
+        STAT_ADD(bits_probed, end - first - count);
+
+        if(first == 0)
+            leaf->prefix = end;
+        if(end == leaf->len)
+            leaf->suffix = leaf->len - first;
+        if(end - first > leaf->longest)
+            leaf->longest = end - first;
+    }
+    for(n = (space_leaves + group) / 2; n >= 1; n /= 2)
+        space_join(n);
+    if(image_threads)
+        pthread_mutex_unlock(&space_lock);
+}
+
+// Makes the tree from the group descriptors alone, unless it is made already.
+// Returns 0 on success or -1.
+static int space_build() {
+
+    unsigned int group;
+    unsigned int n;
+    struct space_node *leaf;
+
+    if(space != NULL)
+        return 0;
+
+    for(space_leaves = 1; space_leaves < num_groups; space_leaves *= 2);
+    space = calloc(2 * space_leaves, sizeof(struct space_node));
+    if(space == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for(group = 0; group < num_groups; group++) {
+        leaf = &space[space_leaves + group];
+        leaf->free = gd[group].bg_free_blocks_count;
+        leaf->len = leaf->prefix = leaf->suffix = leaf->longest = group_blocks(group);
+        leaf->unread = 1;
+    }
+    for(n = space_leaves - 1; n >= 1; n--) {
+        space[n].free = space[2 * n].free + space[2 * n + 1].free;
+        space_join(n);
+    }
+    return 0;
+}
+
+// Returns the lowest group from group on whose descriptor counts free blocks,
+// or num_groups if there is none
+static unsigned int next_group_with_space(unsigned int group) {
+
+    unsigned int n;
+
+    if(group >= num_groups || space_build() == -1)
+        return num_groups;
+
+    // Climb until the node on the right of the way up has free blocks
+    n = space_leaves + group;
+    if(__atomic_load_n(&space[n].free, __ATOMIC_RELAXED) != 0)
+        return group;
+    while(n > 1 && (n % 2 == 1 || __atomic_load_n(&space[n + 1].free, __ATOMIC_RELAXED) == 0))
+        n /= 2;
+    if(n == 1)
+        return num_groups;
+
+    // Then take the leftmost way down through nodes with free blocks
+    for(n++; n < space_leaves;
+         n = __atomic_load_n(&space[2 * n].free, __ATOMIC_RELAXED) != 0 ? 2 * n : 2 * n + 1);
+    return n - space_leaves;
+}
+
+// Returns the first bit of the lowest run of count free bits among the first
+// size bits of bitmap, or -1 if there is no such run
+static int bitmap_run(unsigned char *bitmap, unsigned int size, unsigned int count) {
+
+    unsigned int bit;
+    unsigned int length = 0;    // length of the current free run
+
+    for(bit = 0; bit < size; bit++) {
+        // Skip whole bytes that are fully used
+        if(bit % 8 == 0 && bit + 8 <= size && bitmap[bit / 8] == 0xff) {
+            length = 0;
+            bit += 7;
+            continue;
+        }
+
+        if(bitmap[bit / 8] & (1 << (bit % 8))) {
+            length = 0;
+            continue;
+        }
+        if(++length == count) {
+            STAT_ADD(bits_probed, bit + 1);
+            return bit + 1 - count;
+        }
+    }
+    STAT_ADD(bits_probed, size);
+    return -1;
+}
+
+// Returns a group whose bitmap was not read yet among those that a run
+// crossing from the groups first..middle - 1 into middle..last - 1 would
+// cover, or num_groups if the runs of all of them are known
+static unsigned int unread_across(unsigned int first, unsigned int middle, unsigned int last) {
+
+    struct space_node *leaf;
+    unsigned int group;
+
+    for(group = middle; group-- > first; ) {
+        leaf = &space[space_leaves + group];
+        if(leaf->unread)
+            return group;
+        if(leaf->suffix != leaf->len)
+            break;
+    }
+    for(group = middle; group < last && group < num_groups; group++) {
+        leaf = &space[space_leaves + group];
+        if(leaf->unread)
+            return group;
+        if(leaf->prefix != leaf->len)
+            break;
+    }
+    return num_groups;
+}
+
+// Looks for the lowest run of count free blocks under node n, which covers
+// width groups from group on and may hold such a run going by its longest.
+// Returns the first block of the run, or 0 if a bitmap the answer depends on
+// had to be read first, in which case the caller asks again.
+static unsigned int space_run(unsigned int n, unsigned int group, unsigned int width, unsigned int count) {
+
+    struct space_node *left = &space[2 * n];
+    struct space_node *right = &space[2 * n + 1];
+    unsigned int half = width / 2;
+    unsigned int unread;
+    int bit;
+
+    if(n >= space_leaves) {
+        if(space[n].unread) {
+            space_update(group);
+            return 0;
+        }
+        bit = bitmap_run(get_block(gd[group].bg_block_bitmap), space[n].len, count);
+
+        // The longest run was longer before blocks were taken out of it
+        if(bit == -1) {
+            space_update(group);
+            return 0;
+        }
+        return sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+    }
+
+    if(left->longest >= count)
+        return space_run(2 * n, group, half, count);
+    if(left->suffix + right->prefix >= count) {
+        unread = unread_across(group, group + half, group + width);
+        if(unread != num_groups) {
+            space_update(unread);
+            return 0;
+        }
+        return sb->s_first_data_block + (group + half) * sb->s_blocks_per_group - left->suffix;
+    }
+    return space_run(2 * n + 1, group + half, half, count);
+}
+
+// Returns the first block of the lowest run of count consecutive free blocks,
+// or 0 if there is no such run
+static unsigned int lowest_free_run(unsigned int count) {
+
+    unsigned int block_num = 0;
+
+    if(count == 0 || space_build() == -1)
+        return 0;
+
+    // Every answer of 0 read one more bitmap, which leaves that group's
+    // runs exact, so this ends
+    while(block_num == 0 && space[1].longest >= count)
+        block_num = space_run(1, 0, space_leaves, count);
+    return block_num;
+}
+
+// Returns 1 if block block_num is marked as in-use in its group's bitmap
+// Returns 0 if it is not
+int block_in_use(unsigned int block_num) {
+
+    unsigned int group = block_group(block_num);
+    unsigned int bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+    return check_allocation(get_block(gd[group].bg_block_bitmap), bit + 1);
+}
+
+// Returns 1 if inode inum is marked as in-use in its group's bitmap
+// Returns 0 if it is not
+int inode_in_use(unsigned int inum) {
+
+    unsigned int group = inode_group(inum);
+    unsigned int bit = (inum - 1) % sb->s_inodes_per_group;
+    return check_allocation(get_block(gd[group].bg_inode_bitmap), bit + 1);
+}
+
+// Marks block block_num as in-use and updates the free counters
+void mark_block_used(unsigned int block_num) {
+
+    unsigned int group = block_group(block_num);
+    unsigned int bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+
+    lock_group(group);
+    set_to_used(get_block(gd[group].bg_block_bitmap), bit + 1);
+    add_free_blocks(-1);
+    gd[group].bg_free_blocks_count--;
+    update_group_checksum(group);
+    if(space != NULL)
+        space_change(group, bit, 1, 1);
+    unlock_group(group);
+}
+
+// Marks inode inum as in-use and updates the free counters
+void mark_inode_used(unsigned int inum) {
+
+    unsigned int group = inode_group(inum);
+    unsigned int bit = (inum - 1) % sb->s_inodes_per_group;
+
+    lock_group(group);
+    set_to_used(get_block(gd[group].bg_inode_bitmap), bit + 1);
+    add_free_inodes(-1);
+    gd[group].bg_free_inodes_count--;
+    update_group_checksum(group);
+    unlock_group(group);
+}
+
+// Returns the index of the first free bit in bitmap between start and end
+// (end is exclusive), or -1 if every bit in that range is in use.
+// Fully used 64-bit words are skipped without testing each bit.
+static int find_free_bit(unsigned char *bitmap, int start, int end) {
+
+    int bit = start;
+    unsigned long long word;
+
+    while(bit < end) {
+        if(bit % 64 == 0 && bit + 64 <= end) {
+            memcpy(&word, bitmap + bit / 8, sizeof(word));
+            if(word == ~0ULL) {
+                bit += 64;
+                continue;
+            }
+        }
+        if((bitmap[bit / 8] & (1 << (bit % 8))) == 0) {
+            STAT_ADD(bits_probed, bit - start + 1);
+            return bit;
+        }
+        bit++;
+    }
+    STAT_ADD(bits_probed, end - start);
+    return -1;
+}
+
+// Makes sure the inode table of group is initialized up to inode index idx.
+// A lazily formatted group leaves the last bg_itable_unused inodes of its table
+// unwritten, so the table blocks are zeroed here the first time they are used.
+static void init_inode_table(unsigned int group, unsigned int idx) {
+
+    struct ext2_group_desc *desc = &gd[group];
+    unsigned int ipg = sb->s_inodes_per_group;
+    unsigned int per_block = EXT2_BLOCK_SIZE / inode_size();
+    unsigned int initialized = ipg - desc->bg_itable_unused;  // inodes already usable
+    unsigned int block;                                       // index of a block in the table
+    unsigned int start;                                       // offset to start zeroing from
+
+    if((desc->bg_flags & EXT2_BG_INODE_ZEROED) || idx < initialized)
+        return;
+
+    // Zero from the first uninitialized inode to the end of the block holding idx
+    for(block = initialized / per_block; block <= idx / per_block; block++) {
+        start = 0;
+        if(block == initialized / per_block)
+            start = (initialized % per_block) * inode_size();
+        memset(get_block(desc->bg_inode_table + block) + start, 0, EXT2_BLOCK_SIZE - start);
+    }
+
+    initialized = (idx / per_block + 1) * per_block;
+    if(initialized >= ipg) {
+        desc->bg_itable_unused = 0;
+        desc->bg_flags |= EXT2_BG_INODE_ZEROED;
+    }
+    else {
+        desc->bg_itable_unused = ipg - initialized;
+    }
+    update_group_checksum(group);
+}
+
+// Finds an empty inode in the table and allocates it.
+// It returns inode number for inode if it is found or
+// it returns 0 if there is no more empty inodes.
+int allocate_inode() {
+
+    unsigned int group;
+    int idx;
+    int first_idx;      // first index that may be allocated in this group
+    unsigned int inum = 0;
+    struct ext2_inode *inode;
+    unsigned long long start;
+
+    // The reserved inode was already cleared by reserve
+    if(active != NULL && active->inum != 0) {
+        inum = active->inum;
+        active->inum = 0;
+        return inum;
+    }
+
+    start = OP_START();
+    for(group = 0; group < num_groups; group++) {
+        if(gd[group].bg_free_inodes_count == 0)
+            continue;
+
+        // Skip the reserved inodes (and lost+found) at the start of the first group
+        first_idx = 0;
+        if(group == 0)
+            first_idx = (sb->s_rev_level < EXT2_DYNAMIC_REV) ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+
+        // Check if there is an avaliable inode in this group
+        lock_group(group);
+        idx = find_free_bit(get_block(gd[group].bg_inode_bitmap), first_idx, sb->s_inodes_per_group);
+        if(idx == -1) {
+            unlock_group(group);
+            continue;
+        }
+
+        inum = group * sb->s_inodes_per_group + idx + 1;
+        init_inode_table(group, idx);
+        mark_inode_used(inum);
+        unlock_group(group);
+        inode = get_inode(inum);
+        memset(inode, 0, inode_size());
+        break;
+    }
+    OP_END(OP_ALLOC_INODE, inum, start);
+    return inum;
+}
+
+// Finds an empty block and allocates it.
+// It returns block number for data block if it is found or
+// it returns 0 if there is no more empty data blocks.
+int allocate_block() {
+
+    unsigned int group;
+    int bit;
+    unsigned int block_num = 0;
+    unsigned long long start;
+
+    if(active != NULL && active->next < active->num_blocks) {
+        block_num = active->blocks[active->next++];
+        write_blocks(block_num, 1, zero_block);
+        return block_num;
+    }
+
+    start = OP_START();
+    for(group = next_group_with_space(0); group < num_groups; group = next_group_with_space(group + 1)) {
+        // Check if there is an avaiable block in this group
+        lock_group(group);
+        bit = find_free_bit(get_block(gd[group].bg_block_bitmap), 0, group_blocks(group));
+        if(bit == -1) {
+            unlock_group(group);
+            continue;
+        }
+
+        // Zeroed by writing through, as most new blocks are data that is written the same way
+        block_num = sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+        if(write_blocks(block_num, 1, zero_block) == -1)
+            block_num = 0;
+        else
+            mark_block_used(block_num);
+        unlock_group(group);
+        break;
+    }
+    OP_END(OP_ALLOC_BLOCK, block_num, start);
+    return block_num;
+}
+
+// Finds the lowest run of count consecutive free blocks.
+// Returns the first block of the run if it is found or
+// returns 0 if there is no such run.
+unsigned int find_free_run(unsigned int count) {
+
+    unsigned long long start = OP_START();
+    unsigned int block_num = lowest_free_run(count);
+
+    OP_END(OP_ALLOC_BLOCK, block_num, start);
+    return block_num;
+}
+
+// Sets aside an inode (if inodes is 1) and count blocks for one operation, so
+// that once this succeeds the operation cannot run out of space half way.
+// The blocks are found in one pass over the block bitmaps, lowest first, and
+// are marked in use straight away. Until release_reservation is called,
+// allocate_inode and allocate_block hand out what was reserved before
+// looking anywhere else.
+// Returns 0 on success.
+// Returns -1 if there is not enough space, in which case nothing is reserved.
+int reserve(struct reservation *res, unsigned int inodes, unsigned int count) {
+
+    unsigned int group;
+    unsigned int block_num;
+    int bit;
+
+    memset(res, 0, sizeof(struct reservation));
+    if(__atomic_load_n(&sb->s_free_blocks_count, __ATOMIC_RELAXED) < count ||
+       __atomic_load_n(&sb->s_free_inodes_count, __ATOMIC_RELAXED) < inodes)
+        return -1;
+
+    res->blocks = malloc((count + 1) * sizeof(unsigned int));
+    if(res->blocks == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for(group = next_group_with_space(0); group < num_groups && res->num_blocks < count; \
+            group = next_group_with_space(group + 1)) {
+        bit = 0;
+        lock_group(group);
+        while(res->num_blocks < count && \
+                (bit = find_free_bit(get_block(gd[group].bg_block_bitmap), bit, group_blocks(group))) != -1) {
+            block_num = sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+            mark_block_used(block_num);
+            res->blocks[res->num_blocks++] = block_num;
+            bit++;
+        }
+        unlock_group(group);
+    }
+
+    // The free counts said there was room, but the bitmaps disagree
+    if(res->num_blocks < count || (inodes > 0 && (res->inum = allocate_inode()) == 0)) {
+        release_reservation(res);
+        return -1;
+    }
+
+    active = res;
+    return 0;
+}
+
+// Gives back whatever part of res was not used and stops handing it out
+void release_reservation(struct reservation *res) {
+
+    if(res->inum != 0)
+        deallocate_inode(res->inum);
+    while(res->next < res->num_blocks)
+        deallocate_block(res->blocks[res->next++]);
+    free(res->blocks);
+    memset(res, 0, sizeof(struct reservation));
+    if(active == res)
+        active = NULL;
+}
+
+// Deallocate inode at inum
+void deallocate_inode(int inum) {
+
+    unsigned int group = inode_group(inum);
+    unsigned int bit = (inum - 1) % sb->s_inodes_per_group;
+
+    lock_group(group);
+    unsigned char *inode_bitmap = get_block(gd[group].bg_inode_bitmap);
+
+    int byte_pos = bit / 8;
+    int bit_pos = bit % 8;
+    inode_bitmap[byte_pos] = inode_bitmap[byte_pos] & ~(1 << bit_pos);
+    add_free_inodes(1);
+    gd[group].bg_free_inodes_count++;
+    update_group_checksum(group);
+    unlock_group(group);
+}
+
+// Deallocate block at block_num
+void deallocate_block(int block_num) {
+
+    unsigned int group = block_group(block_num);
+    unsigned int bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+
+    lock_group(group);
+    unsigned char *block_bitmap = get_block(gd[group].bg_block_bitmap);
+
+    int byte_pos = bit / 8;
+    int bit_pos = bit % 8;
+    block_bitmap[byte_pos] = block_bitmap[byte_pos] & ~(1 << bit_pos);
+    add_free_blocks(1);
+    gd[group].bg_free_blocks_count++;
+    update_group_checksum(group);
+    if(space != NULL)
+        space_change(group, bit, 1, 0);
+    unlock_group(group);
+}
+
+// Sets (used is 1) or clears (used is 0) the bits of count blocks starting
+// at block_num and updates the free counters of every group it touches.
+// Whole bytes are handled at once.
+// Returns the number of bits that actually changed.
+static unsigned int change_blocks(unsigned int block_num, unsigned int count, int used) {
+
+    unsigned int group;
+    unsigned int bit;           // bit of block_num in its group's bitmap
+    unsigned int first;         // bit of the first block in this group
+    unsigned int end;           // bit after the last one in this group
+    unsigned int changed;       // bits changed in this group
+    unsigned int total = 0;
+    unsigned char *bitmap;
+    unsigned char mask;
+    unsigned char value = used ? 0xff : 0x00;
+
+    while(count > 0) {
+        group = block_group(block_num);
+        bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+        end = bit + count;
+        if(end > sb->s_blocks_per_group)
+            end = sb->s_blocks_per_group;
+        first = bit;
+        lock_group(group);
+        bitmap = get_block(gd[group].bg_block_bitmap);
+
+        block_num += end - bit;
+        count -= end - bit;
+        changed = 0;
+        while(bit < end) {
+            if(bit % 8 == 0 && bit + 8 <= end) {
+                changed += __builtin_popcount(bitmap[bit / 8] ^ value);
+                bitmap[bit / 8] = value;
+                bit += 8;
+            }
+            else {
+                mask = 1 << (bit % 8);
+                if(((bitmap[bit / 8] & mask) != 0) != used) {
+                    bitmap[bit / 8] ^= mask;
+                    changed++;
+                }
+                bit++;
+            }
+        }
+
+        if(used) {
+            add_free_blocks(-changed);
+            gd[group].bg_free_blocks_count -= changed;
+        }
+        else {
+            add_free_blocks(changed);
+            gd[group].bg_free_blocks_count += changed;
+        }
+        update_group_checksum(group);
+        if(space != NULL)
+            space_change(group, first, end - first, used);
+        unlock_group(group);
+        total += changed;
+    }
+    return total;
+}
+
+// Marks count blocks starting at block_num as in-use.
+// Returns the number of blocks that were not in use before.
+unsigned int mark_blocks_used(unsigned int block_num, unsigned int count) {
+    return change_blocks(block_num, count, 1);
+}
+
+// Deallocates count blocks starting at block_num.
+// Returns the number of blocks that were in use before.
+unsigned int deallocate_blocks(unsigned int block_num, unsigned int count) {
+    return change_blocks(block_num, count, 0);
+}
+
+// Returns the number of blocks marked as in-use among count blocks starting at block_num
+unsigned int count_blocks_in_use(unsigned int block_num, unsigned int count) {
+
+    unsigned int total = 0;
+    unsigned int group;
+    unsigned int bit;
+    unsigned int end;
+    unsigned char *bitmap;
+
+    while(count > 0) {
+        group = block_group(block_num);
+        bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+        end = bit + count;
+        if(end > sb->s_blocks_per_group)
+            end = sb->s_blocks_per_group;
+        bitmap = get_block(gd[group].bg_block_bitmap);
+
+        block_num += end - bit;
+        count -= end - bit;
+        while(bit < end) {
+            if(bit % 8 == 0 && bit + 8 <= end) {
+                total += __builtin_popcount(bitmap[bit / 8]);
+                bit += 8;
+            }
+            else {
+                total += (bitmap[bit / 8] >> (bit % 8)) & 1;
+                bit++;
+            }
+        }
+    }
+    return total;
+}
+
+
+// cur_entry:  a pointer to current entry
+// dir_inum: inode numbfor for directory that contains current entry
+// block_idx: an index for the block that contains current entry 
+// offset: an offest for current entry in this block
+// Move from current entry to the next entry in this directory
+// Returns a pointer to the next entry if there is one.
+// Returns NULL if current entry is the last entry in this directory.
+struct ext2_dir_entry *move_entry(struct ext2_dir_entry *cur_entry, unsigned int dir_inum, unsigned int *block_idx, unsigned int *offset)  {
+
+    STAT_INC(entries_visited);
+    // Move to next position in current block
+    *offset += cur_entry->rec_len;
+    
+    // Case 1: More entries left in current block
+    if(*offset < 1024) {
+        cur_entry = (struct ext2_dir_entry *)((unsigned char *)cur_entry + cur_entry->rec_len);
+        
+    }
+
+    // Case 2: No more entries left in current block
+    // Go to next block if it exists
+    else {
+        *offset = 0;
+        *block_idx += 1;
+
+        // Blocks after the twelfth are found through the indirect blocks,
+        // up to the size of the directory
+        struct ext2_inode *dir_inode = get_inode(dir_inum);
+        unsigned int *slot = NULL;
+        if(*block_idx < 12 || *block_idx < dir_inode->i_size / EXT2_BLOCK_SIZE)
+            slot = block_pointer(dir_inode, *block_idx, 0);
+
+        // Check if next block has entries
+        if(slot != NULL && *slot > 0) {
+            cur_entry = (struct ext2_dir_entry *)get_block(*slot);
+        }
+        // Next block is empty 
+        else {
+            return NULL;
+        }    
+    }    
+    return cur_entry;
+}
+
+
+// A name to look for, set up once for all the entries it is compared with
+struct name_key {
+    const char *name;
+    unsigned int len;
+    unsigned int last;          // last 4 bytes of the name (all of it if it is shorter)
+    unsigned int mask;          // bytes of last that belong to the name
+};
+
+static void make_key(struct name_key *key, const char *name, unsigned int len) {
+
+    unsigned int tail = len < 4 ? len : 4;
+
+    key->name = name;
+    key->len = len;
+    key->last = 0;
+    key->mask = 0;
+    memcpy(&key->last, name + len - tail, tail);
+    memset(&key->mask, 0xff, tail);
+}
+
+// Returns 1 if entry is in use and called key->name.
+// Entries are turned down on their length, and then on the last word of the
+// name (names in one directory often start the same, like file1, file2 ...),
+// before the rest of the names are compared. entry must have room for 4
+// bytes of name, as every entry takes at least 12 bytes.
+static int entry_matches(struct ext2_dir_entry *entry, struct name_key *key) {
+
+    unsigned int word;
+
+    if(entry->name_len != key->len || entry->inode == 0)
+        return 0;
+    if(key->len < 4) {
+        memcpy(&word, entry->name, 4);
+        return (word & key->mask) == key->last;
+    }
+    memcpy(&word, entry->name + key->len - 4, 4);
+    return word == key->last && memcmp(entry->name, key->name, key->len - 4) == 0;
+}
+
+// Returns inode number for the entry called key->name in a directory block,
+// or 0 if it has none
+static unsigned int scan_block(unsigned char *block, struct name_key *key) {
+
+    struct ext2_dir_entry *entry;
+    unsigned int offset = 0;
+
+    while(offset <= EXT2_BLOCK_SIZE - 12) {
+        entry = (struct ext2_dir_entry *)(block + offset);
+        STAT_INC(entries_visited);
+        if(entry_matches(entry, key))
+            return entry->inode;
+        if(entry->rec_len == 0)
+            break;
+        offset += entry->rec_len;
+    }
+    return 0;
+}
+
+// dir_inum: inode number for directory
+// name: name_len bytes of the name of the file, which need not be null-terminated
+// Checks if there is a file object with this name in this directory
+// Returns inode number for the file object if found.
+// Returns 0 if not found.
+// Returns -1 if dir_inum is not inode number for directory
+int search_name(unsigned int dir_inum, const char *name, unsigned int name_len) {
+
+    struct ext2_inode *dir_inode = get_inode(dir_inum);
+    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+        return -1;
+    }
+
+    unsigned long long start = OP_START();
+    unsigned int num_blocks = dir_inode->i_size / EXT2_BLOCK_SIZE;    // blocks in the directory
+    unsigned int block_idx;
+    unsigned int *slot;
+    struct name_key key;
+    int found = 0;      // inode number of the matching entry (0 if not found)
+
+    // Scan one block at a time, up to the first block the directory does not have
+    make_key(&key, name, name_len);
+    for(block_idx = 0; found == 0 && (block_idx < 12 || block_idx < num_blocks); block_idx++) {
+        slot = block_pointer(dir_inode, block_idx, 0);
+        if(slot == NULL || *slot == 0)
+            break;
+        found = scan_block(get_block(*slot), &key);
+    }
+ 
+    OP_END(OP_LOOKUP, dir_inum, start);
+    return found;
+}
+
+// Same as search_name, for a null-terminated name
+int search_directory(unsigned int dir_inum, char *name) {
+
+    return search_name(dir_inum, name, strlen(name));
+}
+
+// Finds the last file object in path and the directory it is in, in one
+// walk from the root directory. Names are compared where they are in path,
+// so nothing is copied or allocated, and threads may resolve paths at once.
+// Returns inode number for the last file object, also put in info, if path is valid.
+// Returns 0 if path is not valid.
+unsigned int resolve_path(const char *path, struct path_info *info) {
+
+    unsigned int cur_inum = 2;  // inode number for current file object (start from the root)
+    const char *pos = path;     // start of the current name
+    unsigned int len;           // length of the current name
+
+    info->inum = 0;
+    info->parent_inum = 0;
+    info->name = path;
+    info->name_len = 0;
+
+    // path must start from the root directory
+    if(path[0] != '/')
+        return 0;
+
+    // Examine each name on path one by one
+    while(1) {
+
+        // Skip the slashes before the name
+        while(*pos == '/')
+            pos++;
+        if(*pos == '\0')
+            break;
+        for(len = 0; pos[len] != '\0' && pos[len] != '/'; len++)
+            ;
+
+        // Only a directory has names after it
+        if(cur_inum != 0 && (get_inode(cur_inum)->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR)
+            cur_inum = 0;
+        info->parent_inum = cur_inum;
+        info->name = pos;
+        info->name_len = len;
+
+        // Go to next level in path, unless some directory on the way does not exist
+        if(cur_inum != 0) {
+            STAT_INC(path_components);
+
+            // Threads changing the directory hold its lock exclusively (see lock_directory)
+            if(image_threads)
+                pthread_rwlock_rdlock(&dir_locks[info->parent_inum % DIR_LOCKS]);
+            cur_inum = search_name(info->parent_inum, pos, len);
+            if(image_threads)
+                pthread_rwlock_unlock(&dir_locks[info->parent_inum % DIR_LOCKS]);
+        }
+        pos += len;
+    }
+
+    // If path is not a directory, it cannot end with /
+    if(cur_inum != 0 && pos[-1] == '/' && \
+            (get_inode(cur_inum)->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR)
+        cur_inum = 0;
+
+    info->inum = cur_inum;
+    return cur_inum;
+}
+
+// Returns inode number for last file obtject in path if path is valid.
+// Returns 0 if path is not valid.
+int pathwalk(char *path) {
+
+    struct path_info info;
+
+    return resolve_path(path, &info);
+}
+
+// Returns where entry can take a new entry of space_need bytes in the space
+// it has after itself, or NULL if it has not enough.
+// The new entry goes after the removed entries hidden there, so that
+// ext2_restore can still bring them back, unless they leave too little
+// room; then it goes right after entry, over them.
+static struct ext2_dir_entry *entry_room(struct ext2_dir_entry *entry, int space_need) {
+
+    unsigned char *end = (unsigned char *)entry + entry->rec_len;
+    unsigned char *pos = (unsigned char *)entry + (int)ceil((double)(8 + entry->name_len) / 4) * 4;
+    unsigned char *after = pos;     // first position after the hidden entries
+    struct ext2_dir_entry *hidden;
+
+    if(end - pos < space_need)
+        return NULL;
+
+    // Skip the hidden entries the way ext2_restore looks for them
+    while(end - after >= 8) {
+        hidden = (struct ext2_dir_entry *)after;
+        if(hidden->inode == 0)
+            break;
+        after += (int)ceil((double)(8 + hidden->name_len) / 4) * 4;
+    }
+
+    if(end - after >= space_need)
+        return (struct ext2_dir_entry *)after;
+    return (struct ext2_dir_entry *)pos;
+}
+
+// Returns the most space any entry of a directory block has after itself,
+// which is the largest new entry the block can take.
+static unsigned short block_gap(unsigned char *block) {
+
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block;
+    unsigned int offset = 0;
+    int space_have;
+    int gap = 0;
+
+    // Nothing has been written to the block yet
+    if(entry->rec_len == 0)
+        return EXT2_BLOCK_SIZE;
+
+    while(offset < EXT2_BLOCK_SIZE && entry->rec_len != 0) {
+        space_have = entry->rec_len - (int)ceil((double)(8 + entry->name_len) / 4) * 4;
+        if(space_have > gap)
+            gap = space_have;
+        offset += entry->rec_len;
+        entry = (struct ext2_dir_entry *)(block + offset);
+    }
+    return gap;
+}
+
+// Returns the largest gap below node n of the tree of index
+static unsigned short node_gap(struct dir_index *index, unsigned int n) {
+    return n >= index->max_blocks ? index->gaps[n - index->max_blocks] : index->most[n];
+}
+
+// Sets node n of the tree of index from its children
+static void update_node(struct dir_index *index, unsigned int n) {
+
+    unsigned short left = node_gap(index, 2 * n);
+    unsigned short right = node_gap(index, 2 * n + 1);
+
+    index->most[n] = left > right ? left : right;
+}
+
+// Sets the gap of block idx in index, which grows by a block if idx is its
+// number of blocks.
+// Returns 0 on success or -1 if memory runs out, and then the index is dropped.
+static int index_gap(struct dir_index *index, unsigned int idx, unsigned short gap) {
+
+    unsigned int n;
+
+    if(idx == index->num_blocks) {
+        if(idx == index->max_blocks) {
+            unsigned int max_blocks = index->max_blocks == 0 ? 16 : 2 * index->max_blocks;
+            unsigned short *gaps = realloc(index->gaps, max_blocks * sizeof(unsigned short));
+            if(gaps == NULL) {
+                index->inum = 0;
+                return -1;
+            }
+            index->gaps = gaps;
+            unsigned short *most = realloc(index->most, max_blocks * sizeof(unsigned short));
+            if(most == NULL) {
+                index->inum = 0;
+                return -1;
+            }
+            index->most = most;
+
+            // The tree is twice as wide now, so it is built again
+            memset(gaps + index->max_blocks, 0, (max_blocks - index->max_blocks) * sizeof(unsigned short));
+            index->max_blocks = max_blocks;
+            for(n = max_blocks - 1; n > 0; n--)
+                update_node(index, n);
+        }
+        index->num_blocks++;
+    }
+    index->gaps[idx] = gap;
+    for(n = (index->max_blocks + idx) / 2; n > 0; n /= 2)
+        update_node(index, n);
+    return 0;
+}
+
+// Returns the first block of index whose gap is at least space_need, or
+// the number of blocks in index if there is none
+static unsigned int first_fit(struct dir_index *index, int space_need) {
+
+    unsigned int n = 1;
+
+    if(index->max_blocks == 0 || index->most[1] < space_need)
+        return index->num_blocks;
+
+    // Go down to the leftmost leaf with room
+    while(n < index->max_blocks)
+        n = node_gap(index, 2 * n) >= space_need ? 2 * n : 2 * n + 1;
+    return n - index->max_blocks;
+}
+
+// Returns the index of directory dir_inum, which is built if the directory
+// has none or it does not cover all the blocks.
+// Returns NULL if memory runs out.
+static struct dir_index *directory_index(unsigned int dir_inum, struct ext2_inode *dir_inode) {
+
+    struct dir_index *index = &dir_indexes[dir_inum % DIR_INDEXES];
+    unsigned int num_blocks = dir_inode->i_size / EXT2_BLOCK_SIZE;
+    unsigned int *slot;
+    unsigned int i;
+
+    if(index->inum == dir_inum && index->num_blocks == num_blocks)
+        return index;
+
+    // What another directory left in the tree must not be found
+    index->inum = dir_inum;
+    index->num_blocks = 0;
+    if(index->max_blocks > 0) {
+        memset(index->gaps, 0, index->max_blocks * sizeof(unsigned short));
+        memset(index->most, 0, index->max_blocks * sizeof(unsigned short));
+    }
+    prefetch_inode_blocks(dir_inode);
+    for(i = 0; i < num_blocks; i++) {
+        // A hole takes no entries
+        slot = block_pointer(dir_inode, i, 0);
+        if(index_gap(index, i, slot == NULL || *slot == 0 ? 0 : block_gap(get_block(*slot))) == -1)
+            return NULL;
+    }
+    return index;
+}
+
+// Where find_room found room for a new entry
+struct dir_room {
+    unsigned int block_idx;             // block of the directory it is in
+    unsigned char *block;
+    struct ext2_dir_entry *entry;       // entry whose space it takes (NULL if the block is empty)
+    struct ext2_dir_entry *room;        // where the new entry goes
+};
+
+// Looks for room for a new entry of space_need bytes in the blocks
+// directory dir_inum already has, in the first block that has any
+// (trying every block in turn if index is NULL).
+// Returns 0 and fills in place if there is room.
+// Returns -1 if the directory has to grow for the new entry.
+static int find_room(struct ext2_inode *dir_inode, struct dir_index *index, int space_need, \
+        struct dir_room *place) {
+
+    unsigned int num_blocks = dir_inode->i_size / EXT2_BLOCK_SIZE;  // blocks in the directory
+    unsigned int cur_block_offset;      // offset at current block
+    unsigned int *slot;                 // where the block pointer of the current block is
+    unsigned char *block;
+
+    for(place->block_idx = 0; ; place->block_idx++) {
+
+        // The index goes straight to the next block whose gap is large enough
+        if(index != NULL)
+            place->block_idx = first_fit(index, space_need);
+        if(place->block_idx >= num_blocks)
+            break;
+        slot = block_pointer(dir_inode, place->block_idx, 0);
+        if(slot == NULL || *slot == 0) {
+            if(index != NULL)
+                index_gap(index, place->block_idx, 0);
+            continue;
+        }
+        block = get_block(*slot);
+        place->block = block;
+
+        // Case 1: Current block is empty
+        if(((struct ext2_dir_entry *)block)->rec_len == 0) {
+            place->entry = NULL;
+            place->room = (struct ext2_dir_entry *)block;
+            return 0;
+        }
+
+        // Case 2: Current block is not empty, so the new entry goes in the
+        // space an entry has after itself
+        for(cur_block_offset = 0; cur_block_offset < EXT2_BLOCK_SIZE; \
+                cur_block_offset += place->entry->rec_len) {
+            place->entry = (struct ext2_dir_entry *)(block + cur_block_offset);
+            if(place->entry->rec_len == 0)
+                break;
+            place->room = entry_room(place->entry, space_need);
+            if(place->room != NULL)
+                return 0;
+        }
+
+        // The gap was larger than the room the block has left
+        if(index != NULL)
+            index_gap(index, place->block_idx, block_gap(block));
+    }
+    return -1;
+}
+
+// Does the work of add_new_entry
+static int insert_entry(unsigned int dir_inum, struct ext2_dir_entry *new_entry) {
+   
+    // Obtain info for directory
+    struct ext2_inode *dir_inode = get_inode(dir_inum);   
+
+    // Return if type is not a directory
+    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) 
+        return -1;
+
+    struct dir_room place;                  // where the new entry goes
+    unsigned int *slot;                     // where the block pointer of a new block goes
+    struct dir_index *index = directory_index(dir_inum, dir_inode);
+
+    // Space needed for new entry, which needs to be aligned on 4 bytes boundaries
+    int space_need = ceil((double)(8 + new_entry->name_len) / 4) * 4;
+
+    // Case 3: No block has room, so the directory grows by a block, with the
+    // indirect blocks on the way to it
+    if(find_room(dir_inode, index, space_need, &place) == -1) {
+        place.block_idx = dir_inode->i_size / EXT2_BLOCK_SIZE;
+        slot = block_pointer(dir_inode, place.block_idx, 1);
+        if(slot != NULL && *slot == 0) {
+            *slot = allocate_block();
+            if(*slot != 0) {
+                dir_inode->i_blocks += 2;
+                dir_inode->i_size += 1024;
+            }
+        }
+        if(slot == NULL || *slot == 0) {
+            fprintf(stderr, "There is no more available data blocks.\n");
+            return -1;
+        }
+        place.block = get_block(*slot);
+        place.entry = NULL;
+        place.room = (struct ext2_dir_entry *)place.block;
+    }
+
+    // Split the space between the entry that had it and the new entry
+    struct ext2_dir_entry *room = place.room;
+    if(place.entry == NULL) {
+        room->rec_len = 1024;
+    }
+    else {
+        room->rec_len = (unsigned char *)place.entry + place.entry->rec_len - (unsigned char *)room;
+        place.entry->rec_len = (unsigned char *)room - (unsigned char *)place.entry;
+    }
+    room->inode = new_entry->inode;
+    room->name_len = new_entry->name_len;
+    room->file_type = new_entry->file_type;
+    strncpy(room->name, new_entry->name, room->name_len);
+
+    // What follows the new entry in its space is left of the entries it was
+    // written over, which ext2_restore must not take for whole ones
+    if(room->rec_len > space_need)
+        ((struct ext2_dir_entry *)((unsigned char *)room + space_need))->inode = 0;
+
+    if(index != NULL)
+        index_gap(index, place.block_idx, block_gap(place.block));
+    return 0;
+}    
+
+// Returns the number of blocks directory dir_inum needs for a new entry
+// with a name of name_len bytes: 0 if one of its blocks has room for it,
+// or else the block the directory grows by and the indirect blocks on the
+// way to it
+unsigned int directory_growth(unsigned int dir_inum, unsigned int name_len) {
+
+    struct ext2_inode *dir_inode = get_inode(dir_inum);
+    unsigned int logical = dir_inode->i_size / EXT2_BLOCK_SIZE;    // the block it would get
+    int space_need = ceil((double)(8 + name_len) / 4) * 4;
+    struct dir_room place;
+
+    if(find_room(dir_inode, directory_index(dir_inum, dir_inode), space_need, &place) == 0)
+        return 0;
+
+    if(logical < 12)
+        return 1;
+    logical -= 12;
+    if(logical < PTRS_PER_BLOCK)
+        return 1 + (dir_inode->i_block[12] == 0);
+    logical -= PTRS_PER_BLOCK;
+    if(logical < PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+        return 1 + (dir_inode->i_block[13] == 0) + (logical % PTRS_PER_BLOCK == 0);
+    logical -= PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    return 1 + (dir_inode->i_block[14] == 0) + (logical % (PTRS_PER_BLOCK * PTRS_PER_BLOCK) == 0) + \
+           (logical % PTRS_PER_BLOCK == 0);
+}
+
+// dir_inum: inode number for directory to which new entry is added
+// new_etnry: Entry that is newly added to this directory
+// Adds new entry to a directory. 
+// The directory may need directory_growth more blocks (see reserve).
+// Return 0 on success.
+// Return -1 if dir_inum is not inode number for a directory or
+// the directory needs a new block and there is none.
+int add_new_entry(unsigned int dir_inum, struct ext2_dir_entry *new_entry) {
+
+    unsigned long long start = OP_START();
+    int rv = insert_entry(dir_inum, new_entry);
+
+    OP_END(OP_CREATE, dir_inum, start);
+    return rv;
+}
+
+// dir_inum: inode number for directory
+// name: name of the entry to remove
+// Removes the entry called name from this directory by merging its space
+// into the entry before it, or by clearing its inode number if it is the
+// first entry in its block.
+// Returns the inode number the entry pointed to.
+// Returns 0 if there is no such entry.
+int remove_entry(unsigned int dir_inum, char *name) {
+
+    struct ext2_inode dir_inode = *get_inode(dir_inum);
+    unsigned long long start = OP_START();
+    int removed = 0;    // inode number of the removed entry
+
+    // Current data block info
+    unsigned int cur_block_idx = 0;     // idx for i_block
+    unsigned int cur_block_offset = 0;  // offset at current block
+
+    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry *)get_block(dir_inode.i_block[0]);
+    struct ext2_dir_entry *prev_entry = cur_entry;
+    struct dir_index *index;
+    struct name_key key;
+
+    make_key(&key, name, strlen(name));
+    while(cur_entry != NULL) {
+
+        // Check if we found the entry
+        if(entry_matches(cur_entry, &key)) {
+
+            removed = cur_entry->inode;
+
+            // The first entry in a block has no entry before it to take its space
+            if(cur_entry == prev_entry)
+                cur_entry->inode = 0;
+            else
+                prev_entry->rec_len += cur_entry->rec_len;
+
+            // The block can take a larger entry now
+            index = &dir_indexes[dir_inum % DIR_INDEXES];
+            if(index->inum == dir_inum && cur_block_idx < index->num_blocks)
+                index_gap(index, cur_block_idx, block_gap((unsigned char *)cur_entry - cur_block_offset));
+            break;
+        }
+
+        // Case 1: current entry points to the first entry in the next block
+        if(cur_block_offset + cur_entry->rec_len == 1024) {
+            cur_entry = move_entry(cur_entry, dir_inum, &cur_block_idx, &cur_block_offset);
+            prev_entry = cur_entry;
+        }
+        // Case 2: current entry points to the next entry in current block
+        else {
+            prev_entry = cur_entry;
+            cur_entry = move_entry(cur_entry, dir_inum, &cur_block_idx, &cur_block_offset);
+        }
+    }
+
+    OP_END(OP_UNLINK, dir_inum, start);
+    return removed;
+}
+// dir_inum: inode number for directory
+// Rewrites the entries of this directory densely from its first block on,
+// dropping removed and hidden entries, and releases the blocks that end up
+// empty at the end of the directory.
+// Returns the number of blocks released.
+// Returns -1 if dir_inum is not inode number for a directory, the directory
+// has holes or memory runs out.
+int compact_directory(unsigned int dir_inum) {
+
+    struct ext2_inode *dir_inode = get_inode(dir_inum);
+    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR)
+        return -1;
+    if(dir_indexes[dir_inum % DIR_INDEXES].inum == dir_inum)
+        dir_indexes[dir_inum % DIR_INDEXES].inum = 0;
+
+    // Collect the directory's blocks in logical order
+    unsigned int num_blocks = (dir_inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int *blocks = calloc(num_blocks, sizeof(unsigned int));
+    unsigned char *packed = calloc(num_blocks, EXT2_BLOCK_SIZE);     // new contents of the blocks
+    if(blocks == NULL || packed == NULL) {
+        free(blocks);
+        free(packed);
+        return -1;
+    }
+
+    struct block_iter iter;
+    struct block_run run;
+    unsigned int i;
+
+    block_iter_init(&iter, dir_inode);
+    while(block_iter_next(&iter, &run)) {
+        for(i = 0; i < run.length && run.metadata == 0; i++)
+            blocks[run.logical + i] = run.physical == 0 ? 0 : run.physical + i;
+    }
+
+    // Copy live entries one after another into packed
+    unsigned int out_block = 0;         // block being filled in packed
+    unsigned int out_offset = 0;        // offset in that block
+    struct ext2_dir_entry *last = NULL; // last entry written to packed
+    struct ext2_dir_entry *cur_entry;
+    unsigned int offset;
+    int space_used;
+
+    for(i = 0; i < num_blocks; i++) {
+        // Directories with holes are left alone
+        if(blocks[i] == 0) {
+            free(blocks);
+            free(packed);
+            return -1;
+        }
+
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += cur_entry->rec_len) {
+            cur_entry = (struct ext2_dir_entry *)(get_block(blocks[i]) + offset);
+            if(cur_entry->rec_len == 0)
+                break;
+            if(cur_entry->inode == 0)
+                continue;
+
+            space_used = ceil((double)(8 + cur_entry->name_len) / 4) * 4;
+
+            // Entry does not fit in this block: the last entry takes the rest of it
+            if(out_offset + space_used > EXT2_BLOCK_SIZE) {
+                last->rec_len += EXT2_BLOCK_SIZE - out_offset;
+                out_block++;
+                out_offset = 0;
+            }
+
+            last = (struct ext2_dir_entry *)(packed + out_block * EXT2_BLOCK_SIZE + out_offset);
+            memcpy(last, cur_entry, 8 + cur_entry->name_len);
+            last->rec_len = space_used;
+            out_offset += space_used;
+        }
+    }
+    if(last != NULL)
+        last->rec_len += EXT2_BLOCK_SIZE - out_offset;
+
+    // Write the packed blocks back and release the rest
+    unsigned int keep = out_block + 1;  // blocks still used by the directory
+    unsigned int before = dir_inode->i_blocks;
+
+    for(i = 0; i < keep; i++)
+        memcpy(get_block(blocks[i]), packed + i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+    truncate_blocks(dir_inode, keep);
+    dir_inode->i_size = keep * EXT2_BLOCK_SIZE;
+
+    free(blocks);
+    free(packed);
+    return (before - dir_inode->i_blocks) / (EXT2_BLOCK_SIZE / 512);
+}
+
+// Returns the name of the last file object in path, which is cut off the
+// '/' after it if there is one.
+// The name is part of path, so nothing is allocated.
+char *find_name(char *path) {
+
+    char *end = path + strlen(path);
+
+    while(end > path && end[-1] == '/')
+        end--;
+    *end = '\0';
+    while(end > path && end[-1] != '/')
+        end--;
+    return end;
+}
+
+
+/* From below is the block map iterator */
+
+// Starts a walk over the blocks of inode.
+// The walk covers the logical blocks below i_size and stops once it has
+// seen as many blocks as i_blocks accounts for, so inodes that keep other
+// data in i_block (fast symlinks) have no blocks.
+void block_iter_init(struct block_iter *iter, struct ext2_inode *inode) {
+
+    memset(iter, 0, sizeof(struct block_iter));
+    iter->inode = inode;
+    iter->num_blocks = (inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    iter->budget = inode->i_blocks / (EXT2_BLOCK_SIZE / 512);
+    iter->start = OP_START();
+}
+
+// Moves the walk one pointer forward.
+// Fills item with a single data block, a single indirect block (metadata)
+// or a hole covering every logical block under a missing pointer.
+// Returns 1 if there is an item, 0 at the end of the walk.
+static int next_block(struct block_iter *iter, struct block_run *item) {
+
+    unsigned int ptr;           // current block pointer
+    int level;                  // indirection level of ptr (0 for a data block)
+    unsigned int span;          // logical blocks under ptr
+    struct block_iter_level *top;
+    int i;
+
+    while(iter->logical < iter->num_blocks && iter->budget > 0) {
+
+        // Take the next pointer from the inode or from the innermost indirect block
+        if(iter->depth == 0) {
+            if(iter->slot >= 15)
+                return 0;
+            ptr = iter->inode->i_block[iter->slot];
+            level = (iter->slot < 12) ? 0 : iter->slot - 11;
+            iter->slot++;
+        }
+        else {
+            top = &iter->stack[iter->depth - 1];
+            if(top->idx >= PTRS_PER_BLOCK) {
+                iter->depth--;
+                continue;
+            }
+            ptr = ((unsigned int *)get_block(top->block_num))[top->idx++];
+            level = top->level - 1;
+        }
+
+        span = 1;
+        for(i = 0; i < level; i++)
+            span *= PTRS_PER_BLOCK;
+
+        // Case 1: missing (or out of range) pointer
+        if(ptr == 0 || ptr >= sb->s_blocks_count) {
+            if(span > iter->num_blocks - iter->logical)
+                span = iter->num_blocks - iter->logical;
+            item->logical = iter->logical;
+            item->physical = 0;
+            item->length = span;
+            item->metadata = 0;
+            iter->logical += span;
+            return 1;
+        }
+
+        // Case 2: data block
+        iter->budget--;
+        if(level == 0) {
+            item->logical = iter->logical++;
+            item->physical = ptr;
+            item->length = 1;
+            item->metadata = 0;
+            return 1;
+        }
+
+        // Case 3: indirect block, walk into it next
+        top = &iter->stack[iter->depth++];
+        top->block_num = ptr;
+        top->level = level;
+        top->idx = 0;
+        item->logical = iter->logical;
+        item->physical = ptr;
+        item->length = 1;
+        item->metadata = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Fills run with the next run of the walk: consecutive data blocks stored
+// in consecutive physical blocks, consecutive indirect blocks (metadata is 1),
+// or a hole (physical is 0).
+// Returns 1 if there is a run, 0 at the end of the walk.
+int block_iter_next(struct block_iter *iter, struct block_run *run) {
+
+    struct block_run item;
+
+    if(iter->has_pending == 0) {
+        if(next_block(iter, &iter->pending) == 0) {
+            // Only walks that reach the end are timed
+            OP_END(OP_BLOCK_MAP, 0, iter->start);
+            iter->start = 0;
+            return 0;
+        }
+        iter->has_pending = 1;
+    }
+
+    *run = iter->pending;
+    while(next_block(iter, &item)) {
+        // Extend the run if the item continues it
+        if(item.metadata == run->metadata && \
+                ((run->physical == 0 && item.physical == 0 && run->logical + run->length == item.logical) || \
+                 (run->physical != 0 && item.physical == run->physical + run->length))) {
+            run->length += item.length;
+        }
+        else {
+            iter->pending = item;
+            return 1;
+        }
+    }
+    iter->has_pending = 0;
+    return 1;
+}
+
+// Frees the blocks under the pointer *ptr (an indirect block of the given
+// level, or a data block if level is 0) that hold logical blocks at or
+// above keep. first is the first logical block under *ptr.
+static void truncate_tree(struct ext2_inode *inode, unsigned int *ptr, int level, \
+        unsigned int first, unsigned int keep) {
+
+    unsigned int span = 1;      // logical blocks under one pointer of *ptr
+    unsigned int *children;
+    int i;
 
-extern unsigned char *disk;
-extern struct ext2_super_block *sb;
-extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char *inode_bitmap;
-extern struct ext2_inode *inode_table;
+    for(i = 0; i < level - 1; i++)
+        span *= PTRS_PER_BLOCK;
 
-int max(int a, int b) {
-    if(a > b)
-        return a;
-    return b;
-}
+    if(*ptr == 0 || *ptr >= sb->s_blocks_count)
+        return;
+    if(level > 0 && first + span * PTRS_PER_BLOCK <= keep)
+        return;
+    if(level == 0 && first < keep)
+        return;
 
-// Checks if the block located at pos in bitmap is allocated
-// Returns 1 if it is allocated
-// Returns 0 if it is not allocated
-int check_allocation(unsigned char *bitmap, int num) {
-    int byte_pos = (num - 1) / 8;
-    int bit_pos = (num - 1) % 8;
+    if(level > 0) {
+        children = (unsigned int *)get_block(*ptr);
+        for(i = 0; i < PTRS_PER_BLOCK; i++)
+            truncate_tree(inode, &children[i], level - 1, first + i * span, keep);
 
-    if(bitmap[byte_pos] & (1 << bit_pos)) {
-        return 1;
+        // The indirect block still points to blocks that are kept
+        if(first < keep)
+            return;
     }
 
-    return 0;
+    deallocate_block(*ptr);
+    *ptr = 0;
+    inode->i_blocks -= EXT2_BLOCK_SIZE / 512;
 }
 
+// Releases every block of inode from logical block keep on, along with the
+// indirect blocks that no longer point to anything. i_size is left to the caller.
+void truncate_blocks(struct ext2_inode *inode, unsigned int keep) {
 
-// Set inode or block that has the number num to used
-void set_to_used(unsigned char *bitmap, int num) {
+    unsigned int first = 0;     // first logical block under i_block[slot]
+    unsigned int span;
+    int slot;
+    int level;
+    int i;
 
-    int byte_pos = (num - 1) / 8;
-    int bit_pos = (num - 1) % 8;
-    bitmap[byte_pos] = bitmap[byte_pos] | (1 << bit_pos);
-}
+    if(inode->i_blocks == 0)
+        return;
 
-// Finds an empty inode in the table and allocates it.
-// It returns inode number for inode if it is found or
-// it returns 0 if there is no more empty inodes.
-int allocate_inode() {
+    for(slot = 0; slot < 15; slot++) {
+        level = (slot < 12) ? 0 : slot - 11;
+        truncate_tree(inode, &inode->i_block[slot], level, first, keep);
 
-    int inum;
-    struct ext2_inode *inode;
-    for(inum = 12; inum <= 32; inum++) {
-        // Check if current inode is avaliable
-        if(check_allocation(inode_bitmap, inum) == 0) {
-            set_to_used(inode_bitmap, inum);
-            inode = &inode_table[inum - 1];
-            memset(inode, 0, 128);
-            sb->s_free_inodes_count--;
-            gd->bg_free_inodes_count--; 
-            return inum;
-        }
+        span = 1;
+        for(i = 0; i < level; i++)
+            span *= PTRS_PER_BLOCK;
+        first += span;
     }
-    return 0;
 }
 
-// Finds an empty block and allocates it.
-// It returns block number for data block if it is found or
-// it returns 0 if there is no more empty data blocks.
-int allocate_block() {
+// Returns the number of indirect blocks a file of num_blocks blocks needs
+// when none of them are holes
+unsigned int indirect_blocks(unsigned int num_blocks) {
 
-    int block_num;
-    unsigned char *block;
+    unsigned int count = 0;
+    unsigned int n;
 
-    for(block_num = 1; block_num <= 128; block_num++) { 
-        // Check if current block is avaiable
-        if(check_allocation(block_bitmap, block_num) == 0) {
-            block = disk + block_num * 1024;
-            memset(block, 0, 1024);
-            set_to_used(block_bitmap, block_num);
-            sb->s_free_blocks_count--;
-            gd->bg_free_blocks_count--;
-            return block_num;
-        }
-    }
-    return 0;
+    if(num_blocks <= 12)
+        return 0;
+    num_blocks -= 12;
+
+    // Single indirect
+    count++;
+    if(num_blocks <= PTRS_PER_BLOCK)
+        return count;
+    num_blocks -= PTRS_PER_BLOCK;
+
+    // Double indirect: the block in i_block[13] and one per PTRS_PER_BLOCK blocks
+    n = num_blocks < PTRS_PER_BLOCK * PTRS_PER_BLOCK ? num_blocks : PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    count += 1 + (n + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+    if(num_blocks <= PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+        return count;
+    num_blocks -= PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+
+    // Triple indirect: the block in i_block[14], then one double indirect
+    // block per PTRS_PER_BLOCK^2 blocks and one single per PTRS_PER_BLOCK
+    return count + 1 + (num_blocks + PTRS_PER_BLOCK * PTRS_PER_BLOCK - 1) / (PTRS_PER_BLOCK * PTRS_PER_BLOCK) + \
+           (num_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
 }
 
-// Deallocate inode at inum
-void deallocate_inode(int inum) {
+/* From below is the file handle API */
 
-    int byte_pos = (inum - 1) / 8;
-    int bit_pos = (inum - 1) % 8;
-    inode_bitmap[byte_pos] = inode_bitmap[byte_pos] & ~(1 << bit_pos);
-    sb->s_free_inodes_count++;
-    gd->bg_free_inodes_count++;
+#define READAHEAD_MIN 4                                             // first read-ahead window in blocks
+#define READAHEAD_MAX 64                                            // largest read-ahead window in blocks
+
+// Starts reading count blocks from block_num before they are used
+void prefetch_blocks(unsigned int block_num, unsigned int count) {
+    io->prefetch(block_num, count);
 }
 
-// Deallocate block at block_num
-void deallocate_block(int block_num) {
+// Starts reading every data and indirect block of inode before they are used
+void prefetch_inode_blocks(struct ext2_inode *inode) {
 
-    int byte_pos = (block_num - 1) / 8;
-    int bit_pos = (block_num - 1) % 8;
-    block_bitmap[byte_pos] = block_bitmap[byte_pos] & ~(1 << bit_pos);
-    sb->s_free_blocks_count++;
-    gd->bg_free_blocks_count++;
+    struct block_iter iter;
+    struct block_run run;
+
+    block_iter_init(&iter, inode);
+    while(block_iter_next(&iter, &run)) {
+        if(run.physical != 0)
+            prefetch_blocks(run.physical, run.length);
+    }
 }
 
+// Appends length blocks starting at logical to the block map of file,
+// merging them into the last run when they continue that run.
+// physical is 0 for a hole.
+static int add_to_map(struct ext2_file *file, unsigned int logical, unsigned int physical, \
+        unsigned int length) {
 
-// cur_entry:  a pointer to current entry
-// dir_inum: inode numbfor for directory that contains current entry
-// block_idx: an index for the block that contains current entry 
-// offset: an offest for current entry in this block
-// Move from current entry to the next entry in this directory
-// Returns a pointer to the next entry if there is one.
-// Returns NULL if current entry is the last entry in this directory.
-struct ext2_dir_entry *move_entry(struct ext2_dir_entry *cur_entry, unsigned int dir_inum, unsigned int *block_idx, unsigned int *offset)  {
+    struct ext2_run *last = NULL;
+    if(file->num_runs > 0)
+        last = &file->runs[file->num_runs - 1];
 
-    struct ext2_inode dir_inode = inode_table[dir_inum - 1];
-    // Move to next position in current block
-    *offset += cur_entry->rec_len;
-    
-    // Case 1: More entries left in current block
-    if(*offset < 1024) {
-        cur_entry = (struct ext2_dir_entry *)((unsigned char *)cur_entry + cur_entry->rec_len);
-        
+    if(last != NULL && last->logical + last->length == logical && \
+            ((last->physical == 0 && physical == 0) || \
+             (last->physical != 0 && last->physical + last->length == physical))) {
+        last->length += length;
+        return 0;
     }
 
-    // Case 2: No more entries left in current block
-    // Go to next block if it exists
-    else {
-        *offset = 0;
-        *block_idx += 1;
-        unsigned int block_num = dir_inode.i_block[*block_idx];
+    if(file->num_runs == file->max_runs) {
+        unsigned int max_runs = file->max_runs > 0 ? file->max_runs * 2 : 8;
+        struct ext2_run *runs = realloc(file->runs, max_runs * sizeof(struct ext2_run));
+        if(runs == NULL)
+            return -1;
+        file->runs = runs;
+        file->max_runs = max_runs;
+    }
 
-        // Check if next block has entries
-        if(block_num > 0) {
-            cur_entry = (struct ext2_dir_entry *)(disk + block_num * 1024);
-        }
-        // Next block is empty 
-        else {
-            return NULL;
-        }    
-    }    
-    return cur_entry;
+    last = &file->runs[file->num_runs++];
+    last->logical = logical;
+    last->physical = physical;
+    last->length = length;
+    return 0;
 }
 
+// Resolves the block map of file from its inode.
+// Returns 0 on success, -1 if memory runs out.
+static int load_map(struct ext2_file *file) {
 
-// dir_inum: inode number for directory
-// name: name of the file 
-// Checks if there is a file object with name 'name' is in this directory
-// Returns inode number for the file object if found.
-// Returns 0 if not found.
-// Returns -1 if dir_inum is not inode number for directory
-int search_directory(unsigned int dir_inum, char *name) {
+    struct block_iter iter;
+    struct block_run run;
 
-    struct ext2_inode dir_inode = inode_table[dir_inum - 1];
-    if((dir_inode.i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
-        return -1;
+    file->num_runs = 0;
+    file->last_run = 0;
+    block_iter_init(&iter, file->inode);
+    while(block_iter_next(&iter, &run)) {
+        if(run.metadata == 0 && add_to_map(file, run.logical, run.physical, run.length) == -1)
+            return -1;
     }
+    return 0;
+}
 
-    // Current data block info
-    unsigned int cur_block_idx = 0;  // index for current block
-    unsigned int cur_block_offset = 0;  // offset at current block    
-    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry *)(disk + dir_inode.i_block[0]* 1024);
+// Returns the slot in inode that holds the block pointer for logical block
+// logical. If create is 1, missing indirect blocks on the way are allocated.
+// Returns NULL if an indirect block is missing (or cannot be allocated).
+static unsigned int *block_pointer(struct ext2_inode *inode, unsigned int logical, int create) {
 
-    while(cur_entry != NULL) {
+    unsigned int *slot;
+    unsigned int divisor;
+    int level;
+    int i;
+
+    if(logical < 12)
+        return &inode->i_block[logical];
+
+    // Find which indirect tree holds this block
+    logical -= 12;
+    if(logical < PTRS_PER_BLOCK) {
+        level = 1;
+        slot = &inode->i_block[12];
+    }
+    else if(logical - PTRS_PER_BLOCK < PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+        logical -= PTRS_PER_BLOCK;
+        level = 2;
+        slot = &inode->i_block[13];
+    }
+    else {
+        logical -= PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+        level = 3;
+        slot = &inode->i_block[14];
+    }
+
+    // Walk down the indirect blocks
+    for(; level > 0; level--) {
+        if(*slot == 0) {
+            if(create == 0)
+                return NULL;
+            *slot = allocate_block();
+            if(*slot == 0)
+                return NULL;
+            inode->i_blocks += 2;
+        }
 
-        if(strncmp(cur_entry->name, name, max(cur_entry->name_len, strlen(name))) == 0 && \
-                cur_entry->inode != 0) {
+        divisor = 1;
+        for(i = 1; i < level; i++)
+            divisor *= PTRS_PER_BLOCK;
+        slot = (unsigned int *)get_block(*slot) + (logical / divisor) % PTRS_PER_BLOCK;
+    }
+    return slot;
+}
 
-            return cur_entry->inode;
+// Returns the run in the block map of file that contains logical block logical.
+// Sequential lookups are answered from the last run used without searching.
+static struct ext2_run *find_run(struct ext2_file *file, unsigned int logical) {
+
+    struct ext2_run *run;
+    unsigned int low = 0;
+    unsigned int high = file->num_runs;
+    unsigned int mid;
+
+    // Case 1: same run as last time or the one right after it
+    if(file->last_run < file->num_runs) {
+        run = &file->runs[file->last_run];
+        if(logical >= run->logical && logical < run->logical + run->length)
+            return run;
+        if(file->last_run + 1 < file->num_runs && logical == run->logical + run->length) {
+            file->last_run++;
+            return run + 1;
         }
+    }
+
+    // Case 2: binary search
+    while(low < high) {
+        mid = (low + high) / 2;
+        run = &file->runs[mid];
+        if(logical < run->logical)
+            high = mid;
+        else if(logical >= run->logical + run->length)
+            low = mid + 1;
         else {
-            cur_entry = move_entry(cur_entry, dir_inum, &cur_block_idx, &cur_block_offset);
+            file->last_run = mid;
+            return run;
         }
     }
- 
-    // Matching entry not found
-    return 0;
+    return NULL;
 }
 
-// Returns inode number for last file obtject in path if path is valid.
-// Returns 0 if path is not valid.
-int pathwalk(char *path) {
+// Starts reading the blocks that come after logical block logical when
+// the file is being read sequentially. The window doubles on each
+// sequential read up to READAHEAD_MAX blocks.
+static void readahead(struct ext2_file *file, unsigned int logical) {
 
-    // path must start from the root directory
-    if(path[0] != '/')
-        return 0;
-  
-    int cur_inum = 2;   // inode number for current file object (start from the root)
+    struct ext2_run *run;
+    unsigned int end;
+    unsigned int count;
+    unsigned int last_run = file->last_run;
 
-    int path_len = strlen(path);  
-    char last_char = path[path_len - 1];    // last chararacter of path
+    if(logical != file->next_logical) {
+        // Random access: no read-ahead
+        file->ra_window = 0;
+        return;
+    }
 
-    char *path_temp = malloc(path_len + 1); // duplicate of path (prevent from modifying path)
-    strncpy(path_temp, path, path_len);
-    path_temp[path_len] = '\0';
+    file->ra_window = file->ra_window == 0 ? READAHEAD_MIN : file->ra_window * 2;
+    if(file->ra_window > READAHEAD_MAX)
+        file->ra_window = READAHEAD_MAX;
+
+    if(file->ra_end < logical)
+        file->ra_end = logical;
+    end = logical + file->ra_window;
+
+    // Prefetch each physical run between the read-ahead mark and the window's end
+    while(file->ra_end < end && (run = find_run(file, file->ra_end)) != NULL) {
+        count = run->logical + run->length - file->ra_end;
+        if(count > end - file->ra_end)
+            count = end - file->ra_end;
+        if(run->physical != 0)
+            prefetch_blocks(run->physical + (file->ra_end - run->logical), count);
+        file->ra_end += count;
+    }
 
-    char *token = strtok(path_temp, "/");   // name of file object
-    int rv; // return value
+    // Looking ahead must not move the hint used by the read itself
+    file->last_run = last_run;
+}
 
-    // Examine each name on path one by one
-    while(token != NULL) {
-        
-        rv = search_directory(cur_inum, token);
-        
-        // Case 1: Found an entry that matches token
-        if(rv > 0) {
-            // Go to next level in path
-            cur_inum = rv;
-        }
+// Opens the file at path in the image.
+// flags is O_RDONLY or O_RDWR, optionally with O_CREAT to create a regular
+// file that does not exist yet.
+// Returns a handle on success.
+// Returns NULL and sets errno on failure.
+struct ext2_file *ext2_open(char *path, int flags) {
 
-        // Case 2: Did not find an entry that matches token
-        else if(rv == 0) {
-            return 0;
-        }        
+    struct path_info info;
+    unsigned int inum = resolve_path(path, &info);
+    struct ext2_inode *inode;
 
-        // Case 3: We are dealing with a file/link, not a directory
-        else {
-            // Since there are more file objects in path after current file/link
-            // this path is invalid.
-            // * path would look like .../current_file/next_token...
+    // Create the file if it does not exist
+    if(inum == 0 && (flags & O_CREAT)) {
+        unsigned int dir_inum = info.parent_inum;
 
-            return 0;
+        if(dir_inum == 0 || path[strlen(path) - 1] == '/' || info.name_len == 0) {
+            errno = ENOENT;
+            return NULL;
+        }
+        if(info.name_len > EXT2_NAME_LEN) {
+            errno = ENAMETOOLONG;
+            return NULL;
         }
 
-        token = strtok(NULL, "/");
+        inum = allocate_inode();
+        if(inum == 0) {
+            errno = ENOSPC;
+            return NULL;
+        }
+        inode = get_inode(inum);
+        inode->i_mode = EXT2_S_IFREG;
+        inode->i_links_count = 1;
+
+        // The inode is given back if the directory cannot take the new entry
+        struct ext2_dir_entry *new_entry = malloc(sizeof(struct ext2_dir_entry) + EXT2_NAME_LEN);
+        int added = -1;
+        errno = ENOMEM;
+        if(new_entry != NULL) {
+            new_entry->inode = inum;
+            new_entry->name_len = info.name_len;
+            new_entry->file_type = EXT2_FT_REG_FILE;
+            memcpy(new_entry->name, info.name, new_entry->name_len);
+            added = add_new_entry(dir_inum, new_entry);
+            free(new_entry);
+            errno = ENOSPC;
+        }
+        if(added == -1) {
+            memset(inode, 0, sizeof(struct ext2_inode));
+            deallocate_inode(inum);
+            return NULL;
+        }
+    }
+    else if(inum == 0) {
+        errno = ENOENT;
+        return NULL;
     }
 
-    // If path is not a directory, it cannot end with /
-    struct ext2_inode inode = inode_table[cur_inum - 1];
-    unsigned short file_type = inode.i_mode & EXT2_IMODE_MASK;
-    if(file_type != EXT2_S_IFDIR && last_char == '/') 
-        return 0;
+    return ext2_open_inode(inum, flags);
+}
 
-    return cur_inum;
+// Opens the file with inode number inum, as ext2_open does.
+// Returns a handle on success.
+// Returns NULL and sets errno on failure.
+struct ext2_file *ext2_open_inode(unsigned int inum, int flags) {
+
+    struct ext2_inode *inode = get_inode(inum);
+
+    if((flags & O_ACCMODE) != O_RDONLY && (inode->i_mode & EXT2_IMODE_MASK) == EXT2_S_IFDIR) {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    struct ext2_file *file = calloc(1, sizeof(struct ext2_file));
+    if(file == NULL)
+        return NULL;
+    file->inum = inum;
+    file->inode = inode;
+    file->flags = flags;
+
+    // Resolve the block map once
+    if(load_map(file) == -1) {
+        ext2_close(file);
+        return NULL;
+    }
+    return file;
 }
 
-// dir_inum: inode number for directory to which new entry is added
-// new_etnry: Entry that is newly added to this directory
-// Adds new entry to a directory. 
-// Return 0 on success.
-// Return -1 if dir_inum is not inode number for a directory.
-int add_new_entry(unsigned int dir_inum, struct ext2_dir_entry *new_entry) {
-   
-    // Obtain info for directory
-    struct ext2_inode *dir_inode = &inode_table[dir_inum - 1];   
+// Reads up to count bytes at offset from file into buf.
+// Returns the number of bytes read (0 at end of file).
+// Returns -1 and sets errno on failure.
+ssize_t ext2_pread(struct ext2_file *file, void *buf, size_t count, off_t offset) {
 
-    // Return if type is not a directory
-    if((dir_inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) 
+    struct ext2_run *run;
+    unsigned int logical;
+    unsigned int blocks;
+    unsigned int block_offset;
+    size_t chunk;
+    size_t total = 0;
+
+    if(offset < 0) {
+        errno = EINVAL;
         return -1;
+    }
+    file->inode = get_inode(file->inum);
+    if(offset >= file->inode->i_size)
+        return 0;
+    if(count > file->inode->i_size - offset)
+        count = file->inode->i_size - offset;
+
+    readahead(file, offset / EXT2_BLOCK_SIZE);
+
+    while(total < count) {
+        logical = (offset + total) / EXT2_BLOCK_SIZE;
+        block_offset = (offset + total) % EXT2_BLOCK_SIZE;
+        chunk = EXT2_BLOCK_SIZE - block_offset;
+        if(chunk > count - total)
+            chunk = count - total;
+
+        run = find_run(file, logical);
+        if(run == NULL || run->physical == 0)
+            memset((char *)buf + total, 0, chunk);
+        else if(chunk == EXT2_BLOCK_SIZE) {
+            // Whole blocks: copy as much of the run as fits in one go
+            blocks = run->logical + run->length - logical;
+            if(blocks > (count - total) / EXT2_BLOCK_SIZE)
+                blocks = (count - total) / EXT2_BLOCK_SIZE;
+            if(read_blocks(run->physical + (logical - run->logical), blocks, (char *)buf + total) == -1) {
+                errno = EIO;
+                return -1;
+            }
+            chunk = (size_t)blocks * EXT2_BLOCK_SIZE;
+        }
+        else
+            memcpy((char *)buf + total, get_block(run->physical + (logical - run->logical)) + block_offset, chunk);
+        total += chunk;
+    }
 
-    // Current data block info
-    unsigned int cur_block_idx = 0;  // index for current block
-    unsigned int cur_block_offset = 0;  // offset at current block
-    int cur_block_num = dir_inode->i_block[cur_block_idx];
-    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry *)(disk + dir_inode->i_block[0] * 1024);;
-    struct ext2_dir_entry *hidden_entry;    // a pointer to a removed entry
-
-    // Space info
-    int space_need = ceil((double)(8 + new_entry->name_len) / 4) * 4; // space needed for new entry
-                                                                      // need to be aligned on 4 bytes boundaries
-    int space_used;     // Space current entry actually uses
-    int space_have;     // Extra space current entry has
-
-    // Loop until we find a place to add new entry 
-    // Assumption: There will always be a place for new entry
-    //             so loop wiil terminate eventually
-    while(1) {
+    file->next_logical = (offset + total + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    return total;
+}
 
-        // Case 1: Current block is empty
-        if(cur_entry->inode == 0 && cur_entry->rec_len == 0) {
-            cur_entry->inode = new_entry->inode;
-            cur_entry->rec_len = 1024;
-            cur_entry->name_len = new_entry->name_len;
-            cur_entry->file_type = new_entry->file_type;
-            strncpy(cur_entry->name, new_entry->name, cur_entry->name_len);
-            return 0;
-        }
+// Writes count bytes from buf at offset into file, allocating blocks
+// (and indirect blocks) as the file grows.
+// Returns the number of bytes written, which is less than count only if
+// the disk ran out of blocks.
+// Returns -1 and sets errno on failure.
+ssize_t ext2_pwrite(struct ext2_file *file, const void *buf, size_t count, off_t offset) {
+
+    struct ext2_inode *inode = file->inode = get_inode(file->inum);
+    struct ext2_run *run;
+    unsigned int *slot;
+    unsigned int block_num;
+    unsigned int mapped = 0;        // number of logical blocks in the map
+    unsigned int first;             // first logical block written
+    unsigned int last;              // last logical block written
+    unsigned int blocks;
+    unsigned int logical;
+    unsigned int block_offset;
+    size_t chunk;
+    size_t total = 0;
+
+    if((file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
-        // Case 2: Current block is not empty
-        else {
+    if(count == 0)
+        return 0;
+    if(file->num_runs > 0)
+        mapped = file->runs[file->num_runs - 1].logical + file->runs[file->num_runs - 1].length;
+
+    // Grow the file up to the last block written. Skipped blocks are allocated
+    // (zeroed) as well so that the file has no holes.
+    first = offset / EXT2_BLOCK_SIZE;
+    last = (offset + count - 1) / EXT2_BLOCK_SIZE;
+    while(mapped <= last) {
+        slot = block_pointer(inode, mapped, 1);
+        block_num = (slot != NULL) ? allocate_block() : 0;
+        if(block_num == 0) {
+            // Write only what fits
+            if(mapped <= first) {
+                errno = ENOSPC;
+                return -1;
+            }
+            count = (size_t)mapped * EXT2_BLOCK_SIZE - offset;
+            break;
+        }
+        *slot = block_num;
+        inode->i_blocks += 2;
+        if(add_to_map(file, mapped, block_num, 1) == -1)
+            return -1;
+        mapped++;
+
+        // Blocks skipped over before offset become part of the file as zeros
+        if(mapped <= first && inode->i_size < mapped * EXT2_BLOCK_SIZE)
+            inode->i_size = mapped * EXT2_BLOCK_SIZE;
+    }
 
-            // Move to the last entry in current block
-            while(cur_block_offset + cur_entry->rec_len < 1024) {
-                cur_entry = move_entry(cur_entry, dir_inum, &cur_block_idx, &cur_block_offset);
+    while(total < count) {
+        logical = (offset + total) / EXT2_BLOCK_SIZE;
+        block_offset = (offset + total) % EXT2_BLOCK_SIZE;
+        chunk = EXT2_BLOCK_SIZE - block_offset;
+        if(chunk > count - total)
+            chunk = count - total;
+
+        // Fill a hole with a new block and resolve the map again
+        run = find_run(file, logical);
+        if(run->physical == 0) {
+            slot = block_pointer(inode, logical, 1);
+            block_num = (slot != NULL) ? allocate_block() : 0;
+            if(block_num == 0) {
+                if(total > 0)
+                    return total;
+                errno = ENOSPC;
+                return -1;
             }
+            *slot = block_num;
+            inode->i_blocks += 2;
+            if(load_map(file) == -1)
+                return -1;
+            run = find_run(file, logical);
+        }
 
-            space_used = ceil((double)(8 + cur_entry->name_len) / 4) * 4;   
-            space_have = cur_entry->rec_len - space_used;                   
-        
-            // Check if new entry can fit in current entry
-            if(space_have >= space_need) {
-                
-                hidden_entry = cur_entry;
-
-                // Add a new entry after all hidden (or removed) entries 
-                // Loop variant: space_have >= space_used
-                while(space_have >= space_need) {
-
-                    // Move to next position and see if there is a hidden entry there
-                    hidden_entry = (struct ext2_dir_entry *)((unsigned char *)hidden_entry + space_used);
-
-                    // If cur_entry does not point to a hidden entry, add a new entry here
-                    if(hidden_entry->inode == 0) {
-                        hidden_entry->inode = new_entry->inode;
-                        hidden_entry->rec_len = space_have;
-                        hidden_entry->name_len = new_entry->name_len;
-                        hidden_entry->file_type = new_entry->file_type;
-                        strncpy(hidden_entry->name, new_entry->name, hidden_entry->name_len);
-
-                        // Modify last entry's rec_len
-                        cur_entry->rec_len -= space_have;
-                        return 0;
-                    }
-
-                    // cur_entry points to a hidden entry, so new entry cannot be added here
-                    else {
-                        space_used = ceil((double)(8 + cur_entry->name_len) / 4) * 4;
-                        space_have -= space_used;
-                    }
-                }   
+        if(chunk == EXT2_BLOCK_SIZE) {
+            // Whole blocks: copy as much of the run as fits in one go
+            blocks = run->logical + run->length - logical;
+            if(blocks > (count - total) / EXT2_BLOCK_SIZE)
+                blocks = (count - total) / EXT2_BLOCK_SIZE;
+            if(write_blocks(run->physical + (logical - run->logical), blocks, (char *)buf + total) == -1) {
+                errno = EIO;
+                return -1;
             }
+            chunk = (size_t)blocks * EXT2_BLOCK_SIZE;
+        }
+        else
+            memcpy(get_block(run->physical + (logical - run->logical)) + block_offset, (char *)buf + total, chunk);
+        total += chunk;
 
-            // If new entry cannot fit in the last entry in current block, move to the next block
-            else {
-               
-                cur_block_idx += 1;
-                
-                // Allocate new block if needed
-                if(dir_inode->i_block[cur_block_idx] == 0) {
-                    dir_inode->i_block[cur_block_idx] = allocate_block();
-                    if(dir_inode->i_block[cur_block_idx] == 0) {
-                        fprintf(stderr, "There is no more available data blocks.\n");
-                        exit(-1);
-                    }
-                    dir_inode->i_size += 1024;
-                    dir_inode->i_blocks += 2;
-                }
-                    
-                cur_block_num = dir_inode->i_block[cur_block_idx];
-                cur_block_offset = 0;
-                cur_entry = (struct ext2_dir_entry *)(disk + cur_block_num * 1024);
-            }    
-        }     
+        if(offset + total > inode->i_size)
+            inode->i_size = offset + total;
     }
 
-    return 0;
-}    
-// Ruturns name of the last file object in this path
-char *find_name(char *path) {
+    return total;
+}
 
-    char *name = malloc(EXT2_NAME_LEN);
-    if(name == NULL) {
-        perror("malloc");
-        exit(-1);
-    }
+// Releases the handle file
+int ext2_close(struct ext2_file *file) {
 
-    char *token = strtok(path, "/");
-    while(token != NULL) {
-        memset(name, '\0', EXT2_NAME_LEN);
-        strncpy(name, token, strlen(token));
-        token = strtok(NULL, "/");
-    }
-    return name;
+    free(file->runs);
+    free(file);
+    return 0;
 }
 
-// Returns path to the parent directory of the last file object in this path.
-// If path is /path/to/some/target, it returns /path/to/some/
-char *find_subpath(char *path) {
 
+/* From below is helper functions for checker program */
+
+// dirty: 1 for each group that may have changed, or NULL for every group
+// Checks the free inode and block counts of the superblock and of the
+// group descriptors against the bitmaps, and fixes the ones that are off.
+// A group that has not changed is taken to still match its bitmaps.
+// Returns the total number of inconsistencies, or -1 if memory ran out
+int check_free_counts(unsigned char *dirty) {
+
+    int total = 0;  // total number of inconsistencies
+    int bitmap_free_inodes_count = 0;
+    int bitmap_free_blocks_count = 0;
+    unsigned int group;
+    int diff;
+
+    // Free counts of each group according to its bitmaps
+    int *group_free_inodes = calloc(num_groups, sizeof(int));
+    int *group_free_blocks = calloc(num_groups, sizeof(int));
+    if(group_free_inodes == NULL || group_free_blocks == NULL) {
+        perror("calloc");
+        free(group_free_inodes);
+        free(group_free_blocks);
+        return -1;
+    }
+
+    // Count the number of free inodes and blocks in the bitmaps
     int i;
-    int subpath_len = strlen(path);
-    char *subpath = malloc(subpath_len + 1);
-    if(subpath == NULL) {
-        perror("malloc");
-        exit(-1);
+
+    // Ask for every bitmap up front so that the reads overlap
+    for(group = 0; group < num_groups; group++) {
+        if(dirty != NULL && dirty[group] == 0)
+            continue;
+        prefetch_blocks(gd[group].bg_block_bitmap, 1);
+        prefetch_blocks(gd[group].bg_inode_bitmap, 1);
     }
 
-    strncpy(subpath, path, subpath_len);
-    subpath[subpath_len] = '\0';
-    if(subpath[subpath_len - 1] == '/') 
-        subpath[subpath_len - 1] = '\0';
+    for(group = 0; group < num_groups; group++) {
+
+        // A group that has not changed still matches its bitmaps
+        if(dirty != NULL && dirty[group] == 0) {
+            group_free_inodes[group] = gd[group].bg_free_inodes_count;
+            group_free_blocks[group] = gd[group].bg_free_blocks_count;
+            bitmap_free_inodes_count += group_free_inodes[group];
+            bitmap_free_blocks_count += group_free_blocks[group];
+            continue;
+        }
+
+        unsigned char *inode_bitmap = get_block(gd[group].bg_inode_bitmap);
+        unsigned char *block_bitmap = get_block(gd[group].bg_block_bitmap);
+
+        for(i = 1; i <= sb->s_inodes_per_group; i++) {
+           if(check_allocation(inode_bitmap, i) == 0) 
+               group_free_inodes[group]++;
+        }
+
+        for(i = 1; i <= group_blocks(group); i++) {
+            if(check_allocation(block_bitmap, i) == 0)
+                group_free_blocks[group]++;
+        }
+
+        bitmap_free_inodes_count += group_free_inodes[group];
+        bitmap_free_blocks_count += group_free_blocks[group];
+    }
+    
+    if(sb->s_free_inodes_count != bitmap_free_inodes_count) {
+        diff = abs(sb->s_free_inodes_count - bitmap_free_inodes_count);        
+        printf("Fixed: superblock's free inodes was off by %d compared to the bitmap\n", diff);
+        sb->s_free_inodes_count = bitmap_free_inodes_count;        
+        total += diff;
+    }
 
-    // Get rid of the name of the last file object in this path
-    for(i = subpath_len - 1; subpath[i] != '/'; i--) {
-        subpath[i] = '\0';
+    if(sb->s_free_blocks_count != bitmap_free_blocks_count) {
+        diff = abs(sb->s_free_blocks_count - bitmap_free_blocks_count);
+        printf("Fixed: superblock's free blocks was off by %d compared to the bitmap\n", diff);
+        sb->s_free_blocks_count = bitmap_free_blocks_count;
+        total += diff;
     }
 
-    return subpath;
-}
+    for(group = 0; group < num_groups; group++) {
+        if(gd[group].bg_free_inodes_count != group_free_inodes[group]) {
+            diff = abs(gd[group].bg_free_inodes_count - group_free_inodes[group]);
+            printf("Fixed: block group's free inodes was off by %d compared to the bitmap\n", diff);
+            gd[group].bg_free_inodes_count = group_free_inodes[group];
+            total += diff;
+        }
 
+        if(gd[group].bg_free_blocks_count != group_free_blocks[group]) {        
+            diff = abs(gd[group].bg_free_blocks_count - group_free_blocks[group]);
+            printf("Fixed: block group's free blocks was off by %d compared to the bitmap\n", diff);
+            gd[group].bg_free_blocks_count = group_free_blocks[group];
+            total += diff;
+        }
+        update_group_checksum(group);
+    }
 
-/* From below is helper functions for checker program */
+    free(group_free_inodes);
+    free(group_free_blocks);
+    return total;
+}
 
 // dir_inum: inode number for directory
-// Checks each entry in this directory for any corruption
+// Checks each entry in this directory for any corruption,
+// and the entries of its subdirectories if recursive is 1
 // Returns the total number of inconsistencies
-int check_directory(unsigned int dir_inum) {
+static int check_entries(unsigned int dir_inum, int recursive) {
 
     int total = 0;
-    struct ext2_inode dir_inode = inode_table[dir_inum - 1];
+    struct ext2_inode dir_inode = *get_inode(dir_inum);
 
     // Current data block info
     unsigned int cur_block_idx = 0;  // idx for i_block
     unsigned int cur_block_offset = 0;  // offset at current block
-    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry *)(disk + dir_inode.i_block[0] * 1024);
+    struct ext2_dir_entry *cur_entry;
+
+    // Queue the reads of the directory blocks, then of the inodes they name,
+    // so that the checks below find them in memory
+    prefetch_inode_blocks(&dir_inode);
+    cur_entry = (struct ext2_dir_entry *)get_block(dir_inode.i_block[0]);
+    while(cur_entry != NULL) {
+        if(cur_entry->inode != 0 && cur_entry->inode <= sb->s_inodes_count)
+            prefetch_blocks(inode_block(cur_entry->inode), 1);
+        cur_entry = move_entry(cur_entry, dir_inum, &cur_block_idx, &cur_block_offset);
+    }
+
+    cur_block_idx = 0;
+    cur_block_offset = 0;
+    cur_entry = (struct ext2_dir_entry *)get_block(dir_inode.i_block[0]);
 
     while(cur_entry != NULL) {
        
@@ -423,8 +2778,8 @@ int check_directory(unsigned int dir_inum) {
             }
 
             // Case 2: current entry is a directory (but not . entry)
-            else {
-                total += check_directory(cur_entry->inode);
+            else if(recursive) {
+                total += check_entries(cur_entry->inode, 1);
             }
         }      
         
@@ -435,13 +2790,86 @@ int check_directory(unsigned int dir_inum) {
     return total;
 }
 
+// dir_inum: inode number for directory
+// Checks each entry in this directory and below it for any corruption
+// Returns the total number of inconsistencies
+int check_directory(unsigned int dir_inum) {
+    return check_entries(dir_inum, 1);
+}
+
+// Checks the inodes of group that are still linked, and the entries of the
+// directories among them, instead of walking the tree from the root.
+// Changing a file or a directory looks up its inode, which flags the group
+// it is in (see open_image), so only groups with EXT2_BG_DIRTY need this.
+// Returns the total number of inconsistencies
+int check_group(unsigned int group) {
+
+    unsigned int num = sb->s_inodes_per_group;      // inodes of the table that were ever used
+    unsigned int first_ino = sb->s_rev_level < EXT2_DYNAMIC_REV ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    struct ext2_dir_entry entry;                    // stands for the entries naming each inode
+    struct ext2_inode *inode;
+    unsigned int inum;
+    unsigned int i;
+    int total = 0;
+
+    if(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+        num -= gd[group].bg_itable_unused;
+    prefetch_blocks(gd[group].bg_inode_table, (num * inode_size() + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+
+    memset(&entry, 0, sizeof(entry));
+    for(i = 0; i < num; i++) {
+        inum = group * sb->s_inodes_per_group + i + 1;
+        if(inum < first_ino && inum != EXT2_ROOT_INO)
+            continue;
+        inode = get_inode(inum);
+        if(inode->i_links_count == 0)
+            continue;
+
+        entry.inode = inum;
+        total += check_inode(&entry);
+        total += check_dtime(&entry);
+        total += check_blocks(&entry);
+        if((inode->i_mode & EXT2_IMODE_MASK) == EXT2_S_IFDIR)
+            total += check_entries(inum, 0);
+    }
+    return total;
+}
+
+// Records that ext2_checker has just made the image consistent: clears
+// EXT2_BG_DIRTY in every group and EXT2_ERROR_FS, stops flagging groups
+// until the image is closed, and stamps the superblock (see was_checked)
+void mark_checked() {
+
+    unsigned int group;
+
+    track_groups = 0;
+    for(group = 0; group < num_groups; group++) {
+        if(gd[group].bg_flags & EXT2_BG_DIRTY) {
+            gd[group].bg_flags &= ~EXT2_BG_DIRTY;
+            update_group_checksum(group);
+        }
+    }
+    sb->s_state &= ~EXT2_ERROR_FS;
+    sb->s_lastcheck = time(0);
+    sb->s_wtime = sb->s_lastcheck;
+}
+
+// Returns 1 if mark_checked (or ext2_mkfs) has stamped the image, so its
+// EXT2_BG_DIRTY flags tell what changed since the last check.
+// These tools never set s_wtime, while other writers of ext2 images do, and
+// images that were never checked have no s_lastcheck: both need a full check.
+int was_checked() {
+
+    return sb->s_lastcheck != 0 && sb->s_wtime == sb->s_lastcheck;
+}
+
 // Checks if this entry's file_type matches its imode.
 // If not match, file_type follows imode.
 // Returns 1 if there is an inconsistency. 
 // Returns 0 if there is not an inconsistency.
 int check_type(struct ext2_dir_entry *dir_entry) {
 
-    struct ext2_inode inode = inode_table[dir_entry->inode - 1];
+    struct ext2_inode inode = *get_inode(dir_entry->inode);
     unsigned short imode = inode.i_mode & EXT2_IMODE_MASK;
     unsigned char imode_converted;
 
@@ -470,10 +2898,8 @@ int check_type(struct ext2_dir_entry *dir_entry) {
 // Returns 0 if there is not an inconsistency.
 int check_inode(struct ext2_dir_entry *dir_entry) {
 
-    if(check_allocation(inode_bitmap, dir_entry->inode) == 0) {
-        set_to_used(inode_bitmap, dir_entry->inode);
-        sb->s_free_inodes_count -= 1;
-        gd->bg_free_inodes_count -= 1;
+    if(inode_in_use(dir_entry->inode) == 0) {
+        mark_inode_used(dir_entry->inode);
         printf("Fixed: inode[%d] not marked as in-use\n", dir_entry->inode);
         return 1;
     }
@@ -487,7 +2913,7 @@ int check_inode(struct ext2_dir_entry *dir_entry) {
 // Returns 0 if there is not an inconsistency.
 int check_dtime(struct ext2_dir_entry *dir_entry) {
     
-    struct ext2_inode *inode = &inode_table[dir_entry->inode - 1];
+    struct ext2_inode *inode = get_inode(dir_entry->inode);
 
     if(inode->i_dtime != 0) {
         inode->i_dtime = 0;
@@ -503,63 +2929,15 @@ int check_dtime(struct ext2_dir_entry *dir_entry) {
 // Returns the total number of inconsistencies.
 int check_blocks(struct ext2_dir_entry *dir_entry) {
 
-    struct ext2_inode inode = inode_table[dir_entry->inode - 1];    // inode for current block  
-    unsigned int block_idx = 0;                                     // index of current block 
-    unsigned int indirect_idx = 0;                                  // current index for indirect block
-    unsigned int num_blocks = inode.i_blocks / 2;                   // total number of blocks allocated to this entry
+    struct ext2_inode *inode = get_inode(dir_entry->inode);        // inode for current entry
     unsigned int num_errors = 0;                                    // total number of inconsistencies
+    struct block_iter iter;
+    struct block_run run;
 
-    unsigned int block_num;                                         // block number for current block
-    unsigned int indirect_num;                                      // block number for indirect block
-    unsigned int *indirect_block;                                   // indirect block for current entry
-
-    while(num_blocks > 0) {
-        // Direct blocks
-        if(block_idx < 12) {
-
-            block_num = inode.i_block[block_idx];
-
-            if(check_allocation(block_bitmap, block_num) == 0) {
-                set_to_used(block_bitmap, block_num);
-                sb->s_free_blocks_count -= 1;
-                gd->bg_free_blocks_count -= 1;
-                num_errors += 1;
-            }
-            block_idx += 1;
-            num_blocks -= 1;
-        }
-        // Blocks in the indirect block
-        else {
-            // First check the block allocated to the indirect block
-            if(indirect_idx == 0) {
-
-                indirect_num = inode.i_block[block_idx];
-                indirect_block = (unsigned int *)(disk + indirect_num * 1024);
-
-                if(check_allocation(block_bitmap, indirect_num) == 0) {
-                    set_to_used(block_bitmap, indirect_num);
-                    sb->s_free_blocks_count -= 1;
-                    gd->bg_free_blocks_count -= 1;
-                    num_errors += 1;
-                }
-
-                num_blocks -= 1;
-            }
-
-            block_num = indirect_block[indirect_idx]; // block number for the first block in in indirect block
-
-            // Check blocks in the indirect block
-            if(check_allocation(block_bitmap, block_num) == 0) {
-                set_to_used(block_bitmap, block_num);
-                sb->s_free_blocks_count -= 1;
-                gd->bg_free_blocks_count -= 1;
-                num_errors += 1;
-            }
-
-            indirect_idx += 1;                    
-            num_blocks -= 1;
-
-        }
+    block_iter_init(&iter, inode);
+    while(block_iter_next(&iter, &run)) {
+        if(run.physical != 0)
+            num_errors += mark_blocks_used(run.physical, run.length);
     }
 
     if(num_errors > 0)
@@ -1,35 +1,178 @@
 #ifndef __EXT2_HELPER_H__
 #define __EXT2_HELPER_H__
 
+#include <sys/types.h>
 #include "ext2.h"
 
 #define EXT2_IMODE_MASK  0xf000 /* mask for imode */
 
-extern unsigned char *disk;
+// A run of blocks produced by the block map iterator
+struct block_run {
+    unsigned int logical;       // first logical block in the run
+    unsigned int physical;      // first physical block in the run (0 for a hole)
+    unsigned int length;        // number of blocks in the run
+    int metadata;               // 1 if the run is indirect blocks
+};
+
+// Indirect block that the block map iterator is walking through
+struct block_iter_level {
+    unsigned int block_num;     // block number of the indirect block
+    int level;                  // 1 for single, 2 for double, 3 for triple indirect
+    unsigned int idx;           // next pointer to read in it
+};
+
+// State of a walk over the blocks of an inode
+struct block_iter {
+    struct ext2_inode *inode;
+    unsigned int num_blocks;    // logical blocks below i_size
+    unsigned int budget;        // blocks left according to i_blocks
+    unsigned int logical;       // next logical block
+    int slot;                   // next pointer to read in i_block
+    int depth;                  // number of indirect blocks on the stack
+    struct block_iter_level stack[3];
+    struct block_run pending;   // first item of the next run
+    int has_pending;
+    unsigned long long start;   // when the walk started, if it is timed (see ext2_stats.h)
+};
+
+// A run of consecutive logical blocks stored in consecutive physical blocks
+struct ext2_run {
+    unsigned int logical;       // first logical block in the run
+    unsigned int physical;      // first physical block in the run (0 for a hole)
+    unsigned int length;        // number of blocks in the run
+};
+
+// Handle for an open file in the image
+struct ext2_file {
+    unsigned int inum;          // inode number of the file
+    struct ext2_inode *inode;   // looked up again on every call, as checkpoints may move it
+    int flags;                  // flags given to ext2_open
+    struct ext2_run *runs;      // block map of the file, sorted by logical block
+    unsigned int num_runs;
+    unsigned int max_runs;
+    unsigned int last_run;      // index of the run used by the last lookup
+    unsigned int next_logical;  // block after the end of the last read
+    unsigned int ra_end;        // read-ahead has been issued up to this block
+    unsigned int ra_window;     // current read-ahead window in blocks
+};
+
+// An inode and blocks set aside by reserve for one operation
+struct reservation {
+    unsigned int inum;          // reserved inode (0 once it is handed out or if none was asked for)
+    unsigned int *blocks;       // reserved blocks, lowest first
+    unsigned int num_blocks;
+    unsigned int next;          // index of the next block to hand out
+};
+
+// What resolve_path found out about a path
+struct path_info {
+    unsigned int inum;          // last file object in the path (0 if it does not exist)
+    unsigned int parent_inum;   // directory it is in (0 if that does not exist or for "/")
+    const char *name;           // its name, name_len bytes inside the path (not null-terminated)
+    unsigned int name_len;
+};
+
+#define DELTA_MAGIC 0x544C4432     // "2DLT"
+#define DELTA_ZERO 1                // flag of a run of zero blocks, stored without data
+
+// Header of a block delta written by ext2_diff and applied by ext2_patch.
+// num_runs runs follow it, each a struct delta_run followed by its blocks
+// unless the run has DELTA_ZERO set.
+struct delta_header {
+    unsigned int magic;
+    unsigned int old_blocks;                    // blocks in the image the delta applies to
+    unsigned int new_blocks;                    // blocks in the image once it is applied
+    unsigned int num_runs;
+    unsigned char old_super[EXT2_BLOCK_SIZE];   // block 1 of the image the delta applies to
+};
+
+// Changed blocks start to start + count - 1
+struct delta_run {
+    unsigned int start;
+    unsigned int count;
+    unsigned int flags;
+};
+
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char *inode_bitmap;
-extern struct ext2_inode *inode_table;
+extern unsigned int num_groups;
+extern int image_threads;
+
+int open_image(char *image_name, int flags);
+void close_image();
+int sync_image();
+int checkpoint_image();
+int begin_threads();
+void end_threads();
+void fold_free_counts();
+void lock_group(unsigned int group);
+void unlock_group(unsigned int group);
+void lock_directory(unsigned int dir_inum);
+void unlock_directory(unsigned int dir_inum);
+unsigned char *get_block(unsigned int block_num);
+int read_blocks(unsigned int block_num, unsigned int count, void *buf);
+int write_blocks(unsigned int block_num, unsigned int count, const void *buf);
+struct ext2_inode *get_inode(unsigned int inum);
+unsigned int inode_block(unsigned int inum);
+unsigned int block_group(unsigned int block_num);
+unsigned int inode_group(unsigned int inum);
+unsigned int group_blocks(unsigned int group);
+int has_super(unsigned int group, int sparse);
+void update_group_checksum(unsigned int group);
 
 int max(int a, int b);
 int check_allocation(unsigned char *bitmap, int num);
 void set_to_used(unsigned char *bitmap, int num);
+int block_in_use(unsigned int block_num);
+int inode_in_use(unsigned int inum);
+void mark_block_used(unsigned int block_num);
+void mark_inode_used(unsigned int inum);
 int allocate_inode();
 int allocate_block();
+unsigned int find_free_run(unsigned int count);
+int reserve(struct reservation *res, unsigned int inodes, unsigned int count);
+void release_reservation(struct reservation *res);
 void deallocate_inode(int inum);
 void deallocate_block(int block_num);
+unsigned int mark_blocks_used(unsigned int block_num, unsigned int count);
+unsigned int deallocate_blocks(unsigned int block_num, unsigned int count);
+unsigned int count_blocks_in_use(unsigned int block_num, unsigned int count);
 struct ext2_dir_entry *move_entry(struct ext2_dir_entry *cur_entry, unsigned int dir_num, \
         unsigned int *block_idx, unsigned int *offset);
+int search_name(unsigned int dir_inum, const char *name, unsigned int name_len);
 int search_directory(unsigned int dir_inum, char *name);
+unsigned int resolve_path(const char *path, struct path_info *info);
 int pathwalk(char *path);
+unsigned int directory_growth(unsigned int dir_inum, unsigned int name_len);
 int add_new_entry(unsigned int dir_inum, struct ext2_dir_entry *new_entry);
+int remove_entry(unsigned int dir_inum, char *name);
+int compact_directory(unsigned int dir_inum);
 char *find_name(char *path);
-char *find_subpath(char *path);
+
+// From below is the block map iterator
+
+void block_iter_init(struct block_iter *iter, struct ext2_inode *inode);
+int block_iter_next(struct block_iter *iter, struct block_run *run);
+void truncate_blocks(struct ext2_inode *inode, unsigned int keep);
+unsigned int indirect_blocks(unsigned int num_blocks);
+
+// From below is the file handle API
+
+void prefetch_blocks(unsigned int block_num, unsigned int count);
+void prefetch_inode_blocks(struct ext2_inode *inode);
+struct ext2_file *ext2_open(char *path, int flags);
+struct ext2_file *ext2_open_inode(unsigned int inum, int flags);
+ssize_t ext2_pread(struct ext2_file *file, void *buf, size_t count, off_t offset);
+ssize_t ext2_pwrite(struct ext2_file *file, const void *buf, size_t count, off_t offset);
+int ext2_close(struct ext2_file *file);
 
 // From below is helper functions for checker
 
+int check_free_counts(unsigned char *dirty);
 int check_directory(unsigned int dir_inum);
+int check_group(unsigned int group);
+void mark_checked();
+int was_checked();
 int check_type(struct ext2_dir_entry *dir_entry);
 int check_inode(struct ext2_dir_entry *dir_entry);
 int check_dtime(struct ext2_dir_entry *dir_entry);
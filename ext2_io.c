@@ -0,0 +1,1076 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ext2.h"
+#include "ext2_io.h"
+
+#define DEFAULT_CACHE_BLOCKS 4096   // blocks kept by the pread and uring backends between checkpoints
+#define MAX_IOVECS 256              // blocks moved by one request
+#define RING_ENTRIES 128            // submission queue size of the io_uring backend
+#define RING_CHUNK 64               // blocks of file data per io_uring request
+
+struct block_io *io;
+
+static int overlay_fd = -1;                 // delta file given to overlay_open, or -1
+
+// Picks the backend named by EXT2_IO ("mmap", "pread" or "uring") and opens the image with it.
+// The backend takes over fd.
+// Returns 0 on success or -1.
+int io_open(int fd, unsigned long long size, int writable, unsigned int pinned) {
+
+    char *name = getenv("EXT2_IO");
+
+    io = &mmap_io;
+    if(name != NULL && strcmp(name, pread_io.name) == 0)
+        io = &pread_io;
+    else if(name != NULL && strcmp(name, uring_io.name) == 0)
+        io = &uring_io;
+    else if(name != NULL && strcmp(name, mmap_io.name) != 0)
+        fprintf(stderr, "EXT2_IO: unknown backend %s, using mmap\n", name);
+
+    // Writes to an overlay go to another file than reads, which a mapping or a ring cannot do
+    if(overlay_fd != -1)
+        io = &pread_io;
+
+    return io->open(fd, size, writable, pinned);
+}
+
+/* From below is the mmap backend */
+
+static unsigned char *disk;             // the whole image mapped into memory
+static unsigned long long disk_size;    // length of the mapping
+
+static int mmap_open(int fd, unsigned long long size, int writable, unsigned int pinned) {
+
+    int prot = PROT_READ;
+    if(writable)
+        prot |= PROT_WRITE;
+
+    disk = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if(disk == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    disk_size = size;
+    close(fd);
+    return 0;
+}
+
+static unsigned char *mmap_get_block(unsigned int block_num) {
+    return disk + (unsigned long)block_num * EXT2_BLOCK_SIZE;
+}
+
+// Asks the kernel to start reading the pages behind count blocks from block_num
+static void mmap_prefetch(unsigned int block_num, unsigned int count) {
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long start = (unsigned long)mmap_get_block(block_num);
+    unsigned long end = start + (unsigned long)count * EXT2_BLOCK_SIZE;
+
+    start &= ~(page_size - 1);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static int mmap_read(unsigned int block_num, unsigned int count, unsigned char *buf) {
+    memcpy(buf, mmap_get_block(block_num), (size_t)count * EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+static int mmap_write(unsigned int block_num, unsigned int count, const unsigned char *buf) {
+    memcpy(mmap_get_block(block_num), buf, (size_t)count * EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+// Stores go straight to the page cache, so there is nothing to write back
+static int mmap_checkpoint() {
+    return 0;
+}
+
+static int mmap_sync() {
+
+    if(msync(disk, disk_size, MS_SYNC) == -1) {
+        perror("msync");
+        return -1;
+    }
+    return 0;
+}
+
+static int mmap_close() {
+    munmap(disk, disk_size);
+    return 0;
+}
+
+struct block_io mmap_io = {
+    "mmap", mmap_open, mmap_get_block, mmap_read, mmap_write, mmap_prefetch,
+    mmap_checkpoint, mmap_sync, mmap_close
+};
+
+/* From below is the overlay delta file */
+
+static struct overlay_header overlay;
+static unsigned char *overlay_bitmap;       // presence bitmap of the delta
+static unsigned char *overlay_dirty;        // 1 for each bitmap block changed since it was written
+
+// Reads size bytes at offset of fd into buf, filling what lies past the end of the file with zeros.
+// Returns 0 on success or -1.
+static int read_range(int fd, off_t offset, unsigned char *buf, size_t size) {
+
+    size_t done = 0;
+    ssize_t got;
+
+    while(done < size) {
+        got = pread(fd, buf + done, size - done, offset + done);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got == -1) {
+            perror("pread");
+            return -1;
+        }
+        if(got == 0)
+            break;
+        done += got;
+    }
+    memset(buf + done, 0, size - done);
+    return 0;
+}
+
+// Reads the header and presence bitmap of the delta file fd.
+// *bitmap is allocated here and has a bit for every block of the base image.
+// Returns 0 on success or -1 if fd is not a delta file.
+int overlay_load(int fd, struct overlay_header *header, unsigned char **bitmap) {
+
+    if(read_range(fd, 0, (unsigned char *)header, sizeof(struct overlay_header)) == -1)
+        return -1;
+    if(header->magic != OVERLAY_MAGIC || \
+            header->bitmap_blocks != (header->blocks_count + EXT2_BLOCK_SIZE * 8 - 1) / (EXT2_BLOCK_SIZE * 8)) {
+        fprintf(stderr, "overlay: not a delta file\n");
+        return -1;
+    }
+
+    *bitmap = malloc((size_t)header->bitmap_blocks * EXT2_BLOCK_SIZE);
+    if(*bitmap == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    return read_range(fd, EXT2_BLOCK_SIZE, *bitmap, (size_t)header->bitmap_blocks * EXT2_BLOCK_SIZE);
+}
+
+// Sends every block write of the image open on base_fd to the delta file delta_name,
+// creating it if it does not exist, and reads blocks found there from it.
+// The base image is only read. Must be called before io_open.
+// Returns 0 on success or -1.
+int overlay_open(char *delta_name, int base_fd, unsigned long long size, int writable) {
+
+    struct ext2_super_block super;
+    struct stat delta_stats;
+    int fd;
+
+    if(read_range(base_fd, 1024, (unsigned char *)&super, sizeof(super)) == -1)
+        return -1;
+
+    fd = open(delta_name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if(fd == -1 && errno == ENOENT && writable == 0)
+        return 0;                   // nothing has been written yet: read the base alone
+    if(fd == -1 || fstat(fd, &delta_stats) == -1) {
+        perror(delta_name);
+        return -1;
+    }
+
+    // A new delta starts with only its header: the bitmap and blocks are holes
+    if(delta_stats.st_size == 0) {
+        memset(&overlay, 0, sizeof(overlay));
+        overlay.magic = OVERLAY_MAGIC;
+        overlay.blocks_count = size / EXT2_BLOCK_SIZE;
+        overlay.bitmap_blocks = (overlay.blocks_count + EXT2_BLOCK_SIZE * 8 - 1) / (EXT2_BLOCK_SIZE * 8);
+        memcpy(overlay.base_uuid, super.s_uuid, sizeof(overlay.base_uuid));
+        if(pwrite(fd, &overlay, sizeof(overlay), 0) != sizeof(overlay)) {
+            perror(delta_name);
+            return -1;
+        }
+    }
+
+    if(overlay_load(fd, &overlay, &overlay_bitmap) == -1)
+        return -1;
+    if(overlay.blocks_count != size / EXT2_BLOCK_SIZE || \
+            memcmp(overlay.base_uuid, super.s_uuid, sizeof(overlay.base_uuid)) != 0) {
+        fprintf(stderr, "%s: delta was made from another image\n", delta_name);
+        return -1;
+    }
+
+    overlay_dirty = calloc(overlay.bitmap_blocks, 1);
+    if(overlay_dirty == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    overlay_fd = fd;
+    return 0;
+}
+
+// Returns 1 if block block_num is stored in the delta
+static int in_overlay(unsigned int block_num) {
+    if(overlay_fd == -1 || block_num >= overlay.blocks_count)
+        return 0;
+    return (overlay_bitmap[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+// Returns where block block_num is stored in the delta
+static off_t overlay_offset(unsigned int block_num) {
+    return (off_t)(1 + overlay.bitmap_blocks + block_num) * EXT2_BLOCK_SIZE;
+}
+
+// Records that count blocks from block_num are now stored in the delta
+static void overlay_mark(unsigned int block_num, unsigned int count) {
+
+    unsigned int i;
+
+    for(i = block_num; i < block_num + count && i < overlay.blocks_count; i++) {
+        overlay_bitmap[i / 8] |= 1 << (i % 8);
+        overlay_dirty[i / (EXT2_BLOCK_SIZE * 8)] = 1;
+    }
+}
+
+// Writes the changed blocks of the presence bitmap.
+// They go after the blocks they describe, so a crash in between loses the
+// new blocks instead of exposing unwritten ones.
+// Returns 0 on success or -1.
+static int overlay_write_bitmap() {
+
+    unsigned int i;
+
+    for(i = 0; i < overlay.bitmap_blocks; i++) {
+        if(overlay_dirty[i] == 0)
+            continue;
+        if(pwrite(overlay_fd, overlay_bitmap + (size_t)i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE, \
+                  (off_t)(1 + i) * EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE) {
+            perror("pwrite");
+            return -1;
+        }
+        overlay_dirty[i] = 0;
+    }
+    return 0;
+}
+
+static void overlay_close() {
+
+    free(overlay_bitmap);
+    free(overlay_dirty);
+    close(overlay_fd);
+    overlay_fd = -1;
+}
+
+/* From below is the block cache shared by the pread and uring backends */
+
+// A block held in the cache. Callers write to data through plain pointers, so
+// changed blocks are found by comparing data against clean at write-back time.
+struct cached_block {
+    unsigned int block_num;
+    unsigned int epoch;                 // checkpoints before get_block last returned it
+    int pending;                        // 1 while a read into data is in flight
+    struct cached_block *hash_next;
+    struct cached_block *lru_prev;      // towards the most recently used block
+    struct cached_block *lru_next;      // towards the least recently used block
+    unsigned char data[EXT2_BLOCK_SIZE];
+    unsigned char clean[];              // contents on disk (writable images only)
+};
+
+// A changed block waiting to be written
+struct dirty_block {
+    unsigned int block_num;
+    unsigned char *data;
+    unsigned char *clean;
+};
+
+static int image_fd;
+static int image_writable;
+static unsigned int pinned_blocks;
+static unsigned char *pinned_data;          // blocks 0 to pinned_blocks - 1
+static unsigned char *pinned_clean;
+static struct cached_block **hash_table;
+static unsigned int hash_mask;
+static struct cached_block lru;             // list head: lru.lru_next is the most recent
+static unsigned int num_cached;
+static unsigned int capacity;               // blocks kept after a checkpoint
+static unsigned int epoch;                  // checkpoints so far
+static int use_ring;                        // 1 if requests go through io_uring
+
+static int start_io(int write, unsigned int block_num, struct iovec *iov, unsigned int iovcnt, \
+        struct cached_block **entries);
+static int finish_io();
+static void wait_for(struct cached_block *entry);
+static void evict();
+
+// Reads count blocks from block_num into buf, from the delta for blocks found there.
+// Returns 0 on success or -1.
+static int read_file(unsigned int block_num, unsigned char *buf, unsigned int count) {
+
+    int from_overlay;
+    unsigned int n;
+    int fd;
+    off_t offset;
+
+    while(count > 0) {
+        from_overlay = in_overlay(block_num);
+        for(n = 1; n < count && in_overlay(block_num + n) == from_overlay; n++);
+
+        fd = from_overlay ? overlay_fd : image_fd;
+        offset = from_overlay ? overlay_offset(block_num) : (off_t)block_num * EXT2_BLOCK_SIZE;
+        if(read_range(fd, offset, buf, (size_t)n * EXT2_BLOCK_SIZE) == -1)
+            return -1;
+
+        block_num += n;
+        buf += (size_t)n * EXT2_BLOCK_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+// Carries out a request right away with pread or pwritev.
+// Returns 0 on success or -1.
+static int sync_io(int write, unsigned int block_num, struct iovec *iov, unsigned int iovcnt, \
+        struct cached_block **entries) {
+
+    size_t size = 0;
+    unsigned int i;
+
+    if(write == 0) {
+        for(i = 0; i < iovcnt; i++) {
+            if(read_file(block_num, iov[i].iov_base, iov[i].iov_len / EXT2_BLOCK_SIZE) == -1)
+                return -1;
+            if(entries != NULL && image_writable)
+                memcpy(entries[i]->clean, entries[i]->data, EXT2_BLOCK_SIZE);
+            block_num += iov[i].iov_len / EXT2_BLOCK_SIZE;
+        }
+        return 0;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if(overlay_fd != -1) {
+        if(pwritev(overlay_fd, iov, iovcnt, overlay_offset(block_num)) != (ssize_t)size) {
+            perror("pwritev");
+            return -1;
+        }
+        overlay_mark(block_num, size / EXT2_BLOCK_SIZE);
+        return 0;
+    }
+    if(pwritev(image_fd, iov, iovcnt, (off_t)block_num * EXT2_BLOCK_SIZE) != (ssize_t)size) {
+        perror("pwritev");
+        return -1;
+    }
+    return 0;
+}
+
+static int pread_open(int fd, unsigned long long size, int writable, unsigned int pinned) {
+
+    char *env = getenv("EXT2_CACHE_BLOCKS");
+    unsigned int buckets = 1;
+
+    image_fd = fd;
+    image_writable = writable;
+    pinned_blocks = pinned;
+    capacity = DEFAULT_CACHE_BLOCKS;
+    if(env != NULL && atoi(env) > 0)
+        capacity = atoi(env);
+
+    pinned_data = malloc((size_t)pinned * EXT2_BLOCK_SIZE);
+    pinned_clean = writable ? malloc((size_t)pinned * EXT2_BLOCK_SIZE) : NULL;
+    while(buckets < 2 * capacity && buckets < (1 << 20))
+        buckets *= 2;
+    hash_table = calloc(buckets, sizeof(struct cached_block *));
+    hash_mask = buckets - 1;
+    if(pinned_data == NULL || (writable && pinned_clean == NULL) || hash_table == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    if(read_file(0, pinned_data, pinned) == -1)
+        return -1;
+    if(writable)
+        memcpy(pinned_clean, pinned_data, (size_t)pinned * EXT2_BLOCK_SIZE);
+
+    lru.lru_next = lru.lru_prev = &lru;
+    num_cached = 0;
+    return 0;
+}
+
+static struct cached_block *lookup(unsigned int block_num) {
+
+    struct cached_block *entry = hash_table[block_num & hash_mask];
+    while(entry != NULL && entry->block_num != block_num)
+        entry = entry->hash_next;
+    return entry;
+}
+
+static void lru_unlink(struct cached_block *entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(struct cached_block *entry) {
+    entry->lru_prev = &lru;
+    entry->lru_next = lru.lru_next;
+    lru.lru_next->lru_prev = entry;
+    lru.lru_next = entry;
+}
+
+// Adds an empty entry for block_num to the cache.
+// At capacity it takes the place of the least recently used block if that
+// block is clean and has not been handed out since the last checkpoint.
+// Otherwise the cache grows past capacity: a block handed out since then
+// may still be in use, and is only dropped at the next checkpoint.
+static struct cached_block *insert(unsigned int block_num) {
+
+    size_t size = offsetof(struct cached_block, clean) + (image_writable ? EXT2_BLOCK_SIZE : 0);
+    struct cached_block *entry = lru.lru_prev;
+
+    // Blocks are moved to the front when handed out, so the ones handed
+    // out since the last checkpoint are all ahead of the others
+    if(num_cached >= capacity && entry != &lru && entry->epoch != epoch && entry->pending == 0 && \
+            (image_writable == 0 || memcmp(entry->data, entry->clean, EXT2_BLOCK_SIZE) == 0))
+        evict();
+
+    entry = malloc(size);
+    if(entry == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    entry->block_num = block_num;
+    entry->epoch = epoch;
+    entry->pending = 0;
+    entry->hash_next = hash_table[block_num & hash_mask];
+    hash_table[block_num & hash_mask] = entry;
+    lru_push_front(entry);
+    num_cached++;
+    return entry;
+}
+
+static unsigned char *cache_get_block(unsigned int block_num) {
+
+    struct cached_block *entry;
+    struct iovec iov;
+
+    if(block_num < pinned_blocks)
+        return pinned_data + (size_t)block_num * EXT2_BLOCK_SIZE;
+
+    entry = lookup(block_num);
+    if(entry != NULL) {
+        if(lru.lru_next != entry) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+        }
+        entry->epoch = epoch;
+        wait_for(entry);
+        return entry->data;
+    }
+
+    // The caller needs the block now, so there is nothing to batch it with
+    entry = insert(block_num);
+    iov.iov_base = entry->data;
+    iov.iov_len = EXT2_BLOCK_SIZE;
+    if(sync_io(0, block_num, &iov, 1, &entry) == -1)
+        exit(EIO);
+    return entry->data;
+}
+
+// Returns the cached copy of block_num once it has arrived, or NULL if the block is not cached
+static unsigned char *cached_copy(unsigned int block_num) {
+
+    struct cached_block *entry;
+
+    if(block_num < pinned_blocks)
+        return pinned_data + (size_t)block_num * EXT2_BLOCK_SIZE;
+    entry = lookup(block_num);
+    if(entry == NULL)
+        return NULL;
+    wait_for(entry);
+    return entry->data;
+}
+
+// Copies count blocks from block_num into buf. Cached blocks may hold changes
+// not written back yet and are copied from the cache; runs of other blocks are
+// read straight into buf without going through the cache.
+static int cache_read(unsigned int block_num, unsigned int count, unsigned char *buf) {
+
+    struct iovec iov;
+    unsigned char *copy;
+    int batch = use_ring && count > RING_CHUNK;     // 1 if the request is split over the ring
+    unsigned int limit = batch ? RING_CHUNK : count;
+    unsigned int n;
+
+    while(count > 0) {
+        copy = cached_copy(block_num);
+        if(copy != NULL) {
+            memcpy(buf, copy, EXT2_BLOCK_SIZE);
+            n = 1;
+        }
+        else {
+            for(n = 1; n < count && n < limit && lookup(block_num + n) == NULL; n++);
+            iov.iov_base = buf;
+            iov.iov_len = (size_t)n * EXT2_BLOCK_SIZE;
+            if(batch && start_io(0, block_num, &iov, 1, NULL) == -1)
+                return -1;
+            if(batch == 0 && sync_io(0, block_num, &iov, 1, NULL) == -1)
+                return -1;
+        }
+        block_num += n;
+        buf += (size_t)n * EXT2_BLOCK_SIZE;
+        count -= n;
+    }
+    return finish_io();
+}
+
+// Writes count blocks from buf at block_num straight to the file,
+// and updates the cached copies so that write-back does not undo it
+static int cache_write(unsigned int block_num, unsigned int count, const unsigned char *buf) {
+
+    struct cached_block *entry;
+    struct iovec iov;
+    unsigned char *copy;
+    int batch = use_ring && count > RING_CHUNK;     // 1 if the request is split over the ring
+    unsigned int limit = batch ? RING_CHUNK : count;
+    unsigned int i;
+    unsigned int n;
+
+    for(i = 0; i < count; i++) {
+        copy = cached_copy(block_num + i);
+        if(copy == NULL)
+            continue;
+        memcpy(copy, buf + (size_t)i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+        if(block_num + i < pinned_blocks)
+            memcpy(pinned_clean + (size_t)(block_num + i) * EXT2_BLOCK_SIZE, copy, EXT2_BLOCK_SIZE);
+        else {
+            entry = (struct cached_block *)(copy - offsetof(struct cached_block, data));
+            memcpy(entry->clean, copy, EXT2_BLOCK_SIZE);
+        }
+    }
+
+    for(i = 0; i < count; i += n) {
+        n = count - i < limit ? count - i : limit;
+        iov.iov_base = (unsigned char *)buf + (size_t)i * EXT2_BLOCK_SIZE;
+        iov.iov_len = (size_t)n * EXT2_BLOCK_SIZE;
+        if(batch && start_io(1, block_num + i, &iov, 1, NULL) == -1)
+            return -1;
+        if(batch == 0 && sync_io(1, block_num + i, &iov, 1, NULL) == -1)
+            return -1;
+    }
+    return finish_io();
+}
+
+static int compare_dirty(const void *a, const void *b) {
+
+    unsigned int x = ((struct dirty_block *)a)->block_num;
+    unsigned int y = ((struct dirty_block *)b)->block_num;
+    return (x > y) - (x < y);
+}
+
+// Writes every changed block back to the file, merging neighbours into one request.
+// Returns 0 on success or -1.
+static int write_back() {
+
+    struct dirty_block *dirty;
+    struct cached_block *entry;
+    struct iovec iov[MAX_IOVECS];
+    unsigned int num_dirty = 0;
+    unsigned int block_num;
+    unsigned int i;
+    unsigned int n;
+    int failed = 0;
+
+    if(image_writable == 0)
+        return 0;
+
+    dirty = malloc((pinned_blocks + num_cached) * sizeof(struct dirty_block));
+    if(dirty == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for(block_num = 0; block_num < pinned_blocks; block_num++) {
+        dirty[num_dirty].block_num = block_num;
+        dirty[num_dirty].data = pinned_data + (size_t)block_num * EXT2_BLOCK_SIZE;
+        dirty[num_dirty].clean = pinned_clean + (size_t)block_num * EXT2_BLOCK_SIZE;
+        if(memcmp(dirty[num_dirty].data, dirty[num_dirty].clean, EXT2_BLOCK_SIZE) != 0)
+            num_dirty++;
+    }
+    for(entry = lru.lru_next; entry != &lru; entry = entry->lru_next) {
+        if(entry->pending == 0 && memcmp(entry->data, entry->clean, EXT2_BLOCK_SIZE) != 0) {
+            dirty[num_dirty].block_num = entry->block_num;
+            dirty[num_dirty].data = entry->data;
+            dirty[num_dirty].clean = entry->clean;
+            num_dirty++;
+        }
+    }
+    qsort(dirty, num_dirty, sizeof(struct dirty_block), compare_dirty);
+
+    for(i = 0; i < num_dirty; i += n) {
+        for(n = 0; n < MAX_IOVECS && i + n < num_dirty; n++) {
+            if(n > 0 && dirty[i + n].block_num != dirty[i + n - 1].block_num + 1)
+                break;
+            iov[n].iov_base = dirty[i + n].data;
+            iov[n].iov_len = EXT2_BLOCK_SIZE;
+        }
+        if(start_io(1, dirty[i].block_num, iov, n, NULL) == -1) {
+            failed = 1;
+            break;
+        }
+    }
+    if(finish_io() == -1)
+        failed = 1;
+
+    // A block is only clean once it is on disk, so a failed write is tried
+    // again by the next write-back. The data does not change while the
+    // writes are in flight.
+    if(failed == 0) {
+        for(i = 0; i < num_dirty; i++)
+            memcpy(dirty[i].clean, dirty[i].data, EXT2_BLOCK_SIZE);
+    }
+    free(dirty);
+    if(failed)
+        return -1;
+    if(overlay_fd != -1)
+        return overlay_write_bitmap();
+    return 0;
+}
+
+// Drops the least recently used block from the cache
+static void evict() {
+
+    struct cached_block *entry = lru.lru_prev;
+    struct cached_block **link = &hash_table[entry->block_num & hash_mask];
+
+    while(*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    lru_unlink(entry);
+    num_cached--;
+    free(entry);
+}
+
+static int cache_checkpoint() {
+
+    // Write-back waits for every request, so no read is still filling an entry below
+    if(write_back() == -1)
+        return -1;
+    while(num_cached > capacity)
+        evict();
+    epoch++;
+    return 0;
+}
+
+static int cache_sync() {
+
+    if(write_back() == -1)
+        return -1;
+    if(image_writable && fsync(overlay_fd != -1 ? overlay_fd : image_fd) == -1) {
+        perror("fsync");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0 on success or -1 if the changes could not be written back
+static int cache_close() {
+
+    int ret = write_back();
+
+    while(num_cached > 0)
+        evict();
+    free(hash_table);
+    free(pinned_data);
+    free(pinned_clean);
+    close(image_fd);
+    if(overlay_fd != -1)
+        overlay_close();
+    return ret;
+}
+
+/* From below is the locking that lets threads share the cache */
+
+// Held for the whole of each call into the cache. A block pointer stays valid
+// after the call returns because blocks are only dropped at a checkpoint.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *locked_get_block(unsigned int block_num) {
+
+    unsigned char *block;
+
+    pthread_mutex_lock(&cache_lock);
+    block = cache_get_block(block_num);
+    pthread_mutex_unlock(&cache_lock);
+    return block;
+}
+
+static int locked_read(unsigned int block_num, unsigned int count, unsigned char *buf) {
+
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_read(block_num, count, buf);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static int locked_write(unsigned int block_num, unsigned int count, const unsigned char *buf) {
+
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_write(block_num, count, buf);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static int locked_checkpoint() {
+
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_checkpoint();
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static int locked_sync() {
+
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_sync();
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/* From below is the pread backend */
+
+// Asks the kernel to start reading count blocks from block_num into the page cache.
+// Blocks are only added to our own cache when they are used.
+static void pread_prefetch(unsigned int block_num, unsigned int count) {
+    posix_fadvise(image_fd, (off_t)block_num * EXT2_BLOCK_SIZE, (off_t)count * EXT2_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+struct block_io pread_io = {
+    "pread", pread_open, locked_get_block, locked_read, locked_write, pread_prefetch,
+    locked_checkpoint, locked_sync, cache_close
+};
+
+/* From below is the io_uring backend */
+
+// A request in flight. user_data of its submission points here.
+struct ring_request {
+    int write;
+    size_t size;                        // bytes to transfer
+    struct cached_block **entries;      // cache entries being filled (one per iovec), or NULL
+    unsigned int iovcnt;
+    struct iovec iov[];
+};
+
+static int ring_fd = -1;
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned int sq_entries;
+static unsigned int cq_entries;
+static unsigned int to_submit;              // queued submissions the kernel has not seen yet
+static unsigned int in_flight;              // requests not completed yet
+static int ring_failed;                     // 1 if a request failed since the last finish_io
+
+static int ring_enter(unsigned int submit, unsigned int wait) {
+
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(ret == -1 && errno == EINTR);
+    if(ret == -1)
+        perror("io_uring_enter");
+    return ret;
+}
+
+// Handles one completion
+static void complete(struct io_uring_cqe *cqe) {
+
+    struct ring_request *req = (struct ring_request *)(unsigned long)cqe->user_data;
+    size_t done = cqe->res < 0 ? 0 : cqe->res;
+    size_t offset = 0;
+    unsigned int i;
+
+    if(cqe->res < 0) {
+        errno = -cqe->res;
+        perror(req->write ? "io_uring write" : "io_uring read");
+        ring_failed = 1;
+    }
+    else if(req->write && done != req->size) {
+        fprintf(stderr, "io_uring write: short write\n");
+        ring_failed = 1;
+    }
+
+    for(i = 0; i < req->iovcnt; i++) {
+        // What lies past the end of the file reads as zeros
+        if(req->write == 0 && offset + req->iov[i].iov_len > done) {
+            if(offset >= done)
+                memset(req->iov[i].iov_base, 0, req->iov[i].iov_len);
+            else
+                memset((unsigned char *)req->iov[i].iov_base + (done - offset), 0, offset + req->iov[i].iov_len - done);
+        }
+        offset += req->iov[i].iov_len;
+
+        if(req->entries != NULL) {
+            if(image_writable)
+                memcpy(req->entries[i]->clean, req->entries[i]->data, EXT2_BLOCK_SIZE);
+            req->entries[i]->pending = 0;
+        }
+    }
+
+    in_flight--;
+    free(req);
+}
+
+// Handles every completion that has arrived, waiting for at least wait of them
+static void reap(unsigned int wait) {
+
+    unsigned int head;
+    unsigned int reaped = 0;
+
+    while(1) {
+        head = *cq_head;
+        while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            complete(&cqes[head & *cq_mask]);
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if(reaped >= wait)
+            return;
+        if(ring_enter(to_submit, wait - reaped) == -1)
+            exit(EIO);
+        to_submit = 0;
+    }
+}
+
+static int ring_io(int write, unsigned int block_num, struct iovec *iov, unsigned int iovcnt, \
+        struct cached_block **entries) {
+
+    struct ring_request *req;
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    unsigned int i;
+
+    req = malloc(sizeof(struct ring_request) + iovcnt * sizeof(struct iovec) + \
+                 (entries != NULL ? iovcnt * sizeof(struct cached_block *) : 0));
+    if(req == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    req->write = write;
+    req->size = 0;
+    req->iovcnt = iovcnt;
+    req->entries = NULL;
+    memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+    for(i = 0; i < iovcnt; i++)
+        req->size += iov[i].iov_len;
+    if(entries != NULL) {
+        req->entries = (struct cached_block **)&req->iov[iovcnt];
+        for(i = 0; i < iovcnt; i++) {
+            req->entries[i] = entries[i];
+            entries[i]->pending = 1;
+        }
+    }
+
+    // Never have more requests out than the completion queue can hold
+    if(in_flight >= cq_entries)
+        reap(1);
+    tail = *sq_tail;
+    if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        if(ring_enter(to_submit, 0) == -1)
+            return -1;
+        to_submit = 0;
+    }
+
+    sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = image_fd;
+    sqe->off = (unsigned long long)block_num * EXT2_BLOCK_SIZE;
+    sqe->addr = (unsigned long)req->iov;
+    sqe->len = iovcnt;
+    sqe->user_data = (unsigned long)req;
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    to_submit++;
+    in_flight++;
+    return 0;
+}
+
+// Starts a request: with io_uring it is queued, and each entry in entries
+// stays pending until its block arrives. Otherwise it is carried out right away.
+// Returns 0 on success or -1.
+static int start_io(int write, unsigned int block_num, struct iovec *iov, unsigned int iovcnt, \
+        struct cached_block **entries) {
+
+    if(use_ring)
+        return ring_io(write, block_num, iov, iovcnt, entries);
+    return sync_io(write, block_num, iov, iovcnt, entries);
+}
+
+// Waits for every request in flight.
+// Returns 0 if all of them succeeded or -1.
+static int finish_io() {
+
+    int failed;
+
+    if(use_ring == 0)
+        return 0;
+    if(in_flight > 0)
+        reap(in_flight);
+    failed = ring_failed;
+    ring_failed = 0;
+    return failed ? -1 : 0;
+}
+
+// Waits until the read filling entry has completed
+static void wait_for(struct cached_block *entry) {
+
+    while(entry->pending)
+        reap(1);
+    if(ring_failed)
+        exit(EIO);
+}
+
+static int uring_open(int fd, unsigned long long size, int writable, unsigned int pinned) {
+
+    struct io_uring_params params;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned char *sq_ring;
+    unsigned char *cq_ring;
+
+    if(pread_open(fd, size, writable, pinned) == -1)
+        return -1;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(ring_fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    cq_ring = sq_ring;
+    if((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if(cq_ring == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+    }
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, \
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+    sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+    cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    cq_entries = params.cq_entries;
+    use_ring = 1;
+    return 0;
+}
+
+// Queues reads for the blocks among count blocks from block_num that are not cached yet,
+// one request per run of missing blocks, without waiting for them.
+// Once the cache is full, it only asks the kernel to read ahead like the pread backend,
+// so that read-ahead of large files does not pull them into the cache.
+static void uring_prefetch(unsigned int block_num, unsigned int count) {
+
+    struct iovec iov[MAX_IOVECS];
+    struct cached_block *entries[MAX_IOVECS];
+    unsigned int end = block_num + count;
+    unsigned int first;
+    unsigned int n;
+
+    if(num_cached + count > capacity) {
+        pread_prefetch(block_num, count);
+        return;
+    }
+    if(block_num < pinned_blocks)
+        block_num = pinned_blocks;
+
+    while(block_num < end) {
+        if(lookup(block_num) != NULL) {
+            block_num++;
+            continue;
+        }
+
+        first = block_num;
+        for(n = 0; n < MAX_IOVECS && block_num < end && lookup(block_num) == NULL; n++, block_num++) {
+            entries[n] = insert(block_num);
+            iov[n].iov_base = entries[n]->data;
+            iov[n].iov_len = EXT2_BLOCK_SIZE;
+        }
+        if(ring_io(0, first, iov, n, entries) == -1)
+            exit(EIO);
+    }
+
+    // Let the kernel start on them now rather than at the next wait
+    if(to_submit > 0 && ring_enter(to_submit, 0) != -1)
+        to_submit = 0;
+}
+
+static void locked_prefetch(unsigned int block_num, unsigned int count) {
+    pthread_mutex_lock(&cache_lock);
+    uring_prefetch(block_num, count);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int uring_close() {
+
+    int ret = cache_close();
+
+    close(ring_fd);
+    use_ring = 0;
+    return ret;
+}
+
+struct block_io uring_io = {
+    "uring", uring_open, locked_get_block, locked_read, locked_write, locked_prefetch,
+    locked_checkpoint, locked_sync, uring_close
+};
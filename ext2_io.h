@@ -0,0 +1,45 @@
+#ifndef __EXT2_IO_H__
+#define __EXT2_IO_H__
+
+// A way of getting at the blocks of an image file.
+// Blocks 0 to pinned - 1 (boot block, superblock and group descriptors) are kept
+// in one contiguous buffer by every backend so they can be used as arrays.
+// A pointer returned by get_block stays valid until the next checkpoint.
+// Threads may read through any backend at the same time: the cached ones
+// lock their cache.
+struct block_io {
+    char *name;
+    int (*open)(int fd, unsigned long long size, int writable, unsigned int pinned);
+    unsigned char *(*get_block)(unsigned int block_num);
+    int (*read)(unsigned int block_num, unsigned int count, unsigned char *buf);
+    int (*write)(unsigned int block_num, unsigned int count, const unsigned char *buf);
+    void (*prefetch)(unsigned int block_num, unsigned int count);
+    int (*checkpoint)();        // write back changed blocks and trim caches
+    int (*sync)();              // write back changed blocks and flush them to the file
+    int (*close)();             // write back changed blocks and close the image
+};
+
+extern struct block_io mmap_io;     // maps the whole image (the default)
+extern struct block_io pread_io;    // reads blocks into a bounded LRU cache
+extern struct block_io uring_io;    // the same cache, with requests batched through io_uring
+extern struct block_io *io;         // the backend of the open image
+
+int io_open(int fd, unsigned long long size, int writable, unsigned int pinned);
+
+#define OVERLAY_MAGIC 0x4C564F32    // "2OVL"
+
+// Block 0 of an overlay delta file. The presence bitmap (bit n set if image
+// block n is in the delta) takes the next bitmap_blocks blocks, and image
+// block n is stored at block 1 + bitmap_blocks + n, so the file is sparse and
+// only takes space for the blocks that were written.
+struct overlay_header {
+    unsigned int magic;
+    unsigned int blocks_count;      // blocks in the base image
+    unsigned int bitmap_blocks;
+    unsigned char base_uuid[16];    // s_uuid of the base image
+};
+
+int overlay_open(char *delta_name, int base_fd, unsigned long long size, int writable);
+int overlay_load(int fd, struct overlay_header *header, unsigned char **bitmap);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+#define OUT_SIZE (1 << 16)          // bytes gathered before each write to standard output
+
+// An entry of the directory being listed
+struct listing_entry {
+    unsigned int inum;
+    char *name;                     // in the directory block, not NUL-terminated
+    unsigned char name_len;
+    unsigned char file_type;
+    unsigned short mode;            // filled in by stat_entries
+    unsigned short links;
+    unsigned int size;
+    unsigned int blocks;            // in 1024-byte units
+};
+
+static int long_format;             // -l
+static int recursive;               // -R
+static int show_all;                // -a
+
+static char out_buf[OUT_SIZE];
+static size_t out_len;
+
+/* From below is the buffered writer */
+
+static void out_flush() {
+
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < out_len) {
+        n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1) {
+            perror("write");
+            exit(EIO);
+        }
+        done += n;
+    }
+    out_len = 0;
+}
+
+static void out_put(const char *s, size_t len) {
+
+    if(out_len + len > OUT_SIZE)
+        out_flush();
+    while(len > OUT_SIZE) {
+        memcpy(out_buf, s, OUT_SIZE);
+        out_len = OUT_SIZE;
+        out_flush();
+        s += OUT_SIZE;
+        len -= OUT_SIZE;
+    }
+    memcpy(out_buf + out_len, s, len);
+    out_len += len;
+}
+
+static void out_str(const char *s) {
+    out_put(s, strlen(s));
+}
+
+// Writes value right-aligned in width characters
+static void out_num(unsigned long long value, int width) {
+
+    char digits[24];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+    while(width-- > (int)sizeof(digits) - i)
+        out_put(" ", 1);
+    out_put(digits + i, sizeof(digits) - i);
+}
+
+// Writes mode the way ls -l does, like drwxr-xr-x
+static void out_mode(unsigned short mode) {
+
+    static const char *rwx = "rwxrwxrwx";
+    char text[10];
+    int i;
+
+    switch(mode & EXT2_IMODE_MASK) {
+        case EXT2_S_IFDIR: text[0] = 'd'; break;
+        case EXT2_S_IFLNK: text[0] = 'l'; break;
+        case EXT2_S_IFREG: text[0] = '-'; break;
+        case 0xC000:       text[0] = 's'; break;
+        case 0x6000:       text[0] = 'b'; break;
+        case 0x2000:       text[0] = 'c'; break;
+        case 0x1000:       text[0] = 'p'; break;
+        default:           text[0] = '?'; break;
+    }
+    for(i = 0; i < 9; i++)
+        text[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+
+    // setuid, setgid and sticky replace the execute bits
+    if(mode & 04000)
+        text[3] = (mode & 0100) ? 's' : 'S';
+    if(mode & 02000)
+        text[6] = (mode & 0010) ? 's' : 'S';
+    if(mode & 01000)
+        text[9] = (mode & 0001) ? 't' : 'T';
+    out_put(text, sizeof(text));
+}
+
+/* From below is the listing */
+
+static int compare_inum(const void *a, const void *b) {
+
+    unsigned int x = ((struct listing_entry *)a)->inum;
+    unsigned int y = ((struct listing_entry *)b)->inum;
+    return (x > y) - (x < y);
+}
+
+// Orders names bytewise, like ls in the C locale
+static int compare_name(const void *a, const void *b) {
+
+    const struct listing_entry *x = a;
+    const struct listing_entry *y = b;
+    int diff = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if(diff != 0)
+        return diff;
+    return (int)x->name_len - (int)y->name_len;
+}
+
+// Collects the entries of the directory dir_inum in block order into *entries.
+// Returns the number of entries.
+static unsigned int collect_entries(unsigned int dir_inum, struct listing_entry **entries) {
+
+    struct ext2_inode dir_inode = *get_inode(dir_inum);
+    struct ext2_dir_entry *entry;
+    struct block_iter iter;
+    struct block_run run;
+    unsigned int max_entries = 64;
+    unsigned int n = 0;
+    unsigned char *block;
+    unsigned int offset;
+    unsigned int i;
+
+    *entries = malloc(max_entries * sizeof(struct listing_entry));
+    if(*entries == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    // Queue every block of the directory before reading the first one
+    prefetch_inode_blocks(&dir_inode);
+
+    block_iter_init(&iter, &dir_inode);
+    while(block_iter_next(&iter, &run)) {
+        for(i = 0; i < run.length && run.physical != 0 && run.metadata == 0; i++) {
+            block = get_block(run.physical + i);
+            for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += entry->rec_len) {
+                entry = (struct ext2_dir_entry *)(block + offset);
+                if(entry->rec_len < 8)
+                    break;
+                if(entry->inode == 0 || entry->inode > sb->s_inodes_count || entry->name_len == 0)
+                    continue;
+                if(entry->name[0] == '.' && show_all == 0)
+                    continue;
+
+                if(n == max_entries) {
+                    max_entries *= 2;
+                    *entries = realloc(*entries, max_entries * sizeof(struct listing_entry));
+                    if(*entries == NULL) {
+                        perror("realloc");
+                        exit(ENOMEM);
+                    }
+                }
+                (*entries)[n].inum = entry->inode;
+                (*entries)[n].name = entry->name;
+                (*entries)[n].name_len = entry->name_len;
+                (*entries)[n].file_type = entry->file_type;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+// Reads the inode of every entry, visiting the inode tables in order.
+// Leaves entries sorted by inode number.
+static void stat_entries(struct listing_entry *entries, unsigned int n) {
+
+    struct ext2_inode *inode;
+    unsigned int first;
+    unsigned int last;
+    unsigned int block_num;
+    unsigned int i;
+
+    qsort(entries, n, sizeof(struct listing_entry), compare_inum);
+
+    // Ask for each run of adjacent inode table blocks in one go
+    first = last = 0;
+    for(i = 0; i < n; i++) {
+        block_num = inode_block(entries[i].inum);
+        if(i > 0 && (block_num == last || block_num == last + 1)) {
+            last = block_num;
+            continue;
+        }
+        if(i > 0)
+            prefetch_blocks(first, last - first + 1);
+        first = last = block_num;
+    }
+    if(n > 0)
+        prefetch_blocks(first, last - first + 1);
+
+    for(i = 0; i < n; i++) {
+        inode = get_inode(entries[i].inum);
+        entries[i].mode = inode->i_mode;
+        entries[i].links = inode->i_links_count;
+        entries[i].size = inode->i_size;
+        entries[i].blocks = inode->i_blocks / 2;
+    }
+}
+
+// Writes the target of the symbolic link inum.
+// ext2_ln gives links the size of a whole block, so the target also ends at a NUL.
+static void out_link_target(unsigned int inum) {
+
+    struct ext2_inode *inode = get_inode(inum);
+    unsigned int size = inode->i_size;
+    char *target;
+
+    // Short targets are kept in i_block itself
+    if(inode->i_blocks == 0) {
+        target = (char *)inode->i_block;
+        if(size > sizeof(inode->i_block))
+            size = sizeof(inode->i_block);
+    }
+    else if(inode->i_block[0] != 0) {
+        target = (char *)get_block(inode->i_block[0]);
+        if(size > EXT2_BLOCK_SIZE)
+            size = EXT2_BLOCK_SIZE;
+    }
+    else
+        return;
+    out_put(target, strnlen(target, size));
+}
+
+static void out_entry(struct listing_entry *entry) {
+
+    if(long_format) {
+        out_mode(entry->mode);
+        out_num(entry->links, 4);
+        out_num(entry->blocks, 8);
+        out_num(entry->size, 11);
+        out_put(" ", 1);
+    }
+    out_put(entry->name, entry->name_len);
+    if(long_format && (entry->mode & EXT2_IMODE_MASK) == EXT2_S_IFLNK) {
+        out_str(" -> ");
+        out_link_target(entry->inum);
+    }
+    out_put("\n", 1);
+}
+
+// Lists the directory dir_inum whose path is path, and with -R every directory below it
+static void list_dir(unsigned int dir_inum, char *path) {
+
+    struct listing_entry *entries;
+    unsigned int n = collect_entries(dir_inum, &entries);
+    unsigned int num_subdirs = 0;
+    unsigned int *subdirs = NULL;
+    char **subdir_paths = NULL;
+    unsigned int i;
+
+    if(long_format)
+        stat_entries(entries, n);
+    qsort(entries, n, sizeof(struct listing_entry), compare_name);
+
+    if(recursive) {
+        out_str(path);
+        out_str(":\n");
+    }
+    for(i = 0; i < n; i++)
+        out_entry(&entries[i]);
+
+    // Names point into cached blocks, so the subdirectories are noted before the checkpoint
+    if(recursive) {
+        subdirs = malloc((n + 1) * sizeof(unsigned int));
+        subdir_paths = malloc((n + 1) * sizeof(char *));
+        if(subdirs == NULL || subdir_paths == NULL) {
+            perror("malloc");
+            exit(ENOMEM);
+        }
+        for(i = 0; i < n; i++) {
+            if(entries[i].file_type != EXT2_FT_DIR || entries[i].inum == dir_inum || \
+                    (entries[i].name_len == 2 && strncmp(entries[i].name, "..", 2) == 0))
+                continue;
+            subdirs[num_subdirs] = entries[i].inum;
+            subdir_paths[num_subdirs] = malloc(strlen(path) + entries[i].name_len + 2);
+            if(subdir_paths[num_subdirs] == NULL) {
+                perror("malloc");
+                exit(ENOMEM);
+            }
+            sprintf(subdir_paths[num_subdirs], "%s%s%.*s", path, strcmp(path, "/") == 0 ? "" : "/", \
+                    entries[i].name_len, entries[i].name);
+            num_subdirs++;
+        }
+    }
+    free(entries);
+    checkpoint_image();
+
+    for(i = 0; i < num_subdirs; i++) {
+        out_put("\n", 1);
+        list_dir(subdirs[i], subdir_paths[i]);
+        free(subdir_paths[i]);
+    }
+    free(subdirs);
+    free(subdir_paths);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "lRa")) != -1) {
+        if(opt == 'l')
+            long_format = 1;
+        else if(opt == 'R')
+            recursive = 1;
+        else if(opt == 'a')
+            show_all = 1;
+        else
+            optind = argc + 1;
+    }
+
+    if(optind != argc - 1 && optind != argc - 2) {
+        fprintf(stderr, "Usage: ext2_ls [-l] [-R] [-a] <image file name> [absolute path]\n");
+        return EINVAL;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[optind], O_RDONLY) == -1) {
+        return ENOENT;
+    }
+
+    /* Find what to list */
+
+    char *path = strdup(optind == argc - 2 ? argv[optind + 1] : "/");
+    int inum;
+
+    if(path == NULL || path[0] != '/') {
+        fprintf(stderr, "ext2_ls: %s is not an absolute path\n", argv[argc - 1]);
+        return EINVAL;
+    }
+    while(strlen(path) > 1 && path[strlen(path) - 1] == '/')
+        path[strlen(path) - 1] = '\0';
+    inum = strcmp(path, "/") == 0 ? EXT2_ROOT_INO : pathwalk(path);
+    if(inum <= 0) {
+        fprintf(stderr, "ext2_ls: %s does not exist\n", path);
+        return ENOENT;
+    }
+
+    // A file is listed on its own, under the path it was given by
+    if((get_inode(inum)->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+        struct listing_entry entry;
+
+        entry.inum = inum;
+        entry.name = path;
+        entry.name_len = strlen(path) > 255 ? 255 : strlen(path);
+        entry.file_type = EXT2_FT_UNKNOWN;
+        stat_entries(&entry, 1);
+        out_entry(&entry);
+    }
+    else {
+        list_dir(inum, path);
+    }
+
+    out_flush();
+    return 0;
+}
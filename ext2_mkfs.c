@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+#define INODE_SIZE 128                  // size of inodes created by this program
+#define LOST_FOUND_INO 11               // lost+found takes the first non-reserved inode
+
+// Fills in one directory entry at entry and returns the next position
+static struct ext2_dir_entry *write_entry(struct ext2_dir_entry *entry, unsigned int inum, \
+        char *name, unsigned short rec_len) {
+
+    entry->inode = inum;
+    entry->rec_len = rec_len;
+    entry->name_len = strlen(name);
+    entry->file_type = EXT2_FT_DIR;
+    strncpy(entry->name, name, entry->name_len);
+    return (struct ext2_dir_entry *)((unsigned char *)entry + rec_len);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    int zero_itable = 0;    // 1 if inode tables are zeroed now instead of on first use
+    int argi = 1;
+
+    if(argc > 1 && strcmp(argv[1], "-z") == 0) {
+        zero_itable = 1;
+        argi++;
+    }
+
+    if(argc - argi < 2 || argc - argi > 3) {
+        fprintf(stderr, "Usage: ext2_mkfs [-z] <image file name> <number of blocks> [number of inodes]\n");
+        return -1;
+    }
+
+    unsigned int blocks_count = strtoul(argv[argi + 1], NULL, 10);
+    unsigned int inodes_count = blocks_count / 4;
+    if(argc - argi == 3)
+        inodes_count = strtoul(argv[argi + 2], NULL, 10);
+
+    /* Compute the layout of the block groups */
+
+    unsigned int blocks_per_group = EXT2_BLOCK_SIZE * 8;    // one bitmap block per group
+    unsigned int first_data_block = 1;
+    unsigned int groups;
+    unsigned int inodes_per_group;
+    unsigned int itable_blocks;     // number of inode table blocks in each group
+    unsigned int gdt_blocks;        // number of group descriptor blocks
+    unsigned int overhead;          // metadata blocks in the last group
+    unsigned int last_blocks;       // number of blocks in the last group
+
+    if(blocks_count < 16) {
+        fprintf(stderr, "ext2_mkfs: an image needs at least 16 blocks\n");
+        return EINVAL;
+    }
+
+    groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    while(1) {
+        // Inodes per group must fill whole inode table blocks
+        inodes_per_group = (inodes_count + groups - 1) / groups;
+        inodes_per_group = (inodes_per_group + 7) / 8 * 8;
+        if(inodes_per_group < 16)
+            inodes_per_group = 16;
+        if(inodes_per_group > blocks_per_group)
+            inodes_per_group = blocks_per_group;
+
+        itable_blocks = inodes_per_group * INODE_SIZE / EXT2_BLOCK_SIZE;
+        gdt_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+        // Drop the last group if it is too small to hold its own metadata
+        last_blocks = blocks_count - first_data_block - (groups - 1) * blocks_per_group;
+        overhead = 2 + itable_blocks;
+        if(has_super(groups - 1, 1))
+            overhead += 1 + gdt_blocks;
+        if(groups == 1)
+            overhead += 2;      // root and lost+found directory blocks
+
+        if(last_blocks > overhead + 1)
+            break;
+        if(groups == 1) {
+            fprintf(stderr, "ext2_mkfs: %u blocks cannot hold %u inodes\n", blocks_count, inodes_count);
+            return EINVAL;
+        }
+        blocks_count -= last_blocks;
+        groups--;
+    }
+    inodes_count = inodes_per_group * groups;
+
+    /* Create the image file and map it */
+
+    int image_fd = open(argv[argi], O_RDWR | O_CREAT, 0644);
+    if(image_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    // Space that is not written below reads as zeros if the file grows here
+    if(ftruncate(image_fd, (off_t)blocks_count * EXT2_BLOCK_SIZE) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    if(io_open(image_fd, (unsigned long long)blocks_count * EXT2_BLOCK_SIZE, 1, first_data_block + 1 + gdt_blocks) == -1)
+        return -1;
+
+    /* Fill in the superblock */
+
+    unsigned int now = time(NULL);
+    int i;
+
+    sb = (struct ext2_super_block *)(get_block(0) + 1024);
+    memset(sb, 0, EXT2_BLOCK_SIZE);
+    sb->s_inodes_count = inodes_count;
+    sb->s_blocks_count = blocks_count;
+    sb->s_first_data_block = first_data_block;
+    sb->s_blocks_per_group = blocks_per_group;
+    sb->s_frags_per_group = blocks_per_group;
+    sb->s_inodes_per_group = inodes_per_group;
+    sb->s_wtime = now;
+    sb->s_max_mnt_count = 0xFFFF;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = EXT2_VALID_FS;
+    sb->s_errors = 1;
+    sb->s_lastcheck = now;
+    sb->s_rev_level = EXT2_DYNAMIC_REV;
+    sb->s_first_ino = LOST_FOUND_INO;
+    sb->s_inode_size = INODE_SIZE;
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    sb->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+    srand(now ^ getpid());
+    for(i = 0; i < 16; i++)
+        sb->s_uuid[i] = rand();
+    sb->s_uuid[6] = (sb->s_uuid[6] & 0x0f) | 0x40;
+    sb->s_uuid[8] = (sb->s_uuid[8] & 0x3f) | 0x80;
+
+    gd = (struct ext2_group_desc *)get_block(first_data_block + 1);
+    num_groups = groups;
+    memset(gd, 0, gdt_blocks * EXT2_BLOCK_SIZE);
+
+    /* Lay out each block group: [superblock + descriptors] bitmaps, inode table, data */
+
+    unsigned int group;
+    unsigned int start;             // first block of the group
+    unsigned int next;              // next unused block in the group
+    unsigned int size;              // number of blocks in the group
+    unsigned char *bitmap;
+    unsigned int initialized;       // inodes of the table written now
+
+    for(group = 0; group < groups; group++) {
+        start = first_data_block + group * blocks_per_group;
+        size = group_blocks(group);
+        next = start;
+        if(has_super(group, 1))
+            next += 1 + gdt_blocks;
+
+        gd[group].bg_block_bitmap = next++;
+        gd[group].bg_inode_bitmap = next++;
+        gd[group].bg_inode_table = next;
+        next += itable_blocks;
+
+        // Block bitmap: metadata in use, bits past the end of the group padded as used
+        bitmap = get_block(gd[group].bg_block_bitmap);
+        memset(bitmap, 0, EXT2_BLOCK_SIZE);
+        for(i = 1; i <= next - start; i++)
+            set_to_used(bitmap, i);
+        for(i = size + 1; i <= blocks_per_group; i++)
+            set_to_used(bitmap, i);
+
+        // Inode bitmap: bits past the end of the table padded as used
+        bitmap = get_block(gd[group].bg_inode_bitmap);
+        memset(bitmap, 0, EXT2_BLOCK_SIZE);
+        for(i = inodes_per_group + 1; i <= EXT2_BLOCK_SIZE * 8; i++)
+            set_to_used(bitmap, i);
+
+        gd[group].bg_free_blocks_count = size - (next - start);
+        gd[group].bg_free_inodes_count = inodes_per_group;
+
+        // Only the table blocks that hold the reserved inodes are written
+        // unless -z is given. The rest is zeroed by allocate_inode on first use.
+        initialized = 0;
+        if(zero_itable)
+            initialized = inodes_per_group;
+        else if(group == 0)
+            initialized = (LOST_FOUND_INO + 7) / 8 * 8;
+        if(initialized > inodes_per_group)
+            initialized = inodes_per_group;
+        for(i = 0; i < initialized * INODE_SIZE / EXT2_BLOCK_SIZE; i++)
+            memset(get_block(gd[group].bg_inode_table + i), 0, EXT2_BLOCK_SIZE);
+
+        gd[group].bg_itable_unused = inodes_per_group - initialized;
+        if(gd[group].bg_itable_unused == 0)
+            gd[group].bg_flags |= EXT2_BG_INODE_ZEROED;
+
+        sb->s_free_blocks_count += gd[group].bg_free_blocks_count;
+        sb->s_free_inodes_count += inodes_per_group;
+
+        // Keeps the block cache of the pread backend bounded on large images
+        if(checkpoint_image() == -1)
+            return -1;
+    }
+
+    /* Reserve the special inodes and create the root and lost+found directories */
+
+    for(i = 1; i <= LOST_FOUND_INO; i++)
+        mark_inode_used(i);
+
+    unsigned int root_block = allocate_block();
+    unsigned int lost_found_block = allocate_block();
+    struct ext2_inode *inode;
+    struct ext2_dir_entry *entry;
+
+    inode = get_inode(EXT2_ROOT_INO);
+    inode->i_mode = EXT2_S_IFDIR | 0755;
+    inode->i_size = EXT2_BLOCK_SIZE;
+    inode->i_atime = inode->i_ctime = inode->i_mtime = now;
+    inode->i_links_count = 3;
+    inode->i_blocks = 2;
+    inode->i_block[0] = root_block;
+
+    entry = (struct ext2_dir_entry *)get_block(root_block);
+    entry = write_entry(entry, EXT2_ROOT_INO, ".", 12);
+    entry = write_entry(entry, EXT2_ROOT_INO, "..", 12);
+    write_entry(entry, LOST_FOUND_INO, "lost+found", EXT2_BLOCK_SIZE - 24);
+
+    inode = get_inode(LOST_FOUND_INO);
+    inode->i_mode = EXT2_S_IFDIR | 0700;
+    inode->i_size = EXT2_BLOCK_SIZE;
+    inode->i_atime = inode->i_ctime = inode->i_mtime = now;
+    inode->i_links_count = 2;
+    inode->i_blocks = 2;
+    inode->i_block[0] = lost_found_block;
+
+    entry = (struct ext2_dir_entry *)get_block(lost_found_block);
+    entry = write_entry(entry, LOST_FOUND_INO, ".", 12);
+    write_entry(entry, EXT2_ROOT_INO, "..", EXT2_BLOCK_SIZE - 12);
+
+    gd[0].bg_used_dirs_count = 2;
+
+    // Groups with unwritten inode tables need the gdt_csum feature so that
+    // e2fsck and the kernel trust bg_itable_unused
+    if(zero_itable == 0)
+        sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_GDT_CSUM;
+    for(group = 0; group < groups; group++)
+        update_group_checksum(group);
+
+    /* Write the backup superblocks and group descriptors */
+
+    struct ext2_super_block *backup;
+
+    for(group = 1; group < groups; group++) {
+        if(has_super(group, 1) == 0)
+            continue;
+
+        start = first_data_block + group * blocks_per_group;
+        backup = (struct ext2_super_block *)get_block(start);
+        memcpy(backup, sb, EXT2_BLOCK_SIZE);
+        backup->s_block_group_nr = group;
+        for(i = 0; i < gdt_blocks; i++)
+            memcpy(get_block(start + 1 + i), (unsigned char *)gd + i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+    }
+
+    if(sync_image() == -1)
+        return -1;
+    close_image();
+
+    return 0;
+}
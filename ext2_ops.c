@@ -0,0 +1,825 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_ops.h"
+
+#define PTRS_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int))    // pointers in an indirect block
+#define COPY_CHUNK (256 * 1024)                                     // bytes read from a source file at a time
+
+/* From below is the workload recorder */
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;    // held while a record is written
+
+// Appends the operation op on path to the file named by EXT2_RECORD, if it is set.
+// arg is the source name or source path (NULL if the operation has none).
+static void record(enum record_op op, char *path, char *arg, unsigned int size, int result) {
+
+    static int record_fd = -1;
+    static int failed = 0;
+    char *name = getenv("EXT2_RECORD");
+    struct op_record rec;
+    char *buf;
+    size_t len;
+    off_t end;
+
+    if(name == NULL || name[0] == '\0')
+        return;
+
+    pthread_mutex_lock(&record_lock);
+    if(failed) {
+        pthread_mutex_unlock(&record_lock);
+        return;
+    }
+    if(record_fd == -1) {
+        unsigned int magic = RECORD_MAGIC;
+
+        record_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        end = record_fd == -1 ? -1 : lseek(record_fd, 0, SEEK_END);
+        if(end == -1 || (end == 0 && write(record_fd, &magic, sizeof(magic)) != sizeof(magic))) {
+            perror(name);
+            failed = 1;
+            pthread_mutex_unlock(&record_lock);
+            return;
+        }
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.path_len = strlen(path);
+    rec.arg_len = arg == NULL ? 0 : strlen(arg);
+    rec.result = result;
+    rec.size = size;
+
+    // One write per record, so that tools appending to the same file at once do not interleave
+    len = sizeof(rec) + rec.path_len + rec.arg_len;
+    buf = malloc(len);
+    if(buf == NULL) {
+        perror("malloc");
+        pthread_mutex_unlock(&record_lock);
+        return;
+    }
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), path, rec.path_len);
+    memcpy(buf + sizeof(rec) + rec.path_len, arg, rec.arg_len);
+    if(write(record_fd, buf, len) != len) {
+        perror(name);
+        failed = 1;
+    }
+    pthread_mutex_unlock(&record_lock);
+    free(buf);
+}
+
+// Copies the name resolve_path found at the end of a path into name,
+// which has room for EXT2_NAME_LEN bytes and the null terminator.
+// Returns 0 on success or -1 if the name is too long.
+static int copy_name(char *name, struct path_info *info) {
+
+    if(info->name_len > EXT2_NAME_LEN)
+        return -1;
+    memcpy(name, info->name, info->name_len);
+    name[info->name_len] = '\0';
+    return 0;
+}
+
+// Returns a new directory entry for name pointing to inum
+static struct ext2_dir_entry *new_dir_entry(unsigned int inum, char *name, unsigned char file_type) {
+
+    struct ext2_dir_entry *entry = malloc(sizeof(struct ext2_dir_entry) + EXT2_NAME_LEN);
+    if(entry == NULL) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    entry->inode = inum;
+    entry->rec_len = -1;
+    entry->name_len = strlen(name);
+    entry->file_type = file_type;
+    strncpy(entry->name, name, entry->name_len);
+    return entry;
+}
+
+/* From below is the operations */
+
+// Copies file_size bytes to a new regular file at target, from data or,
+// if data is NULL, read from fd a chunk at a time.
+static int copy_file(char *target, char *source_name, const unsigned char *data, int fd, size_t file_size) {
+
+    /* Check if target path is valid */
+
+    char *file_name;             // name of the copied file
+    char name[EXT2_NAME_LEN + 1];   // last name in path, if the file is called that
+    unsigned int dest_inum;      // inode number for the directoy to which the copied file is added
+
+    // Full path info
+    int path_len = strlen(target);
+    struct path_info info;              // what the walk found, including the parent directory
+    unsigned int path_inum;             // inode number for the last file object in path
+    struct ext2_inode path_inode;
+    unsigned short path_type;
+
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+
+    // Check if path exists
+    path_inum = resolve_path(target, &info);
+
+    // Case 1: path exists
+    if(path_inum > 0) {
+        path_inode = *get_inode(path_inum);
+        path_type = path_inode.i_mode & EXT2_IMODE_MASK;
+
+        // Case 1-1: path is a directory
+        if(path_type == EXT2_S_IFDIR) {
+            // The source's name comes from the caller and is not part of the path
+            if(source_name[0] == '\0' || strchr(source_name, '/') != NULL) {
+                return EINVAL;
+            }
+            if(strlen(source_name) > EXT2_NAME_LEN) {
+                return ENAMETOOLONG;
+            }
+            file_name = source_name;
+            dest_inum = path_inum;
+
+        }
+        // Case 1-2: path is a file/link.
+        else {
+            // There is already a file that has the same name in parent's diretory
+            return EEXIST;
+
+        }
+
+    }
+
+    // Case 2: path does not exist
+    else {
+
+        // If path ends with '/', path does not exist.
+        if(target[path_len - 1] == '/') {
+            return ENOENT;
+        }
+
+        // If the parent is a valid directory, copy the file in parent's direcotry with
+        // with its name as last token in path
+
+        // The walk stopped at the parent's directory if the parent does not
+        // exist or is not a directory, and then path is invalid.
+        if(info.parent_inum == 0) {
+           return ENOENT;
+        }
+        if(copy_name(name, &info) == -1) {
+            return ENAMETOOLONG;
+        }
+
+        // The parent is a valid directory and path does not end with '/'
+
+        file_name = name;
+        dest_inum = info.parent_inum;
+
+    }
+
+    /* Check if the name is free, keeping other threads out of the directory until it is taken */
+
+    // In case 2 pathwalk already found it free, unless another thread has taken it since
+    lock_directory(dest_inum);
+    if((path_inum > 0 || image_threads) && search_directory(dest_inum, file_name) > 0) {
+        unlock_directory(dest_inum);
+        return EEXIST;
+    }
+
+    /* Reserve the inode and every block the copy needs */
+
+    // Data blocks, the indirect blocks that point to them, and the blocks
+    // the directory takes if it has to grow
+    unsigned int data_blocks = (file_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    struct reservation res;
+    unsigned char *buf = NULL;
+
+    if(data == NULL && (buf = malloc(COPY_CHUNK)) == NULL) {
+        unlock_directory(dest_inum);
+        perror("malloc");
+        return ENOMEM;
+    }
+    if(reserve(&res, 1, data_blocks + indirect_blocks(data_blocks) + \
+            directory_growth(dest_inum, strlen(file_name))) == -1) {
+        unlock_directory(dest_inum);
+        free(buf);
+        fprintf(stderr, "There is not enough space for the file.\n");
+        return ENOMEM;
+    }
+
+    // From here on every allocation comes out of the reservation and cannot fail
+
+    /* Allocate an inode to the new file */
+
+    unsigned int new_inum = allocate_inode();
+    struct ext2_inode *new_inode = get_inode(new_inum);
+
+    // ext2_pwrite sets i_size and i_blocks as it adds the blocks
+    new_inode->i_mode = EXT2_S_IFREG;
+    new_inode->i_links_count = 1;
+    new_inode->i_dtime = 0;
+
+    /* Add entry for the new file in the parent's directory */
+
+    struct ext2_dir_entry *new_entry = new_dir_entry(new_inum, file_name, EXT2_FT_REG_FILE);
+    add_new_entry(dest_inum, new_entry);
+    unlock_directory(dest_inum);
+    free(new_entry);
+
+    /* Copy the source file into empty data blocks */
+
+    // ext2_pwrite allocates each block, and the indirect blocks on the way
+    // to it, in file order
+    struct ext2_file *file = ext2_open_inode(new_inum, O_RDWR);
+    size_t total = 0;                       // bytes copied so far
+    size_t chunk;
+    ssize_t got;
+    int rv = file == NULL ? errno : 0;
+
+    while(rv == 0 && total < file_size) {
+        if(data != NULL) {
+            chunk = file_size - total;
+        }
+        else {
+            // The source is read as it is copied, so memory use does not grow with its size
+            got = read(fd, buf, file_size - total < COPY_CHUNK ? file_size - total : COPY_CHUNK);
+            if(got == -1 && errno == EINTR)
+                continue;
+            if(got == -1) {
+                perror("read");
+                rv = EIO;
+                break;
+            }
+            // The source got shorter after its size was taken
+            if(got == 0)
+                break;
+            chunk = got;
+        }
+
+        got = ext2_pwrite(file, data != NULL ? data + total : buf, chunk, total);
+        if(got != chunk)
+            rv = got == -1 ? errno : ENOSPC;
+        else
+            total += chunk;
+    }
+    if(file != NULL)
+        ext2_close(file);
+    free(buf);
+
+    // Gives back the block kept for the directory if it did not grow
+    release_reservation(&res);
+    return rv;
+}
+
+static int make_directory(char *target) {
+
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+
+    if(strncmp(target, "/", strlen(target)) == 0) {
+        return EEXIST;
+    }
+
+    // Find the new directory's parent direcotry.
+    // If path_inum > 0 (meaning the parent exists), it is a directory.
+    struct path_info info;
+    resolve_path(target, &info);
+    unsigned int path_inum = info.parent_inum;   // inode number for parent directory
+    unsigned int new_inum;                       // inode number for new directory
+    struct ext2_inode *new_inode;
+    char new_name[EXT2_NAME_LEN + 1];            // name of new directory
+
+    // Case 1: path does not exist.
+    if(path_inum == 0) {
+        return ENOENT;
+    }
+    if(copy_name(new_name, &info) == -1) {
+        return ENAMETOOLONG;
+    }
+
+    // Case 2-1: Same file name already exists in path.
+    // The parent stays locked until the new directory is complete.
+    // The walk already found the name free, unless another thread has taken
+    // it since or it is a file that the '/' at the end of path hid.
+    lock_directory(path_inum);
+    if((info.inum > 0 || image_threads || target[strlen(target) - 1] == '/') && \
+            search_directory(path_inum, new_name) > 0) {
+        unlock_directory(path_inum);
+        return EEXIST;
+    }
+
+    // Case 2-2: Same file name does not exist in path.
+
+    // Reserve the inode, the directory's block and the blocks the parent takes if it has to grow
+    struct reservation res;
+    if(reserve(&res, 1, 1 + directory_growth(path_inum, strlen(new_name))) == -1) {
+        unlock_directory(path_inum);
+        fprintf(stderr, "There is not enough space for the directory.\n");
+        return ENOMEM;
+    }
+
+    // Create inode for new directory
+    new_inum = allocate_inode();
+    new_inode = get_inode(new_inum);
+    new_inode->i_mode = EXT2_S_IFDIR;
+    new_inode->i_size = 1024;
+    new_inode->i_links_count = 2;
+    new_inode->i_blocks = 2;
+    new_inode->i_dtime = 0;
+
+    // Add entry for new directory in its parent directory
+    struct ext2_dir_entry *new_entry = new_dir_entry(new_inum, new_name, EXT2_FT_DIR);
+    add_new_entry(path_inum, new_entry);
+    free(new_entry);
+
+    // Allocate a block to new directory
+    unsigned int block_num = allocate_block();
+    new_inode = get_inode(new_inum);
+    new_inode->i_block[0] = block_num;
+
+    // Add current entry "." and parent entry '..' in new directory
+    new_entry = new_dir_entry(new_inum, ".", EXT2_FT_DIR);
+    add_new_entry(new_inum, new_entry);
+    free(new_entry);
+
+    new_entry = new_dir_entry(path_inum, "..", EXT2_FT_DIR);
+    add_new_entry(new_inum, new_entry);
+    free(new_entry);
+
+    lock_group(inode_group(new_inum));
+    gd[inode_group(new_inum)].bg_used_dirs_count++;
+    update_group_checksum(inode_group(new_inum));
+    unlock_group(inode_group(new_inum));
+    // Also increment links count for parent's directory
+    get_inode(path_inum)->i_links_count++;
+    unlock_directory(path_inum);
+
+    release_reservation(&res);
+    return 0;
+}
+
+static int make_link(char *source, char *target, int symbolic) {
+
+    if(source[0] != '/') {
+        return ENOENT;
+    }
+
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+
+    /* Check if source path and target path are valid. */
+
+    unsigned int source_inum;           // inode number for source file object
+    char source_name[EXT2_NAME_LEN + 1];    // name for source file object
+    unsigned int source_type;           // type for source file object
+    unsigned int target_inum;           // inode number for target file object
+    unsigned int target_type;           // type for target file object
+    unsigned int dest_inum;             // inode number for the directory to which new link entry is added
+    char *link_name;                    // name for new link
+    char name[EXT2_NAME_LEN + 1];       // last name in target path, if the link is called that
+    struct path_info info;              // what the walk of a path found
+    struct ext2_inode *inode;
+
+    // Source path
+    source_inum = resolve_path(source, &info);
+
+    // Case 1: source path is valid
+    if(source_inum > 0) {
+        inode = get_inode(source_inum);
+        source_type = inode->i_mode & EXT2_IMODE_MASK;
+        // Check if it is trying to hardlink to a directory
+        if(source_type == EXT2_S_IFDIR && !symbolic) {
+            return EISDIR;
+        }
+
+        if(copy_name(source_name, &info) == -1) {
+            return ENAMETOOLONG;
+        }
+    }
+
+    // Case 2: source path is invalid
+    else {
+        return ENOENT;
+    }
+
+    // Target path
+    target_inum = resolve_path(target, &info);
+
+    // Case 1: target path exists
+    if(target_inum > 0) {
+        inode = get_inode(target_inum);
+        target_type = inode->i_mode & EXT2_IMODE_MASK;
+
+        // Case 1-1: target is a directory
+        if(target_type == EXT2_S_IFDIR) {
+            dest_inum = target_inum;
+            link_name = source_name;
+        }
+
+        // Case 1-2: target path is a file/link
+        else {
+            // There is already a file object in this path that has same name as source file name
+            return EEXIST;
+        }
+    }
+
+    // Case 2: target path does not exist
+    else {
+
+        // Check if the directory target file object is in exists
+        // e.g. if full path is /path/to/target, we are checking /path/to/.
+        int path_len = strlen(target); // length of full path
+
+        // If the directory does not exist or (full) path ends with '/', (full) path is invalid.
+        // The walk gives the directory only if it is one.
+        if(info.parent_inum == 0 || target[path_len - 1] == '/') {
+            return ENOENT;
+        }
+        if(copy_name(name, &info) == -1) {
+            return ENAMETOOLONG;
+        }
+
+        // Obtain name for new link and inode number for its directory
+        dest_inum = info.parent_inum;
+        link_name = name;
+    }
+
+    /* Check if the name is free, keeping other threads out of the directory until it is taken */
+
+    // In case 2 pathwalk already found it free, unless another thread has taken it since
+    lock_directory(dest_inum);
+    if((target_inum > 0 || image_threads) && search_directory(dest_inum, link_name) > 0) {
+        unlock_directory(dest_inum);
+        return EEXIST;
+    }
+
+    /* Create a hard link if the flag is not given or a soft link if the flag is given */
+
+    struct ext2_dir_entry *new_entry;
+    struct reservation res;
+
+    // A symbolic link needs an inode and a block for its target, and either
+    // kind of link the blocks the directory takes if it has to grow
+    if(reserve(&res, symbolic, symbolic + directory_growth(dest_inum, strlen(link_name))) == -1) {
+        unlock_directory(dest_inum);
+        fprintf(stderr, "There is not enough space for the link.\n");
+        return ENOMEM;
+    }
+
+    // Hard link
+    if(!symbolic) {
+        // Create an entry for hard link which is linked to the source file object
+        // Note that file type cannot be a directory
+        new_entry = new_dir_entry(source_inum, link_name, \
+                source_type == EXT2_S_IFREG ? EXT2_FT_REG_FILE : EXT2_FT_SYMLINK);
+
+        // Add an entry for new link in the specified directory
+        add_new_entry(dest_inum, new_entry);
+        free(new_entry);
+
+        // Incremement link count for the source file object, which other threads may be linking too
+        __atomic_fetch_add(&get_inode(source_inum)->i_links_count, 1, __ATOMIC_RELAXED);
+    }
+
+    // Symbolic link
+    else {
+        // Allocate an inode to link
+        int new_inum = allocate_inode();
+        struct ext2_inode *new_inode = get_inode(new_inum);
+
+        new_inode->i_mode = EXT2_S_IFLNK;
+        new_inode->i_size = 1024;
+        new_inode->i_links_count = 1;
+        new_inode->i_block[0] = allocate_block();
+        new_inode->i_blocks = 2;
+        new_inode->i_dtime = 0;
+
+        // Write pathname to the block
+        char *block = (char *)get_block(new_inode->i_block[0]);
+        int source_len = strlen(source);
+        strncpy(block, source, source_len);
+        block[source_len] = '\0';
+
+        // Add an entry for new link in the specfied directory
+        new_entry = new_dir_entry(new_inum, link_name, EXT2_FT_SYMLINK);
+        add_new_entry(dest_inum, new_entry);
+        free(new_entry);
+    }
+
+    unlock_directory(dest_inum);
+    release_reservation(&res);
+    return 0;
+}
+
+static int unlink_file(char *target) {
+
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+
+    if(strncmp(target, "/", strlen(target)) == 0) {
+        return EISDIR;
+    }
+
+    /* Check if path is valid */
+
+    struct path_info info;                          // what the walk found
+    char name[EXT2_NAME_LEN + 1];                   // name of target file
+    resolve_path(target, &info);
+    unsigned int path_inum = info.parent_inum;      // inode number for the directory that has target file
+    unsigned int target_inum;                       // inode number for target file
+    struct ext2_inode *target_inode;                // inode for target file
+    unsigned int target_type;                       // type for target file object
+
+    // Case 1: path does not exist or path is not a directory
+
+    // The walk gives the directory only if it exists and is a directory.
+    if(path_inum == 0 || copy_name(name, &info) == -1) {
+        return ENOENT;
+    }
+
+    // Case 2: path exists and is a directory
+    // Check if path has target file.
+    // The walk found it already, unless the '/' at the end of path hid it
+    // or another thread may have changed the directory since.
+    lock_directory(path_inum);
+    target_inum = info.inum;
+    if(target_inum == 0 || image_threads)
+        target_inum = search_directory(path_inum, name);
+    if(target_inum == 0) {
+        unlock_directory(path_inum);
+        return ENOENT;
+    }
+
+    // Check if target file is a directory
+    target_inode = get_inode(target_inum);
+    target_type = target_inode->i_mode & EXT2_IMODE_MASK;
+    if(target_type == EXT2_S_IFDIR) {
+        unlock_directory(path_inum);
+        return EISDIR;
+    }
+
+    /* Remove the entry for the file */
+
+    remove_entry(path_inum, name);
+    unlock_directory(path_inum);
+
+    /* Deallocate associated inode and blocks for the file if links count became 0 */
+
+    // Other threads may be linking or unlinking the same file
+    target_inode = get_inode(target_inum);
+    if(__atomic_sub_fetch(&target_inode->i_links_count, 1, __ATOMIC_RELAXED) == 0) {
+
+        // Record deletion time
+        target_inode->i_dtime = time(0);
+
+        // Deallocate blocks associated with the file one run at a time
+        struct block_iter iter;
+        struct block_run run;
+
+        block_iter_init(&iter, get_inode(target_inum));
+        while(block_iter_next(&iter, &run)) {
+            if(run.physical != 0)
+                deallocate_blocks(run.physical, run.length);
+        }
+
+        // The inode goes last, as another thread may take it and clear it as soon as it is free
+        deallocate_inode(target_inum);
+    }
+
+    return 0;
+}
+
+static int restore_file(char *target) {
+
+    if(target[0] != '/') {
+        return ENOENT;
+    }
+
+    if(strncmp(target, "/", strlen(target)) == 0) {
+        return EISDIR;
+    }
+
+    /* Check if path is valid */
+
+    struct path_info info;                      // what the walk found
+    char target_name[EXT2_NAME_LEN + 1];        // name of the target file
+    resolve_path(target, &info);
+    unsigned int path_inum = info.parent_inum;           // inode number for the parent directory
+
+    // Case 1: path exists and is a directory
+    if(path_inum > 0 && copy_name(target_name, &info) == 0) {
+        // Check if there is a file that has same name as
+        // the target file in this directory (which the walk did not
+        // find if the '/' at the end of path hid it)
+        if(info.inum > 0 || (target[strlen(target) - 1] == '/' && \
+                    search_directory(path_inum, target_name) > 0)) {
+            return EEXIST;
+        }
+    }
+
+    // Case 2: path does not exist or is a file/link
+    else {
+        return ENOENT;
+    }
+
+    /* Look for the target file entry in this directory */
+
+    // Directory info
+    struct ext2_inode *dir_inode = get_inode(path_inum);
+
+    // Current data block info
+    unsigned int cur_block_idx = 0;     // idx for i_block
+    unsigned int cur_block_offset = 0;  // offset at current block
+    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry *)get_block(dir_inode->i_block[0]);
+
+    int space_used;                         // space current entry actually uses (including padding)
+    int space_have;                         // extra space current entry has
+    struct ext2_dir_entry *hidden_entry;    // a pointer to a removed entry in current entry
+    unsigned int target_inum = 0;                    // inode number for the target file
+
+    while(cur_entry != NULL) {
+
+        // Check if current entry is blank and matches the target file
+        if(cur_entry->inode == 0 && \
+                strncmp(cur_entry->name, target_name, max(cur_entry->name_len, strlen(target_name))) == 0) {
+
+            return ENOENT;
+        }
+
+        space_used = ceil((double)(8 + cur_entry->name_len) / 4) * 4;
+        space_have = cur_entry->rec_len - space_used;
+
+        // Search current entry (could be blank or not) if it has enough space to contain more entries
+        if(space_have >= 12) {
+
+            hidden_entry = cur_entry;
+
+            while(space_have > 0) {
+                // move to position where hidden entry might exist
+                hidden_entry = (struct ext2_dir_entry *)((unsigned char *)hidden_entry + space_used);
+
+                // Check if there is hidden entry at this position
+                if(hidden_entry->inode != 0) {
+
+                    // Check if current entry is the one we are looking for
+                    if(strncmp(hidden_entry->name, target_name, \
+                                max(hidden_entry->name_len, strlen(target_name))) == 0) {
+                        // Found a match
+
+                        // Cannot be a directory
+                        if(hidden_entry->file_type == EXT2_FT_DIR) {
+                            return EISDIR;
+                        }
+                        // Save inode number for the target file for later
+                        target_inum = hidden_entry->inode;
+                        break;
+                    }
+                    // If not a match, update info for next use
+                    else {
+                        space_used = ceil((double)(8 + hidden_entry->name_len) / 4) * 4;
+                        space_have -= space_used;
+                    }
+                }
+                // If there is no hidden entry at this position, current entry must be the last entry
+                // because only last entries can have extra space without containing hidden entries.
+                // There cannot be more hidden entries from here in this entry, so move to next block.
+                else {
+                    break;
+                }
+            }
+            // If a match has been found, proceed to next step
+            if(target_inum > 0)
+                break;
+            // If a match has not been found, move to next entry
+            else
+                goto notfound;
+        }
+
+        // Move to next entry if current entry has not enough space
+        else {
+            notfound:
+            cur_entry = move_entry(cur_entry, path_inum, &cur_block_idx, &cur_block_offset);
+        }
+    }
+
+
+    /* Restore inode and blocks */
+
+    // Check if target file has been found
+    if(target_inum == 0) {
+        return ENOENT;
+    }
+
+    // Check if target file's inode has been reused
+    if(inode_in_use(target_inum) == 1) {
+        return ENOENT;
+    }
+
+
+    // Check if target file's blocks have been reused
+    struct ext2_inode *target_inode = get_inode(target_inum);
+    struct block_iter iter;
+    struct block_run run;
+
+    block_iter_init(&iter, target_inode);
+    while(block_iter_next(&iter, &run)) {
+        if(run.physical != 0 && count_blocks_in_use(run.physical, run.length) > 0) {
+            return ENOENT;
+        }
+    }
+
+    // Restore target file's entry
+    hidden_entry->rec_len = space_have;
+    cur_entry->rec_len -= space_have;
+
+    // Set target file's inode to used
+    mark_inode_used(target_inum);
+    target_inode = get_inode(target_inum);
+    target_inode->i_links_count = 1;
+    target_inode->i_dtime = 0;
+
+    // Set target file's blocks to used
+    block_iter_init(&iter, target_inode);
+    while(block_iter_next(&iter, &run)) {
+        if(run.physical != 0)
+            mark_blocks_used(run.physical, run.length);
+    }
+
+    return 0;
+}
+
+/* From below is the entry points, which record each operation */
+
+// Copies size bytes of data to a new regular file at target.
+// If target is a directory, the file is called source_name in it.
+int ext2_copy(char *target, char *source_name, const void *data, size_t size) {
+
+    int rv = size > MAX_COPY_SIZE ? EFBIG : copy_file(target, source_name, data, -1, size);
+
+    fold_free_counts();
+    record(RECORD_COPY, target, source_name, size, rv);
+    return rv;
+}
+
+// Copies the size bytes fd reads to a new regular file at target, as
+// ext2_copy does. Only COPY_CHUNK bytes of the source are held at a time.
+int ext2_copy_fd(char *target, char *source_name, int fd, off_t size) {
+
+    int rv = size > MAX_COPY_SIZE ? EFBIG : copy_file(target, source_name, NULL, fd, size);
+
+    fold_free_counts();
+    record(RECORD_COPY, target, source_name, size, rv);
+    return rv;
+}
+
+// Creates the directory path
+int ext2_mkdir(char *path) {
+
+    int rv = make_directory(path);
+
+    fold_free_counts();
+    record(RECORD_MKDIR, path, NULL, 0, rv);
+    return rv;
+}
+
+// Links target to source, with a hard link or (if symbolic is 1) a symbolic link.
+// If target is a directory, the link gets the name of source in it.
+int ext2_link(char *source, char *target, int symbolic) {
+
+    int rv = make_link(source, target, symbolic);
+
+    fold_free_counts();
+    record(symbolic ? RECORD_SYMLINK : RECORD_LINK, target, source, 0, rv);
+    return rv;
+}
+
+// Removes the file or link at path
+int ext2_unlink(char *path) {
+
+    int rv = unlink_file(path);
+
+    fold_free_counts();
+    record(RECORD_UNLINK, path, NULL, 0, rv);
+    return rv;
+}
+
+// Brings back the removed file or link at path, if its inode and blocks are still free
+int ext2_restore(char *path) {
+
+    int rv = restore_file(path);
+
+    fold_free_counts();
+    record(RECORD_RESTORE, path, NULL, 0, rv);
+    return rv;
+}
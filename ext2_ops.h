@@ -0,0 +1,46 @@
+#ifndef __EXT2_OPS_H__
+#define __EXT2_OPS_H__
+
+// The operations behind ext2_cp, ext2_mkdir, ext2_ln, ext2_rm and ext2_restore,
+// for programs that run many of them on one open image (see ext2_replay).
+// Each returns 0 on success or the errno code the tool exits with.
+// Paths are absolute paths on the image and are not modified.
+// Between begin_threads and end_threads, all but ext2_restore may be called
+// from several threads at once.
+
+int ext2_copy(char *target, char *source_name, const void *data, size_t size);
+int ext2_copy_fd(char *target, char *source_name, int fd, off_t size);
+int ext2_mkdir(char *path);
+int ext2_link(char *source, char *target, int symbolic);
+int ext2_unlink(char *path);
+int ext2_restore(char *path);
+
+#define MAX_COPY_SIZE 0xffffffffULL  // largest file ext2_copy makes: i_size has 32 bits
+
+#define RECORD_MAGIC 0x43455232    // "2REC"
+
+// Kinds of operation in a workload record
+enum record_op {
+    RECORD_COPY,
+    RECORD_MKDIR,
+    RECORD_LINK,
+    RECORD_SYMLINK,
+    RECORD_UNLINK,
+    RECORD_RESTORE
+};
+
+// When EXT2_RECORD names a file, every operation above is appended to it.
+// The file starts with RECORD_MAGIC, and each record is followed by
+// path_len bytes of path and arg_len bytes of argument: the source name
+// given to ext2_copy or the source path given to ext2_link.
+// File contents are not recorded, only their size.
+struct op_record {
+    unsigned short op;              // an enum record_op
+    unsigned short path_len;
+    unsigned short arg_len;
+    unsigned short unused;
+    int result;                     // what the operation returned
+    unsigned int size;              // bytes copied by RECORD_COPY
+};
+
+#endif
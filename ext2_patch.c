@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2_patch <image file name> <delta file name>\n");
+        return -1;
+    }
+
+    /* Check that the delta was made from this version of the image */
+
+    int image_fd = open(argv[1], O_RDWR);
+    FILE *delta = fopen(argv[2], "r");
+    struct stat image_stats;
+    struct delta_header header;
+    unsigned char super[EXT2_BLOCK_SIZE];
+
+    if(image_fd == -1 || fstat(image_fd, &image_stats) == -1) {
+        perror(argv[1]);
+        return ENOENT;
+    }
+    if(delta == NULL) {
+        perror(argv[2]);
+        return ENOENT;
+    }
+    if(fread(&header, sizeof(header), 1, delta) != 1 || header.magic != DELTA_MAGIC) {
+        fprintf(stderr, "ext2_patch: %s is not a delta file\n", argv[2]);
+        return EINVAL;
+    }
+    if(pread(image_fd, super, EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE) {
+        perror("pread");
+        return EIO;
+    }
+    // The image already has the new size if an earlier run of the patch
+    // was interrupted after resizing it
+    if((image_stats.st_size != (off_t)header.old_blocks * EXT2_BLOCK_SIZE && \
+            image_stats.st_size != (off_t)header.new_blocks * EXT2_BLOCK_SIZE) || \
+            memcmp(super, header.old_super, EXT2_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ext2_patch: %s does not apply to %s\n", argv[2], argv[1]);
+        return EINVAL;
+    }
+
+    if(header.new_blocks != header.old_blocks && \
+            ftruncate(image_fd, (off_t)header.new_blocks * EXT2_BLOCK_SIZE) == -1) {
+        perror("ftruncate");
+        return EIO;
+    }
+
+    /* Write each run over the image */
+
+    // The superblock is written last, so that an interrupted patch
+    // still matches the delta and can be run again
+    static unsigned char data[EXT2_BLOCK_SIZE];
+    struct delta_run run;
+    int new_super = 0;
+    unsigned int applied = 0;
+    unsigned int r;
+    unsigned int i;
+
+    for(r = 0; r < header.num_runs; r++) {
+        if(fread(&run, sizeof(run), 1, delta) != 1 || (unsigned long long)run.start + run.count > header.new_blocks) {
+            fprintf(stderr, "ext2_patch: %s is truncated or corrupted\n", argv[2]);
+            return EINVAL;
+        }
+
+        for(i = 0; i < run.count; i++) {
+            if(run.flags & DELTA_ZERO)
+                memset(data, 0, EXT2_BLOCK_SIZE);
+            else if(fread(data, EXT2_BLOCK_SIZE, 1, delta) != 1) {
+                fprintf(stderr, "ext2_patch: %s is truncated\n", argv[2]);
+                return EINVAL;
+            }
+
+            if(run.start + i == 1) {
+                memcpy(super, data, EXT2_BLOCK_SIZE);
+                new_super = 1;
+            }
+            else if(pwrite(image_fd, data, EXT2_BLOCK_SIZE, (off_t)(run.start + i) * EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE) {
+                perror("pwrite");
+                return EIO;
+            }
+            applied++;
+        }
+    }
+
+    if(fsync(image_fd) == -1) {
+        perror("fsync");
+        return EIO;
+    }
+    if(new_super && (pwrite(image_fd, super, EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE || fsync(image_fd) == -1)) {
+        perror("pwrite");
+        return EIO;
+    }
+
+    printf("Applied %u blocks from %s to %s\n", applied, argv[2], argv[1]);
+    return 0;
+}
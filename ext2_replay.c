@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_ops.h"
+
+#define CHECKPOINT_OPS 256      // operations between checkpoints, to bound the block cache
+#define MAX_REPORTED 10         // differing results printed before the rest are only counted
+
+static const char *op_names[] = {"cp", "mkdir", "ln", "ln -s", "rm", "restore"};
+
+// Returns the time in seconds
+static double now() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Makes data at least size bytes of made-up file contents.
+// The bytes come from a fixed xorshift sequence, so every replay writes the same image.
+static unsigned char *synthetic_data(unsigned int size) {
+
+    static unsigned char *data = NULL;
+    static unsigned int have = 0;
+    static unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    unsigned int i;
+
+    if(size <= have)
+        return data;
+
+    data = realloc(data, size);
+    if(data == NULL) {
+        perror("realloc");
+        exit(ENOMEM);
+    }
+    for(i = have; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[i] = state;
+    }
+    have = size;
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2_replay <image file name> <record file name>\n");
+        return -1;
+    }
+
+    /* Read the operations recorded through EXT2_RECORD */
+
+    FILE *trace = fopen(argv[2], "r");
+    unsigned char *records;
+    long trace_size;
+    unsigned int magic;
+
+    if(trace == NULL) {
+        perror(argv[2]);
+        return ENOENT;
+    }
+    if(fread(&magic, sizeof(magic), 1, trace) != 1 || magic != RECORD_MAGIC) {
+        fprintf(stderr, "ext2_replay: %s is not a record file\n", argv[2]);
+        return EINVAL;
+    }
+    fseek(trace, 0, SEEK_END);
+    trace_size = ftell(trace) - sizeof(magic);
+    fseek(trace, sizeof(magic), SEEK_SET);
+    records = malloc(trace_size + 1);
+    if(records == NULL) {
+        perror("malloc");
+        return ENOMEM;
+    }
+    if(fread(records, 1, trace_size, trace) != trace_size) {
+        perror("fread");
+        return EIO;
+    }
+    fclose(trace);
+
+    /* Intiailize disk and other structures */
+
+    // Replaying is not itself recorded
+    unsetenv("EXT2_RECORD");
+
+    if(open_image(argv[1], O_RDWR) == -1) {
+        return -1;
+    }
+
+    /* Apply each operation in turn */
+
+    static char path[USHRT_MAX + 1];
+    static char arg[USHRT_MAX + 1];
+    struct op_record rec;
+    unsigned int counts[RECORD_RESTORE + 1] = {0};
+    unsigned int num_ops = 0;
+    unsigned int differ = 0;            // operations whose result is not the recorded one
+    unsigned long long bytes = 0;       // file data written by cp
+    long offset = 0;
+    double start = now();
+    double elapsed;
+    int rv;
+    int i;
+
+    while(offset < trace_size) {
+        if(trace_size - offset < sizeof(rec)) {
+            fprintf(stderr, "ext2_replay: %s is truncated\n", argv[2]);
+            break;
+        }
+        memcpy(&rec, records + offset, sizeof(rec));
+        if(rec.op > RECORD_RESTORE || trace_size - offset - sizeof(rec) < rec.path_len + rec.arg_len) {
+            fprintf(stderr, "ext2_replay: %s is truncated or corrupted\n", argv[2]);
+            break;
+        }
+        offset += sizeof(rec);
+        memcpy(path, records + offset, rec.path_len);
+        path[rec.path_len] = '\0';
+        offset += rec.path_len;
+        memcpy(arg, records + offset, rec.arg_len);
+        arg[rec.arg_len] = '\0';
+        offset += rec.arg_len;
+
+        switch(rec.op) {
+            case RECORD_COPY:
+                rv = ext2_copy(path, arg, synthetic_data(rec.size), rec.size);
+                if(rv == 0)
+                    bytes += rec.size;
+                break;
+            case RECORD_MKDIR:   rv = ext2_mkdir(path); break;
+            case RECORD_LINK:    rv = ext2_link(arg, path, 0); break;
+            case RECORD_SYMLINK: rv = ext2_link(arg, path, 1); break;
+            case RECORD_UNLINK:  rv = ext2_unlink(path); break;
+            default:             rv = ext2_restore(path); break;
+        }
+
+        if(rv != rec.result) {
+            if(differ < MAX_REPORTED)
+                fprintf(stderr, "ext2_replay: %s %s returned %d, recorded %d\n", op_names[rec.op], path, rv, rec.result);
+            differ++;
+        }
+        counts[rec.op]++;
+        num_ops++;
+
+        if(num_ops % CHECKPOINT_OPS == 0 && checkpoint_image() == -1)
+            return EIO;
+    }
+
+    // Writing back the changes is part of the work being measured
+    close_image();
+    elapsed = now() - start;
+
+    /* Report the throughput */
+
+    printf("Replayed %u operations in %.3f s: %.0f operations/s, %.1f MB/s of file data\n", \
+           num_ops, elapsed, num_ops / elapsed, bytes / elapsed / 1e6);
+    for(i = 0; i <= RECORD_RESTORE; i++) {
+        if(counts[i] > 0)
+            printf("  %-8s %u\n", op_names[i], counts[i]);
+    }
+    if(differ > 0)
+        printf("%u operations returned something other than what was recorded\n", differ);
+    return 0;
+}
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_csum.h"
+
+// Where the metadata of a group that holds a descriptor copy goes when the
+// descriptor table grows into it. A field of 0 means the item stays put.
+struct relocation {
+    unsigned int block_bitmap;
+    unsigned int inode_bitmap;
+    unsigned int inode_table;
+    unsigned char bitmap[EXT2_BLOCK_SIZE];  // block bitmap of the group after the move
+};
+
+// Returns the number of blocks the descriptors of groups take up
+static unsigned int gdt_blocks(unsigned int groups) {
+    return (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+}
+
+// Returns the number of blocks in an inode table
+static unsigned int itable_blocks() {
+
+    unsigned int size = (sb->s_rev_level < EXT2_DYNAMIC_REV) ? 128 : sb->s_inode_size;
+    return (sb->s_inodes_per_group * size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+}
+
+static void clear_bit(unsigned char *bitmap, int num) {
+    bitmap[(num - 1) / 8] &= ~(1 << ((num - 1) % 8));
+}
+
+// Returns the position (counted from 1) of the first run of count free bits
+// in the first size bits of bitmap, and marks it used. Returns 0 if there is none.
+static unsigned int take_free_run(unsigned char *bitmap, unsigned int size, unsigned int count) {
+
+    unsigned int num;
+    unsigned int length = 0;
+
+    for(num = 1; num <= size; num++) {
+        length = check_allocation(bitmap, num) ? 0 : length + 1;
+        if(length == count) {
+            for(; length > 0; length--)
+                set_to_used(bitmap, num - length + 1);
+            return num - count + 1;
+        }
+    }
+    return 0;
+}
+
+// Plans how to free blocks first to end - 1 of group for new descriptor blocks
+// by moving its bitmaps and inode table elsewhere in the group.
+// Nothing on disk changes here. Returns 0 or -1 if file data is in the way
+// or the group has no room for the moved metadata.
+static int plan_relocation(unsigned int group, unsigned int first, unsigned int end, struct relocation *r) {
+
+    unsigned int start = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    unsigned int size = group_blocks(group);
+    unsigned int table = gd[group].bg_inode_table;
+    unsigned int table_end = table + itable_blocks();
+    unsigned int block_num;
+    unsigned int num;
+
+    memset(r, 0, sizeof(struct relocation));
+    memcpy(r->bitmap, get_block(gd[group].bg_block_bitmap), EXT2_BLOCK_SIZE);
+
+    for(block_num = first; block_num < end; block_num++) {
+        if(block_num == gd[group].bg_block_bitmap)
+            r->block_bitmap = 1;
+        else if(block_num == gd[group].bg_inode_bitmap)
+            r->inode_bitmap = 1;
+        else if(block_num >= table && block_num < table_end)
+            r->inode_table = 1;
+        else if(check_allocation(r->bitmap, block_num - start + 1)) {
+            fprintf(stderr, "ext2_resize: block %u is in use by a file and is needed for group descriptors\n", \
+                    block_num);
+            return -1;
+        }
+        set_to_used(r->bitmap, block_num - start + 1);
+    }
+
+    if(r->inode_table) {
+        num = take_free_run(r->bitmap, size, itable_blocks());
+        if(num == 0)
+            goto no_room;
+        r->inode_table = start + num - 1;
+        // Table blocks outside the new descriptor blocks become free
+        for(block_num = table; block_num < table_end; block_num++) {
+            if(block_num < first || block_num >= end)
+                clear_bit(r->bitmap, block_num - start + 1);
+        }
+    }
+    if(r->inode_bitmap) {
+        num = take_free_run(r->bitmap, size, 1);
+        if(num == 0)
+            goto no_room;
+        r->inode_bitmap = start + num - 1;
+    }
+    if(r->block_bitmap) {
+        num = take_free_run(r->bitmap, size, 1);
+        if(num == 0)
+            goto no_room;
+        r->block_bitmap = start + num - 1;
+    }
+    return 0;
+
+no_room:
+    fprintf(stderr, "ext2_resize: group %u has no room to move its metadata\n", group);
+    return -1;
+}
+
+// Carries out a relocation planned by plan_relocation and fixes the free counts
+static void apply_relocation(unsigned int group, struct relocation *r) {
+
+    unsigned int size = group_blocks(group);
+    unsigned int free_blocks = 0;
+    unsigned int num;
+
+    if(r->inode_table) {
+        for(num = 0; num < itable_blocks(); num++)
+            memcpy(get_block(r->inode_table + num), get_block(gd[group].bg_inode_table + num), EXT2_BLOCK_SIZE);
+        gd[group].bg_inode_table = r->inode_table;
+    }
+    if(r->inode_bitmap) {
+        memcpy(get_block(r->inode_bitmap), get_block(gd[group].bg_inode_bitmap), EXT2_BLOCK_SIZE);
+        gd[group].bg_inode_bitmap = r->inode_bitmap;
+    }
+    if(r->block_bitmap)
+        gd[group].bg_block_bitmap = r->block_bitmap;
+    memcpy(get_block(gd[group].bg_block_bitmap), r->bitmap, EXT2_BLOCK_SIZE);
+
+    for(num = 1; num <= size; num++) {
+        if(check_allocation(r->bitmap, num) == 0)
+            free_blocks++;
+    }
+    sb->s_free_blocks_count -= gd[group].bg_free_blocks_count - free_blocks;
+    gd[group].bg_free_blocks_count = free_blocks;
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2_resize <image file name> <new number of blocks>\n");
+        return -1;
+    }
+
+    // The base of an overlay is never written, and the delta is sized for it
+    if(getenv("EXT2_OVERLAY") != NULL && getenv("EXT2_OVERLAY")[0] != '\0') {
+        fprintf(stderr, "ext2_resize: cannot resize through an overlay, flatten it first\n");
+        return EINVAL;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[1], O_RDWR) == -1) {
+        return -1;
+    }
+
+    /* Work out the new layout */
+
+    unsigned int blocks_count = strtoul(argv[2], NULL, 10);
+    unsigned int bpg = sb->s_blocks_per_group;
+    unsigned int ipg = sb->s_inodes_per_group;
+    int sparse = (sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
+    unsigned int old_blocks = sb->s_blocks_count;
+    unsigned int old_groups = num_groups;
+    unsigned int groups;
+    unsigned int last_blocks;       // number of blocks in the new last group
+    unsigned int overhead;          // metadata blocks in the new last group
+
+    if(blocks_count <= old_blocks) {
+        fprintf(stderr, "ext2_resize: the image already has %u blocks and can only grow\n", old_blocks);
+        return EINVAL;
+    }
+
+    groups = (blocks_count - sb->s_first_data_block + bpg - 1) / bpg;
+    if(groups > old_groups) {
+        // Drop the last group if it is too small to hold its own metadata
+        last_blocks = blocks_count - sb->s_first_data_block - (groups - 1) * bpg;
+        overhead = 2 + itable_blocks();
+        if(has_super(groups - 1, sparse))
+            overhead += 1 + gdt_blocks(groups);
+        if(last_blocks <= overhead + 1) {
+            blocks_count -= last_blocks;
+            groups--;
+        }
+    }
+    if(blocks_count <= old_blocks) {
+        fprintf(stderr, "ext2_resize: %s blocks is too few to add a block group\n", argv[2]);
+        return EINVAL;
+    }
+
+    /* Make room for the descriptors of the new groups */
+
+    // The descriptor table sits right before the bitmaps and inode table of every
+    // group with a copy of it, so growing it means moving those out of the way
+    unsigned int old_gdt = gdt_blocks(old_groups);
+    unsigned int new_gdt = gdt_blocks(groups);
+    struct relocation *relocations = NULL;
+    unsigned int group;
+    unsigned int start;
+
+    if(new_gdt > old_gdt) {
+        // Reserved descriptor blocks belong to the resize inode, which is not maintained here
+        if(sb->s_reserved_gdt_blocks != 0) {
+            fprintf(stderr, "ext2_resize: growing past %u groups would need the reserved descriptor blocks\n", \
+                    old_gdt * EXT2_BLOCK_SIZE / (unsigned int)sizeof(struct ext2_group_desc));
+            return ENOSPC;
+        }
+
+        relocations = calloc(old_groups, sizeof(struct relocation));
+        if(relocations == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for(group = 0; group < old_groups; group++) {
+            if(has_super(group, sparse) == 0)
+                continue;
+            start = sb->s_first_data_block + group * bpg;
+            if(plan_relocation(group, start + 1 + old_gdt, start + 1 + new_gdt, &relocations[group]) == -1)
+                return ENOSPC;
+        }
+    }
+
+    /* Extend the backing file and map the new size */
+
+    int image_fd = open(argv[1], O_RDWR);
+    struct stat image_stats;
+
+    if(image_fd == -1 || fstat(image_fd, &image_stats) == -1) {
+        perror(argv[1]);
+        return -1;
+    }
+    // Space past the old end reads as zeros, so new inode tables need no writing
+    if((unsigned long long)blocks_count * EXT2_BLOCK_SIZE > image_stats.st_size) {
+        if(ftruncate(image_fd, (off_t)blocks_count * EXT2_BLOCK_SIZE) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    close_image();
+    if(open_image(argv[1], O_RDWR) == -1) {
+        return -1;
+    }
+
+    if(relocations != NULL) {
+        for(group = 0; group < old_groups; group++) {
+            if(has_super(group, sparse))
+                apply_relocation(group, &relocations[group]);
+        }
+        free(relocations);
+    }
+
+    /* Fill up the old last group */
+
+    unsigned char *bitmap;
+    unsigned int old_size;
+    unsigned int size;
+    unsigned int num;
+
+    group = old_groups - 1;
+    old_size = group_blocks(group);
+    sb->s_blocks_count = blocks_count;
+    num_groups = groups;
+    size = group_blocks(group);
+
+    bitmap = get_block(gd[group].bg_block_bitmap);
+    for(num = old_size + 1; num <= size; num++)
+        clear_bit(bitmap, num);
+    gd[group].bg_free_blocks_count += size - old_size;
+    sb->s_free_blocks_count += size - old_size;
+
+    /* Lay out each new group: [superblock + descriptors] bitmaps, inode table, data */
+
+    unsigned int next;              // next unused block in the group
+    unsigned char bitmaps[2][EXT2_BLOCK_SIZE];  // block and inode bitmap of a new group
+    unsigned int zeroed_end = image_stats.st_size / EXT2_BLOCK_SIZE;  // blocks past here read as zeros
+    int lazy = (sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM) != 0;
+
+    for(group = old_groups; group < groups; group++) {
+        start = sb->s_first_data_block + group * bpg;
+        size = group_blocks(group);
+        next = start;
+        if(has_super(group, sparse))
+            next += 1 + new_gdt;
+
+        memset(&gd[group], 0, sizeof(struct ext2_group_desc));
+        gd[group].bg_block_bitmap = next++;
+        gd[group].bg_inode_bitmap = next++;
+        gd[group].bg_inode_table = next;
+        next += itable_blocks();
+
+        // Block bitmap: metadata in use, bits past the end of the group padded as used
+        memset(bitmaps, 0, sizeof(bitmaps));
+        for(num = 1; num <= next - start; num++)
+            set_to_used(bitmaps[0], num);
+        for(num = size + 1; num <= bpg; num++)
+            set_to_used(bitmaps[0], num);
+
+        // Inode bitmap: bits past the end of the table padded as used
+        for(num = ipg + 1; num <= EXT2_BLOCK_SIZE * 8; num++)
+            set_to_used(bitmaps[1], num);
+
+        // The bitmaps usually land in a hole of the file, where faulting a page
+        // in through the mapping costs far more than writing it
+        if(pwrite(image_fd, bitmaps, sizeof(bitmaps), (off_t)gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE) == -1) {
+            perror("pwrite");
+            return -1;
+        }
+        if(csum_enabled)
+            csum_update(gd[group].bg_block_bitmap, 2, (unsigned char *)bitmaps);
+
+        // A table inside the old file may hold stale data
+        if(gd[group].bg_inode_table < zeroed_end)
+            for(num = 0; num < itable_blocks(); num++)
+                memset(get_block(gd[group].bg_inode_table + num), 0, EXT2_BLOCK_SIZE);
+
+        // With gdt_csum the table is left for allocate_inode to initialize,
+        // just like a lazily formatted group
+        if(lazy)
+            gd[group].bg_itable_unused = ipg;
+        else
+            gd[group].bg_flags |= EXT2_BG_INODE_ZEROED;
+
+        gd[group].bg_free_blocks_count = size - (next - start);
+        gd[group].bg_free_inodes_count = ipg;
+        sb->s_free_blocks_count += gd[group].bg_free_blocks_count;
+        sb->s_free_inodes_count += ipg;
+    }
+
+    close(image_fd);
+
+    /* Update the superblock and write every copy of it and the descriptors */
+
+    struct ext2_super_block *backup;
+
+    sb->s_inodes_count = ipg * groups;
+    sb->s_r_blocks_count = (unsigned long long)sb->s_r_blocks_count * blocks_count / old_blocks;
+
+    for(group = 0; group < groups; group++)
+        update_group_checksum(group);
+
+    for(group = 1; group < groups; group++) {
+        if(has_super(group, sparse) == 0)
+            continue;
+
+        start = sb->s_first_data_block + group * bpg;
+        backup = (struct ext2_super_block *)get_block(start);
+        memcpy(backup, sb, EXT2_BLOCK_SIZE);
+        backup->s_block_group_nr = group;
+        for(num = 0; num < new_gdt; num++)
+            memcpy(get_block(start + 1 + num), (unsigned char *)gd + num * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+    }
+
+    if(sync_image() == -1)
+        return -1;
+
+    printf("Resized %s from %u to %u blocks (%u to %u block groups)\n", \
+            argv[1], old_blocks, blocks_count, old_groups, groups);
+    return 0;
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "ext2_stats.h"
+
+#define MAX_PHASES 16
+#define SUB_BITS 4                          // each power of two is split into 2^SUB_BITS buckets,
+#define SUB_BUCKETS (1 << SUB_BITS)         // so a bucket is at most 1/16 of its values wide
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+#define TRACE_RECORDS (1 << 16)             // records kept in the trace ring
+
+// Wall time spent in one named part of the program
+struct phase {
+    const char *name;
+    double seconds;
+};
+
+// Latencies of one operation in nanoseconds, bucketed like an HDR histogram:
+// exact below SUB_BUCKETS and within 1/16 of the value above that
+struct histogram {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned long long buckets[NUM_BUCKETS];
+};
+
+struct ext2_stats stats;
+int stats_enabled;                  // 1 if EXT2_STATS is set
+int stats_timing;
+
+const char *op_names[NUM_OPS] = {"lookup", "create", "unlink", "alloc_inode", "alloc_block", "block_map"};
+
+static int json;                    // 1 if EXT2_STATS is "json"
+static unsigned long long epoch;    // stats_clock() when stats_init ran
+static struct phase phases[MAX_PHASES];
+static unsigned int num_phases;
+static const char *cur_phase;       // phase the time since phase_start goes to
+static unsigned long long phase_start;
+static struct histogram histograms[NUM_OPS];
+
+static char *trace_name;            // file named by EXT2_TRACE
+static struct trace_record *ring;
+static unsigned long long ring_next;    // records ever added to the ring
+
+// Returns the time in nanoseconds on a clock that only moves forward
+unsigned long long stats_clock() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* From below is the latency histograms and the trace ring */
+
+// Returns the histogram bucket that holds value
+static unsigned int bucket_of(unsigned long long value) {
+
+    int exp;
+
+    if(value < SUB_BUCKETS)
+        return value;
+    exp = 63 - __builtin_clzll(value);
+    return (exp - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Returns the largest value that falls in bucket
+static unsigned long long bucket_high(unsigned int bucket) {
+
+    int shift;
+
+    if(bucket < SUB_BUCKETS)
+        return bucket;
+    shift = bucket / SUB_BUCKETS - 1;
+    return ((unsigned long long)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+// Records an operation of kind op that started at start (from OP_START) and ends now.
+// object is the directory it worked on, or the inode or block it allocated.
+void stats_record(enum ext2_op op, unsigned int object, unsigned long long start) {
+
+    unsigned long long duration = stats_clock() - start;
+    struct histogram *hist = &histograms[op];
+    unsigned long long seen = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    struct trace_record *record;
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total, duration, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[bucket_of(duration)], 1, __ATOMIC_RELAXED);
+    while(duration > seen && \
+            !__atomic_compare_exchange_n(&hist->max, &seen, duration, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if(ring != NULL) {
+        record = &ring[__atomic_fetch_add(&ring_next, 1, __ATOMIC_RELAXED) % TRACE_RECORDS];
+        record->op = op;
+        record->object = object;
+        record->start = start - epoch;
+        record->duration = duration;
+    }
+}
+
+// Returns the smallest latency that at least fraction of the operations in hist did not exceed
+static unsigned long long percentile(struct histogram *hist, double fraction) {
+
+    unsigned long long target = ceil(hist->count * fraction);
+    unsigned long long seen = 0;
+    unsigned int i;
+
+    for(i = 0; i < NUM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if(seen >= target)
+            return bucket_high(i) < hist->max ? bucket_high(i) : hist->max;
+    }
+    return hist->max;
+}
+
+// Writes the trace ring to the file named by EXT2_TRACE, oldest record first.
+// Only uses calls that are safe in a signal handler.
+// Returns 0 on success or -1.
+int stats_dump_trace() {
+
+    unsigned long long next = __atomic_load_n(&ring_next, __ATOMIC_RELAXED);
+    struct trace_header header;
+    unsigned int first;
+    ssize_t size;
+    int fd;
+
+    if(ring == NULL)
+        return 0;
+
+    header.magic = TRACE_MAGIC;
+    header.num_records = next < TRACE_RECORDS ? next : TRACE_RECORDS;
+    header.dropped = next - header.num_records;
+    first = next % TRACE_RECORDS;
+
+    fd = open(trace_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+        return -1;
+    if(write(fd, &header, sizeof(header)) != sizeof(header))
+        goto fail;
+
+    // Once the ring has wrapped, the oldest record is the one the next add overwrites
+    if(header.dropped > 0) {
+        size = (TRACE_RECORDS - first) * sizeof(struct trace_record);
+        if(write(fd, ring + first, size) != size)
+            goto fail;
+    }
+    size = (header.dropped > 0 ? first : header.num_records) * sizeof(struct trace_record);
+    if(write(fd, ring, size) != size)
+        goto fail;
+    return close(fd);
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static void dump_on_signal(int sig) {
+
+    int saved_errno = errno;
+
+    stats_dump_trace();
+    errno = saved_errno;
+}
+
+static void dump_at_exit() {
+
+    if(stats_dump_trace() == -1)
+        perror(trace_name);
+}
+
+/* From below is the report */
+
+// Adds seconds to the phase called name.
+// A phase entered more than once gets the time from every visit.
+static void add_time(const char *name, double seconds) {
+
+    unsigned int i;
+
+    for(i = 0; i < num_phases; i++) {
+        if(strcmp(phases[i].name, name) == 0) {
+            phases[i].seconds += seconds;
+            return;
+        }
+    }
+    if(num_phases < MAX_PHASES) {
+        phases[num_phases].name = name;
+        phases[num_phases].seconds = seconds;
+        num_phases++;
+    }
+}
+
+// Prints the latencies of every operation that ran, in JSON or as a table
+static void report_latencies() {
+
+    static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+    struct histogram *hist;
+    int first = 1;
+    int op;
+    int i;
+
+    for(op = 0; op < NUM_OPS; op++) {
+        hist = &histograms[op];
+        if(hist->count == 0)
+            continue;
+
+        if(json) {
+            fprintf(stderr, "%s\"%s\": {\"count\": %llu, \"mean\": %llu", first ? "" : ", ", op_names[op], \
+                    hist->count, hist->total / hist->count);
+            for(i = 0; i < 4; i++)
+                fprintf(stderr, ", \"%s\": %llu", labels[i], percentile(hist, fractions[i]));
+            fprintf(stderr, ", \"max\": %llu}", hist->max);
+        }
+        else {
+            if(first)
+                fprintf(stderr, "  %-20s %10s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", \
+                        "p50", "p90", "p99", "p99.9", "max");
+            fprintf(stderr, "  %-20s %10llu %10.1f", op_names[op], hist->count, hist->total / hist->count / 1e3);
+            for(i = 0; i < 4; i++)
+                fprintf(stderr, " %10.1f", percentile(hist, fractions[i]) / 1e3);
+            fprintf(stderr, " %10.1f\n", hist->max / 1e3);
+        }
+        first = 0;
+    }
+}
+
+// Prints the counters, the phases and the latencies to standard error
+static void stats_report() {
+
+    static const char *names[] = {"bits_probed", "entries_visited", "blocks_touched", "blocks_read", \
+                                  "blocks_written", "inodes_touched", "path_components"};
+    unsigned long long values[] = {stats.bits_probed, stats.entries_visited, stats.blocks_touched, \
+                                   stats.blocks_read, stats.blocks_written, stats.inodes_touched, \
+                                   stats.path_components};
+    unsigned int i;
+
+    stats_phase(NULL);
+
+    if(json) {
+        fprintf(stderr, "{\"program\": \"%s\"", program_invocation_short_name);
+        for(i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+            fprintf(stderr, ", \"%s\": %llu", names[i], values[i]);
+        fprintf(stderr, ", \"phases\": {");
+        for(i = 0; i < num_phases; i++)
+            fprintf(stderr, "%s\"%s\": %.6f", i > 0 ? ", " : "", phases[i].name, phases[i].seconds);
+        fprintf(stderr, "}, \"latency_ns\": {");
+        report_latencies();
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%s stats:\n", program_invocation_short_name);
+    for(i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        fprintf(stderr, "  %-20s %llu\n", names[i], values[i]);
+    for(i = 0; i < num_phases; i++)
+        fprintf(stderr, "  phase %-14s %.6f s\n", phases[i].name, phases[i].seconds);
+    report_latencies();
+}
+
+// Turns the counters on if EXT2_STATS is set, and the trace ring if
+// EXT2_TRACE names a file to write it to at exit and on SIGUSR1.
+// Called by open_image before it registers close_image, so the report
+// comes after the changes are written back and includes that time.
+void stats_init() {
+
+#ifndef EXT2_NO_STATS
+    static int initialized = 0;
+    char *mode = getenv("EXT2_STATS");
+    struct sigaction action;
+
+    if(initialized)
+        return;
+    initialized = 1;
+    epoch = phase_start = stats_clock();
+
+    trace_name = getenv("EXT2_TRACE");
+    if(trace_name != NULL && trace_name[0] != '\0') {
+        ring = calloc(TRACE_RECORDS, sizeof(struct trace_record));
+        if(ring == NULL) {
+            perror("calloc");
+            exit(ENOMEM);
+        }
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = dump_on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        atexit(dump_at_exit);
+        stats_timing = 1;
+    }
+
+    if(mode == NULL || mode[0] == '\0')
+        return;
+    json = strcmp(mode, "json") == 0;
+    stats_enabled = 1;
+    stats_timing = 1;
+    atexit(stats_report);
+#endif
+}
+
+// Ends the current phase and starts one called name, which must stay valid
+// until exit. NULL ends the current phase without starting another.
+void stats_phase(const char *name) {
+
+    unsigned long long t;
+
+    if(stats_enabled == 0)
+        return;
+    t = stats_clock();
+    if(cur_phase != NULL)
+        add_time(cur_phase, (t - phase_start) / 1e9);
+    cur_phase = name;
+    phase_start = t;
+}
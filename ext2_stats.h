@@ -0,0 +1,84 @@
+#ifndef __EXT2_STATS_H__
+#define __EXT2_STATS_H__
+
+// Counters and latency histograms kept by the helper layer. When EXT2_STATS
+// is set they are printed to standard error as the program exits, as JSON if
+// it is set to "json" and as text otherwise. Building with -DEXT2_NO_STATS
+// leaves them out altogether.
+struct ext2_stats {
+    unsigned long long bits_probed;         // bitmap bits looked at while allocating
+    unsigned long long entries_visited;     // directory entries stepped over
+    unsigned long long blocks_touched;      // blocks looked up through get_block
+    unsigned long long blocks_read;         // blocks copied by read_blocks
+    unsigned long long blocks_written;      // blocks copied by write_blocks
+    unsigned long long inodes_touched;      // inodes looked up through get_inode
+    unsigned long long path_components;     // names resolved by pathwalk
+};
+
+// Helper operations whose latency is kept in a histogram
+enum ext2_op {
+    OP_LOOKUP,          // search_directory
+    OP_CREATE,          // add_new_entry
+    OP_UNLINK,          // remove_entry
+    OP_ALLOC_INODE,     // allocate_inode
+    OP_ALLOC_BLOCK,     // allocate_block and find_free_run
+    OP_BLOCK_MAP,       // a block map walk from block_iter_init to its end,
+                        // including what the caller does between runs
+    NUM_OPS
+};
+
+#define TRACE_MAGIC 0x43525432      // "2TRC"
+
+// Start of a trace file written when EXT2_TRACE names one. The newest
+// num_records records follow it, oldest first; dropped older ones were
+// overwritten in the ring before the file was written.
+struct trace_header {
+    unsigned int magic;
+    unsigned int num_records;
+    unsigned long long dropped;
+};
+
+// One timed operation. Times are in nanoseconds since the program started.
+struct trace_record {
+    unsigned int op;                // an enum ext2_op
+    unsigned int object;            // directory inode, or the inode or block allocated
+    unsigned long long start;
+    unsigned long long duration;
+};
+
+extern struct ext2_stats stats;
+extern int stats_enabled;
+extern int stats_timing;            // 1 if operations are timed (EXT2_STATS or EXT2_TRACE)
+extern const char *op_names[NUM_OPS];
+
+#ifdef EXT2_NO_STATS
+#define STAT_ADD(counter, n) ((void)0)
+#else
+// Threads may count at the same time (see ext2_find), so the adds are atomic
+#define STAT_ADD(counter, n) do { \
+        if(__builtin_expect(stats_enabled, 0)) \
+            __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED); \
+    } while(0)
+#endif
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+
+// OP_START gives the time an operation starts, or 0 if nothing is timed,
+// and OP_END records it once the operation is over
+#ifdef EXT2_NO_STATS
+#define OP_START() 0ULL
+#define OP_END(op, object, start) ((void)(start))
+#else
+#define OP_START() (__builtin_expect(stats_timing, 0) ? stats_clock() : 0ULL)
+#define OP_END(op, object, start) do { \
+        if(start) \
+            stats_record((op), (object), (start)); \
+    } while(0)
+#endif
+
+void stats_init();
+void stats_phase(const char *name);
+unsigned long long stats_clock();
+void stats_record(enum ext2_op op, unsigned int object, unsigned long long start);
+int stats_dump_trace();
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ext2_stats.h"
+
+// Puts the slowest operations first
+static int compare_duration(const void *a, const void *b) {
+
+    unsigned long long x = ((struct trace_record *)a)->duration;
+    unsigned long long y = ((struct trace_record *)b)->duration;
+    return (x < y) - (x > y);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    unsigned int limit = 0;     // -n: only print this many of the slowest operations
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        if(opt == 'n')
+            limit = strtoul(optarg, NULL, 10);
+        else
+            optind = argc + 1;
+    }
+
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: ext2_trace [-n count] <trace file name>\n");
+        return EINVAL;
+    }
+
+    /* Read the records written through EXT2_TRACE */
+
+    FILE *trace = fopen(argv[optind], "r");
+    struct trace_header header;
+    struct trace_record *records;
+    unsigned int n;
+    unsigned int i;
+
+    if(trace == NULL) {
+        perror(argv[optind]);
+        return ENOENT;
+    }
+    if(fread(&header, sizeof(header), 1, trace) != 1 || header.magic != TRACE_MAGIC) {
+        fprintf(stderr, "ext2_trace: %s is not a trace file\n", argv[optind]);
+        return EINVAL;
+    }
+
+    records = malloc((header.num_records + 1) * sizeof(struct trace_record));
+    if(records == NULL) {
+        perror("malloc");
+        return ENOMEM;
+    }
+    n = fread(records, sizeof(struct trace_record), header.num_records, trace);
+    if(n != header.num_records)
+        fprintf(stderr, "ext2_trace: %s is truncated, read %u of %u records\n", argv[optind], n, header.num_records);
+
+    /* Print them in the order they started, or the slowest first with -n */
+
+    if(limit > 0) {
+        qsort(records, n, sizeof(struct trace_record), compare_duration);
+        if(limit < n)
+            n = limit;
+    }
+
+    if(header.dropped > 0)
+        printf("# %llu older operations were dropped\n", header.dropped);
+    printf("# %12s %12s %-12s %10s\n", "start (us)", "time (us)", "operation", "object");
+    for(i = 0; i < n; i++) {
+        printf("  %12.1f %12.1f %-12s %10u\n", records[i].start / 1e3, records[i].duration / 1e3, \
+               records[i].op < NUM_OPS ? op_names[records[i].op] : "?", records[i].object);
+    }
+    return 0;
+}
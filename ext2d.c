@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_ops.h"
+#include "ext2_client.h"
+
+#define MAX_CLIENTS 64          // connections served at once
+#define CHECKPOINT_OPS 256      // requests between checkpoints, to bound the block cache
+#define IDLE_SYNC_MS 1000       // changes reach the image file once no request came for this long
+#define READ_SIZE 65536         // bytes read from a connection at a time
+
+// A connection and the bytes waiting on either side of it
+struct client {
+    int fd;
+    unsigned char *in;          // received bytes not handled yet
+    size_t in_len;
+    size_t in_cap;
+    unsigned char *out;         // replies not sent yet
+    size_t out_len;
+    size_t out_sent;            // bytes of out already sent
+    size_t out_cap;
+};
+
+static struct client clients[MAX_CLIENTS];
+static unsigned int num_clients;
+static struct stat image_stats;             // tells if EXT2D_OPEN names the image being served
+static unsigned int requests;               // requests since the last checkpoint
+static int unsynced;                        // 1 if changes have not reached the image file yet
+static volatile sig_atomic_t stopping;      // 1 once SIGINT or SIGTERM came
+
+// Path and argument of the request being handled, with a terminating '\0'
+static char req_path[USHRT_MAX + 1];
+static char req_arg[USHRT_MAX + 1];
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+// Makes room for size more bytes after the len bytes of *buf
+static void grow(unsigned char **buf, size_t len, size_t *cap, size_t size) {
+
+    size_t new_cap = *cap == 0 ? READ_SIZE : *cap;
+
+    if(len + size <= *cap)
+        return;
+    while(new_cap < len + size)
+        new_cap *= 2;
+    *buf = realloc(*buf, new_cap);
+    if(*buf == NULL) {
+        perror("realloc");
+        exit(ENOMEM);
+    }
+    *cap = new_cap;
+}
+
+// Appends size bytes of data to the replies waiting for c
+static void append(struct client *c, const void *data, size_t size) {
+
+    grow(&c->out, c->out_len, &c->out_cap, size);
+    memcpy(c->out + c->out_len, data, size);
+    c->out_len += size;
+}
+
+// Adds the reply to request id, with size bytes of data
+static void reply(struct client *c, unsigned int id, int result, const void *data, unsigned int size) {
+
+    struct ext2d_reply rep;
+
+    memset(&rep, 0, sizeof(rep));
+    rep.id = id;
+    rep.result = result;
+    rep.size = size;
+    append(c, &rep, sizeof(rep));
+    append(c, data, size);
+}
+
+// Adds the reply to request id with the entries of the directory at path
+static void list_directory(struct client *c, unsigned int id, char *path) {
+
+    int inum = pathwalk(path);
+    struct ext2_inode *inode;
+    struct ext2_dir_entry *cur_entry;
+    struct ext2d_entry entry;
+    struct ext2d_reply rep;
+    size_t start = c->out_len;                  // where the reply starts in out
+    unsigned int cur_block_idx = 0;
+    unsigned int cur_block_offset = 0;
+
+    if(inum <= 0) {
+        reply(c, id, ENOENT, NULL, 0);
+        return;
+    }
+    inode = get_inode(inum);
+    if((inode->i_mode & EXT2_IMODE_MASK) != EXT2_S_IFDIR) {
+        reply(c, id, ENOTDIR, NULL, 0);
+        return;
+    }
+
+    // The entries go after the reply, which gets their size once they are all in
+    memset(&rep, 0, sizeof(rep));
+    rep.id = id;
+    append(c, &rep, sizeof(rep));
+
+    memset(&entry, 0, sizeof(entry));
+    cur_entry = (struct ext2_dir_entry *)get_block(inode->i_block[0]);
+    while(cur_entry != NULL) {
+        if(cur_entry->inode != 0) {
+            entry.inode = cur_entry->inode;
+            entry.name_len = cur_entry->name_len;
+            entry.file_type = cur_entry->file_type;
+            append(c, &entry, sizeof(entry));
+            append(c, cur_entry->name, cur_entry->name_len);
+        }
+        cur_entry = move_entry(cur_entry, inum, &cur_block_idx, &cur_block_offset);
+    }
+    rep.size = c->out_len - start - sizeof(rep);
+    memcpy(c->out + start, &rep, sizeof(rep));
+}
+
+// Carries out one request from c and adds its reply
+static void handle_request(struct client *c, struct ext2d_request *req, const unsigned char *data) {
+
+    struct stat path_stats;
+    struct ext2d_stat st;
+    struct ext2_file *file;
+    ssize_t written;
+    unsigned int count;
+    int inum;
+    int rv;
+
+    // Every operation on a file takes an absolute path on the disk
+    if(req->op != EXT2D_OPEN && req->op != EXT2D_CHECK && req->op != EXT2D_SYNC && req_path[0] != '/') {
+        reply(c, req->id, ENOENT, NULL, 0);
+        return;
+    }
+
+    switch(req->op) {
+    case EXT2D_OPEN:
+        rv = stat(req_path, &path_stats) == 0 && path_stats.st_dev == image_stats.st_dev && \
+             path_stats.st_ino == image_stats.st_ino ? 0 : ENXIO;
+        reply(c, req->id, rv, NULL, 0);
+        return;
+
+    case EXT2D_LOOKUP:
+        inum = pathwalk(req_path);
+        if(inum <= 0)
+            reply(c, req->id, ENOENT, NULL, 0);
+        else
+            reply(c, req->id, 0, &inum, sizeof(inum));
+        return;
+
+    case EXT2D_STAT:
+        inum = pathwalk(req_path);
+        if(inum <= 0) {
+            reply(c, req->id, ENOENT, NULL, 0);
+            return;
+        }
+        st.inum = inum;
+        st.inode = *get_inode(inum);
+        reply(c, req->id, 0, &st, sizeof(st));
+        return;
+
+    case EXT2D_LIST:
+        list_directory(c, req->id, req_path);
+        return;
+
+    case EXT2D_CREATE:
+        rv = ext2_copy(req_path, req_arg, data, req->size);
+        break;
+
+    case EXT2D_WRITE:
+        count = 0;
+        file = ext2_open(req_path, O_RDWR);
+        if(file == NULL) {
+            rv = errno;
+        }
+        else {
+            written = ext2_pwrite(file, data, req->size, req->offset);
+            rv = written == -1 ? errno : 0;
+            count = written == -1 ? 0 : written;
+            ext2_close(file);
+        }
+        reply(c, req->id, rv, &count, sizeof(count));
+        unsynced = 1;
+        return;
+
+    case EXT2D_MKDIR:
+        rv = strcmp(req_path, "/") == 0 ? EEXIST : ext2_mkdir(req_path);
+        break;
+
+    case EXT2D_LINK:
+    case EXT2D_SYMLINK:
+        rv = req_arg[0] != '/' ? ENOENT : ext2_link(req_arg, req_path, req->op == EXT2D_SYMLINK);
+        break;
+
+    case EXT2D_UNLINK:
+        rv = ext2_unlink(req_path);
+        break;
+
+    case EXT2D_RESTORE:
+        rv = ext2_restore(req_path);
+        break;
+
+    case EXT2D_CHECK:
+        rv = check_free_counts(NULL);
+        if(rv == -1) {
+            reply(c, req->id, ENOMEM, NULL, 0);
+            return;
+        }
+        rv += check_directory(2);
+        reply(c, req->id, 0, &rv, sizeof(rv));
+        unsynced = 1;
+        return;
+
+    case EXT2D_SYNC:
+        rv = sync_image() == -1 ? EIO : 0;
+        if(rv == 0)
+            unsynced = 0;
+        reply(c, req->id, rv, NULL, 0);
+        return;
+
+    default:
+        reply(c, req->id, EINVAL, NULL, 0);
+        return;
+    }
+
+    reply(c, req->id, rv, NULL, 0);
+    unsynced = 1;
+}
+
+// Carries out every request c has sent in full
+static void handle_requests(struct client *c) {
+
+    struct ext2d_request req;
+    size_t pos = 0;             // start of the next request in in
+    size_t len;
+
+    while(c->in_len - pos >= sizeof(req)) {
+        memcpy(&req, c->in + pos, sizeof(req));
+        len = sizeof(req) + req.path_len + req.arg_len + (size_t)req.size;
+        if(c->in_len - pos < len) {
+            // Make room for the rest of it at once
+            grow(&c->in, c->in_len, &c->in_cap, pos + len - c->in_len);
+            break;
+        }
+
+        memcpy(req_path, c->in + pos + sizeof(req), req.path_len);
+        req_path[req.path_len] = '\0';
+        memcpy(req_arg, c->in + pos + sizeof(req) + req.path_len, req.arg_len);
+        req_arg[req.arg_len] = '\0';
+        handle_request(c, &req, c->in + pos + sizeof(req) + req.path_len + req.arg_len);
+        pos += len;
+
+        // Pointers into the image are not kept from one request to the next,
+        // and lookups fill the cache as well as changes do
+        if(++requests >= CHECKPOINT_OPS) {
+            if(checkpoint_image() == -1)
+                stopping = 1;
+            requests = 0;
+        }
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+// Sends as many of the replies waiting for c as the socket takes.
+// Returns 0 on success or -1 if the connection failed.
+static int send_replies(struct client *c) {
+
+    ssize_t sent;
+
+    while(c->out_sent < c->out_len) {
+        sent = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if(sent == -1 && errno == EINTR)
+            continue;
+        if(sent == -1 && errno == EAGAIN)
+            return 0;
+        if(sent <= 0)
+            return -1;
+        c->out_sent += sent;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    return 0;
+}
+
+// Reads what c has sent and answers the requests that are complete.
+// Returns 0 on success or -1 if the connection was closed or failed.
+static int serve(struct client *c) {
+
+    ssize_t got;
+
+    grow(&c->in, c->in_len, &c->in_cap, READ_SIZE);
+    got = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if(got == -1 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if(got <= 0)
+        return -1;
+    c->in_len += got;
+
+    handle_requests(c);
+    return send_replies(c);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Check if arguments are valid */
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: ext2d <image file name> <socket path>\n");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    struct stat socket_stats;
+
+    if(strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path is too long\n", argv[2]);
+        return ENAMETOOLONG;
+    }
+
+    /* Intiailize disk and other structures */
+
+    if(open_image(argv[1], O_RDWR) == -1) {
+        return -1;
+    }
+    if(stat(argv[1], &image_stats) == -1) {
+        perror(argv[1]);
+        return -1;
+    }
+
+    /* Listen on the socket, replacing one left behind by an ext2d that did not stop cleanly */
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if(lstat(argv[2], &socket_stats) == 0 && S_ISSOCK(socket_stats.st_mode))
+        unlink(argv[2]);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[2]);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, MAX_CLIENTS) == -1) {
+        perror(argv[2]);
+        return -1;
+    }
+
+    // Stopping closes the image like any tool does when it exits
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Serve requests until stopped */
+
+    struct pollfd fds[MAX_CLIENTS + 1];
+    unsigned int i;
+    unsigned int kept;
+    int ready;
+    int fd;
+
+    while(stopping == 0) {
+        fds[0].fd = num_clients < MAX_CLIENTS ? listen_fd : -1;
+        fds[0].events = POLLIN;
+        for(i = 0; i < num_clients; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN | (clients[i].out_len > 0 ? POLLOUT : 0);
+        }
+
+        ready = poll(fds, num_clients + 1, unsynced ? IDLE_SYNC_MS : -1);
+        if(ready == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        // Nothing came for a while, so write the changes out
+        if(ready == 0) {
+            if(sync_image() == -1)
+                break;
+            unsynced = 0;
+            continue;
+        }
+
+        for(i = 0; i < num_clients; i++) {
+            if((fds[i + 1].revents & POLLOUT && send_replies(&clients[i]) == -1) || \
+                    (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR) && serve(&clients[i]) == -1)) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+
+        // Forget closed connections
+        for(i = 0, kept = 0; i < num_clients; i++) {
+            if(clients[i].fd != -1) {
+                clients[kept++] = clients[i];
+            }
+            else {
+                free(clients[i].in);
+                free(clients[i].out);
+            }
+        }
+        num_clients = kept;
+
+        if(fds[0].revents & POLLIN) {
+            fd = accept(listen_fd, NULL, NULL);
+            if(fd != -1) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&clients[num_clients], 0, sizeof(struct client));
+                clients[num_clients++].fd = fd;
+            }
+        }
+    }
+
+    close(listen_fd);
+    unlink(argv[2]);
+    return 0;
+}